@@ -8,8 +8,25 @@
 #include <unistd.h>
 #include <time.h>
 #include <sys/time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #define BUF_SIZE 65535
+//一个域名最多127段（255字节的域名每段至少1字节加1字节长度）
+#define MAX_LABELS 128
+//读一个域名时最多跟几次压缩指针，再多就当作格式错误
+#define MAX_COMPRESSION_HOPS 32
+
+//压测模式的默认参数
+#define BENCH_DEFAULT_INFLIGHT 100
+#define BENCH_DEFAULT_DURATION 10
+#define BENCH_DEFAULT_TIMEOUT_MS 2000
+#define BENCH_MAX_CONNECTIONS 256
+//同时在途的查询最多这么多个，ID只有16位，要留一些给刚超时的查询，免得迟到的回复被算到新查询头上
+#define BENCH_MAX_INFLIGHT 32768
 
 // Resource Record Types
 #define A_Resource_RecordType 1
@@ -279,120 +296,103 @@ unsigned char* domainStr2DomainBytes(unsigned char* domain) {
     i += len;
     buf[i] = 0;
 
-    return strdup(buf);
+    beg = strdup(buf);
+    free(buf);
+    return beg;
 }
 
 
-//将字节码倒置后转换为DomainName结构体链表
-//倒置是因为在比较域名是否匹配时，需要从后段开始匹配
-//如北邮.教育.中国，需要先看中国，再看教育，最后看北邮，所以不如存成结构体的时候就倒过来存，方便比较
-//参数中的header是用于解压域名中的压缩指针的
-//因为压缩指针是指向某个域名第一次出现时相对于header的位置偏移，所以需要header的地址来做参照
-//压缩指针是一段两个字节长的内容，其中前两个bit是1，后面是长度，如果只有前两个bit是1，后面都是0的话，那么就是c000，
-//一般长度不会特别长，所以往往压缩指针是c0xx这样的。
-//另外，记得这种实现方式不支持嵌套指针。
-struct DomainName* domainBytes2DomainStructureFromPacket(uint8_t** buffer, uint8_t* header) {
-    uint8_t* buf = *buffer;
-    int i, j, first;
-    uint8_t len = 0;
-    struct DomainName* name = NULL;
-    name = malloc(sizeof(struct DomainName));
-    memset(name, 0, sizeof(struct DomainName));
-    struct DomainName* head = name;//最终返回的是这个head，因为过程中name在变
-    unsigned char* nameStr;
-
-    //用于将字节码反转的变量
-    uint8_t* bufNew;
-    uint8_t** reverse;
-    uint8_t lenReverse;
-    uint8_t* tempReverse;
-    int lenNew;
-    reverse = (uint8_t**)malloc(sizeof(uint8_t*) * BUF_SIZE);
-
-    //用于解压缩的变量
-    uint8_t* bufExpress;
-    int compressPointer = 0;//用来存储压缩指针，注意这个压缩指针不是C语言中的指针而是DNS的指针，它是一个相对于header首字节的位置偏移，所以用int类型存储就可以了
-    uint8_t* copyPointer;//用来存储接下来该读内存的哪里的指针
-    bufExpress = malloc(sizeof(uint8_t)*BUF_SIZE);
-    memset(bufExpress, 0, sizeof(uint8_t)*BUF_SIZE);
-    int bufferMoved = 0;//用来记录buffer到底移动了多少，在别的函数中你读取了多少字节buffer就应该移动多少字节，但是在压缩指针这里，一旦遇到压缩指针，buffer的位移就跟读取的字节数不相等了
-    int bufExpressLen = 0;//记录buf_express到底读了多长，也就用于最后给末尾补0
-
-    copyPointer = buf;
-
-    //开始解压缩
-    i = 0;
-    while (copyPointer[i]!=0) {
-        if (copyPointer[i]>=0xc0) {//大于c0则此处和下一个字节加起来是一个指针
-            compressPointer = copyPointer[i]*(16*16)+copyPointer[i+1]-0xc0*(16*16);//16*16是位移两个字节
-            copyPointer = header + compressPointer;
-            bufferMoved += i + 2;//2为压缩指针的字节数，这种写法只适合没有嵌套指针的情况
-            i = 0;//因为copyPointer变了，又得从那个指针位置之后的0点开始读起了所以需要把i重置为0
+//读packet里从offset开始的一个域名，把每一段的长度字节在packet里的位置按顺序写进labels，返回段数
+//压缩指针是一段两个字节长的内容，前两个bit是1，后面14位是相对于header的位置偏移，
+//指过去的地方可能又是几段加一个压缩指针，所以要一直跟下去，直到遇到结尾的0
+//指针只能往前指，而且最多跟MAX_COMPRESSION_HOPS次，这样互相指来指去的报文也不会让这里死循环
+//end写上域名在原位置之后的偏移，也就是下一个字段的开始
+//越界、指针往后指、域名超过255字节都返回-1
+int readNameLabels(uint8_t* header, int len, int offset, unsigned short* labels, int* end) {
+    int count = 0, hops = 0, total = 1, pointer;
+
+    *end = -1;
+    while (1) {
+        if (offset >= len)
+            return -1;
+        if (header[offset] == 0) {
+            if (*end < 0)
+                *end = offset + 1;
+            return count;
         }
-        len = copyPointer[i];
-        memcpy(bufExpress+bufExpressLen,copyPointer+i,1);
-        i++;
-        bufExpressLen++;
-        memcpy(bufExpress+bufExpressLen,copyPointer+i,len);
-        i += len;
-        bufExpressLen += len;
+        if ((header[offset] & 0xc0) == 0xc0) {
+            if (offset + 1 >= len || ++hops > MAX_COMPRESSION_HOPS)
+                return -1;
+            pointer = ((header[offset] & 0x3f) << 8) | header[offset + 1];
+            if (pointer >= offset)
+                return -1;
+            if (*end < 0)
+                *end = offset + 2;//只有第一个指针决定buffer要往后移多少
+            offset = pointer;
+            continue;
+        }
+        if ((header[offset] & 0xc0) != 0 || count >= MAX_LABELS)
+            return -1;//01和10开头的是扩展标签，不支持
+        total += header[offset] + 1;
+        if (total > 255 || offset + 1 + header[offset] > len)
+            return -1;
+        labels[count++] = offset;
+        offset += header[offset] + 1;
     }
-    bufExpress[bufExpressLen] = 0;
+}
 
-    //开始反向存储，即字节码6北邮6教育6中国->6中国6教育6北邮，
-    //反向存储就是先分段存一个数组里，再倒过来从这个数组里取拼成一个字符串
-    bufNew = malloc(sizeof(uint8_t)*(strlen(bufExpress)+1));//因为strlen计算出的长度不包括最后的0所以需要+1
-    memset(bufNew, 0, sizeof(uint8_t)*(strlen(bufExpress)+1));
-    i = 0;
-    j = 0;
-    while (bufExpress[i] != 0) {
-        lenReverse = bufExpress[i];
-        tempReverse = malloc(sizeof(uint8_t)*(lenReverse+1+1));//开头的长度和结尾的\0
-        memset(tempReverse, 0, sizeof(uint8_t)*(lenReverse+1+1));
-        tempReverse[0] = bufExpress[i];
-        i++;
-        memcpy(tempReverse + 1, bufExpress + i, lenReverse);
-        reverse[j] = tempReverse;
-        i += lenReverse;
-        j++;
+//从packet里读出一个域名，直接存成倒序的DomainName链表，并把buffer移到域名后面
+//如北邮.教育.中国，需要先看中国，再看教育，最后看北邮，所以存成结构体的时候就倒过来存，方便比较
+//按报文里的顺序每读到一段就插到链表最前面，读完自然就是倒序的，不需要先解压再反转
+//header是报文的开头，len是报文的长度，格式错误返回NULL
+struct DomainName* domainBytes2DomainStructureFromPacket(uint8_t** buffer, uint8_t* header, int len) {
+    unsigned short labels[MAX_LABELS];
+    struct DomainName* head = NULL;
+    struct DomainName* name;
+    int count, end, i;
+
+    count = readNameLabels(header, len, *buffer - header, labels, &end);
+    if (count < 0)
+        return NULL;
+    for (i = 0; i < count; i++) {
+        name = malloc(sizeof(struct DomainName));
+        name->len = header[labels[i]];
+        name->name = malloc(sizeof(unsigned char)*(name->len+1));
+        memcpy(name->name, header + labels[i] + 1, name->len);
+        name->name[name->len] = '\0';
+        name->next = head;
+        head = name;
     }
-
-    lenNew = 0;
-    for(i = j - 1; i >= 0; i--) {
-        memcpy(bufNew + lenNew, reverse[i], strlen(reverse[i]));
-        lenNew += strlen(reverse[i]);
+    if (head == NULL) {
+        //根域名，和以前一样用一个空的段表示
+        head = malloc(sizeof(struct DomainName));
+        memset(head, 0, sizeof(struct DomainName));
     }
+    *buffer = header + end;
+    return head;
+}
 
-    //开始将字节码存成链表
-    first = 1;
-    i = 0;
-    while (bufNew[i] != 0) {
-        if (!first) {
-            name->next = malloc(sizeof(struct DomainName));
-            memset(name->next, 0, sizeof(struct DomainName));
-            name = name->next;
-        }
-        first = 0;
-        len = bufNew[i];
-        i++;
-        nameStr = malloc(sizeof(unsigned char)*(len+1));
-        memset(nameStr, 0, sizeof(unsigned char)*(len+1));
-        memcpy(nameStr, bufNew+i, len);
-        nameStr[len] = '\0';
-        name->name = nameStr;
-        name->len = len;
-        i += len;
+//MX、CNAME这些rdata里的域名，从packet里读出来直接解压成6北邮6教育6中国0的字节码，并把buffer移到域名后面
+//格式错误返回NULL
+unsigned char* domainBytesFromPacket(uint8_t** buffer, uint8_t* header, int len) {
+    unsigned short labels[MAX_LABELS];
+    unsigned char* bytes;
+    int count, end, i, pos = 0;
+
+    count = readNameLabels(header, len, *buffer - header, labels, &end);
+    if (count < 0)
+        return NULL;
+    bytes = malloc(sizeof(unsigned char)*256);//域名最长255字节
+    for (i = 0; i < count; i++) {
+        memcpy(bytes + pos, header + labels[i], header[labels[i]] + 1);
+        pos += header[labels[i]] + 1;
     }
-    if (bufferMoved!=0)
-        *buffer += bufferMoved;
-    else
-        *buffer += i + 1; //+1为最后的0
-
-    name->next = NULL;
-    return head;
+    bytes[pos] = 0;
+    *buffer = header + end;
+    return bytes;
 }
 
-//跟上面那个函数基本一样，区别是输入源是一段字符串因此不需要移动buffer，而且肯定不会遇到压缩指针
+//将字节码倒置后转换为DomainName结构体链表，输入源是一段字符串因此不需要移动buffer，而且肯定不会遇到压缩指针
 struct DomainName* domainBytes2DomainStructureFromStr(uint8_t* buffer) {
     uint8_t* buf = buffer;
     int i, j, first;
@@ -749,67 +749,85 @@ void writeHeader(struct Message* msg, uint8_t** buffer) {
 }
 
 
-void readSection(struct Message* msg, uint8_t** buffer, int section, unsigned short count, uint8_t* header) {
-    if (count<=0)
-        return;
+//读一个部分的count条记录，格式错误返回-1
+int readSection(struct Message* msg, uint8_t** buffer, int section, unsigned short count, uint8_t* header, int len) {
     int i,j;
     struct ResourceRecord* rr;
+    uint8_t* rdata;
     for (i = 0; i < count; ++i) {
         rr = malloc(sizeof(struct ResourceRecord));
         memset(rr, 0, sizeof(struct ResourceRecord));
-        rr->name = domainBytes2DomainStructureFromPacket(buffer, header);
+        //先挂到链表上，出错时也能跟着整个msg一起释放
+        if (section == 1) {
+            rr->next = msg->answers;
+            msg->answers = rr;
+        }
+        else if (section == 2) {
+            rr->next = msg->authorities;
+            msg->authorities = rr;
+        }
+        else if (section == 3) {
+            rr->next = msg->additionals;
+            msg->additionals = rr;
+        }
+        rr->name = domainBytes2DomainStructureFromPacket(buffer, header, len);
+        if (rr->name == NULL || *buffer + 10 > header + len)
+            return -1;
         rr->type = get16bits(buffer);
         rr->class = get16bits(buffer);
         rr->ttl = get32bits(buffer);
         rr->rd_length = get16bits(buffer);
+        rdata = *buffer;
+        if (rdata + rr->rd_length > header + len)
+            return -1;
         switch (rr->type) {
             case A_Resource_RecordType:
+                if (rr->rd_length != 4)
+                    return -1;
                 for(j = 0; j < 4; ++j)
                     rr->rd_data.a_record.addr[j] = get8bits(buffer);
                 break;
 
             case MX_Resource_RecordType:
+                if (rr->rd_length < 3)
+                    return -1;
                 rr->rd_data.mx_record.preference = get16bits(buffer);
-                rr->rd_data.mx_record.exchange = domainStructure2DomainBytes(
-                        domainBytes2DomainStructureFromPacket(buffer, header));
+                rr->rd_data.mx_record.exchange = domainBytesFromPacket(buffer, header, rdata - header + rr->rd_length);
+                if (rr->rd_data.mx_record.exchange == NULL)
+                    return -1;
                 break;
 
             case CNAME_Resource_RecordType:
-                rr->rd_data.cname_record.name = domainStructure2DomainBytes(
-                        domainBytes2DomainStructureFromPacket(buffer, header));
+                rr->rd_data.cname_record.name = domainBytesFromPacket(buffer, header, rdata - header + rr->rd_length);
+                if (rr->rd_data.cname_record.name == NULL)
+                    return -1;
                 break;
 
             default:
                 fprintf(stderr, "未知类型 %u, 忽略\n", rr->type);
                 break;
         }
-        if (section == 1) {
-            rr->next = msg->answers;
-            msg->answers = rr;
-        }
-        else if (section == 2) {
-            rr->next = msg->authorities;
-            msg->authorities = rr;
-        }
-        else if (section == 3) {
-            rr->next = msg->additionals;
-            msg->additionals = rr;
-        }
+        *buffer = rdata + rr->rd_length;//不认识的类型也按rd_length跳过rdata
     }
+    return 0;
 }
 
-void readQuestion(struct Message* msg, uint8_t** buffer, uint8_t* header) {
+//读所有的问题，格式错误返回-1
+int readQuestion(struct Message* msg, uint8_t** buffer, uint8_t* header, int len) {
     int i;
     for (i = 0; i < msg->qCount; ++i) {
         struct Question* q;
         q = malloc(sizeof(struct Question));
         memset(q, 0, sizeof(struct Question));
-        q->name = domainBytes2DomainStructureFromPacket(buffer, header);
-        q->type = get16bits(buffer);
-        q->class = get16bits(buffer);
         q->next = msg->questions;
         msg->questions = q;
+        q->name = domainBytes2DomainStructureFromPacket(buffer, header, len);
+        if (q->name == NULL || *buffer + 4 > header + len)
+            return -1;
+        q->type = get16bits(buffer);
+        q->class = get16bits(buffer);
     }
+    return 0;
 }
 
 void readHeader(struct Message* msg, uint8_t** buffer) {
@@ -846,20 +864,524 @@ void writeBuffer(struct Message* msg, uint8_t** buffer) {
     writeRR(msg->additionals, buffer, &cp, header);
 }
 
-void readBuffer(struct Message* msg, uint8_t* buffer) {
+//bufLen是收到的字节数，包括TCP的两个字节长度，报文格式错误返回-1
+int readBuffer(struct Message* msg, uint8_t* buffer, int bufLen) {
+    int len = bufLen - 2;
     get16bits(&buffer);//TCP header 长度
     uint8_t* header = buffer;
+    if (len < 12)
+        return -1;
     readHeader(msg, &buffer);
-    readQuestion(msg, &buffer, header);
-    readSection(msg, &buffer, 1, msg->ansCount, header);
-    readSection(msg, &buffer, 2, msg->auCount, header);
-    readSection(msg, &buffer, 3, msg->adCount, header);
+    if (readQuestion(msg, &buffer, header, len) < 0)
+        return -1;
+    if (readSection(msg, &buffer, 1, msg->ansCount, header, len) < 0)
+        return -1;
+    if (readSection(msg, &buffer, 2, msg->auCount, header, len) < 0)
+        return -1;
+    if (readSection(msg, &buffer, 3, msg->adCount, header, len) < 0)
+        return -1;
+    return 0;
+}
+
+
+//压测模式用的一条查询，packet是编好的报文（不含TCP的长度），ID发送时再填
+struct BenchQuery {
+    uint8_t* packet;
+    int len;
+};
+
+//一个在途的查询，按ID放在表里；sentAt是发出的时间（微秒），active为0表示已经收到回复或者超时了
+struct BenchInflight {
+    long sentAt;
+    int active;
+};
+
+//按发出顺序记下每个查询的ID和发出时间，超时时间都一样，所以只需要从最早的看起
+//回复已经到了的条目留在里面，轮到它的时候直接跳过；同一个ID被重新用过的话靠sentAt区分
+struct BenchOrder {
+    unsigned short id;
+    long sentAt;
+};
+
+//压测用的一个TCP连接，in里是还没凑成一个完整报文的回复，out里是还没写出去的请求
+struct BenchConn {
+    int fd;
+    uint8_t* in;
+    int inLen;
+    uint8_t* out;
+    int outLen;
+    int outCap;
+};
+
+struct Bench {
+    struct BenchQuery* queries;
+    int queryCount;
+    int nextQuery;
+    int useTcp;
+    int inflightLimit;
+    int connCount;
+    long qps;
+    long duration;//微秒
+    long timeout;//微秒
+    struct sockaddr_in srvAddr;
+
+    int udpSock;
+    struct BenchConn conns[BENCH_MAX_CONNECTIONS];
+    int nextConn;
+
+    struct BenchInflight ids[65536];
+    unsigned short nextId;
+    int inflight;
+    struct BenchOrder* order;
+    int orderHead;
+    int orderCount;
+    int orderCap;
+
+    long sent;
+    long received;
+    long timeouts;
+    long unmatched;//迟到的（已经算超时了）或者ID对不上的回复
+    long malformed;
+    long rcodes[16];
+    unsigned int* latencies;//每个收到的回复的延迟，微秒，最后排序求分位数
+    long latencyCount;
+    long latencyCap;
+    long latencySum;
+};
+
+long benchNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+//把一条查询编成报文：header只有一个question，不要求递归，后面是域名、类型和IN类别
+void buildBenchQuery(struct BenchQuery* query, unsigned char* name, unsigned short type) {
+    uint8_t buffer[512];
+    uint8_t* p = buffer;
+    unsigned char* bytes = domainStr2DomainBytes(name);
+    int nameLen = strlen(bytes) + 1;
+
+    put16bits(&p, 0);//ID
+    put16bits(&p, 0);//flags
+    put16bits(&p, 1);//qCount
+    put16bits(&p, 0);
+    put16bits(&p, 0);
+    put16bits(&p, 0);
+    memcpy(p, bytes, nameLen);
+    p += nameLen;
+    put16bits(&p, type);
+    put16bits(&p, IN_Class);
+    free(bytes);
+
+    query->len = p - buffer;
+    query->packet = malloc(query->len);
+    memcpy(query->packet, buffer, query->len);
+}
+
+//读查询文件，每行是 域名 类型（空格或tab分开），空行和#开头的行跳过，返回读到的条数
+int loadBenchQueries(struct Bench* bench, unsigned char* fileName) {
+    FILE* fd;
+    unsigned char line[1024];
+    unsigned char name[256];
+    unsigned char typeStr[16];
+    unsigned short type;
+    int cap = 1024;
+
+    fd = fopen(fileName, "r");
+    if (fd == NULL) {
+        printf("无法打开文件%s\n", fileName);
+        return 0;
+    }
+    bench->queries = malloc(sizeof(struct BenchQuery) * cap);
+    while (fgets(line, sizeof(line), fd) != NULL) {
+        if (line[0] == '#' || sscanf(line, "%255s %15s", name, typeStr) != 2)
+            continue;
+        if (strcmp(typeStr, "A") == 0)
+            type = A_Resource_RecordType;
+        else if (strcmp(typeStr, "NS") == 0)
+            type = NS_Resource_RecordType;
+        else if (strcmp(typeStr, "MX") == 0)
+            type = MX_Resource_RecordType;
+        else if (strcmp(typeStr, "CNAME") == 0)
+            type = CNAME_Resource_RecordType;
+        else if (strcmp(typeStr, "PTR") == 0)
+            type = PTR_Resource_RecordType;
+        else {
+            printf("忽略不支持的类型：%s %s\n", name, typeStr);
+            continue;
+        }
+        if (strlen(name) > 253) {
+            printf("忽略过长的域名：%s\n", name);
+            continue;
+        }
+        if (bench->queryCount == cap) {
+            cap *= 2;
+            bench->queries = realloc(bench->queries, sizeof(struct BenchQuery) * cap);
+        }
+        buildBenchQuery(&bench->queries[bench->queryCount++], name, type);
+    }
+    fclose(fd);
+    return bench->queryCount;
+}
+
+void setNonBlocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+//连上服务器，UDP一个socket，TCP按-k开若干个连接，失败返回-1
+int openBenchSockets(struct Bench* bench) {
+    struct BenchConn* conn;
+    int i, on = 1;
+
+    if (!bench->useTcp) {
+        bench->udpSock = socket(PF_INET, SOCK_DGRAM, 0);
+        if (connect(bench->udpSock, (struct sockaddr*) &bench->srvAddr, sizeof(bench->srvAddr)) < 0)
+            return -1;
+        setNonBlocking(bench->udpSock);
+        return 0;
+    }
+    for (i = 0; i < bench->connCount; i++) {
+        conn = &bench->conns[i];
+        conn->fd = socket(PF_INET, SOCK_STREAM, 0);
+        if (connect(conn->fd, (struct sockaddr*) &bench->srvAddr, sizeof(bench->srvAddr)) < 0)
+            return -1;
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        setNonBlocking(conn->fd);
+        conn->in = malloc(BUF_SIZE + 2);
+        conn->outCap = 65536;
+        conn->out = malloc(conn->outCap);
+    }
+    return 0;
+}
+
+//把TCP连接里攒着的请求尽量写出去，连接断了返回-1
+int flushBenchConn(struct BenchConn* conn) {
+    int n;
+    while (conn->outLen > 0) {
+        n = send(conn->fd, conn->out, conn->outLen, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        memmove(conn->out, conn->out + n, conn->outLen - n);
+        conn->outLen -= n;
+    }
+    return 0;
+}
+
+//发出查询文件里的下一条，查询文件用完了从头再来；ID跳过还在途的
+void sendBenchQuery(struct Bench* bench, long now) {
+    struct BenchQuery* query = &bench->queries[bench->nextQuery];
+    struct BenchConn* conn;
+    unsigned short id;
+
+    bench->nextQuery = (bench->nextQuery + 1) % bench->queryCount;
+    while (bench->ids[bench->nextId].active)
+        bench->nextId++;
+    id = bench->nextId++;
+    query->packet[0] = id >> 8;
+    query->packet[1] = id & 0xFF;
+
+    if (!bench->useTcp) {
+        if (send(bench->udpSock, query->packet, query->len, 0) < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) {
+            printf("发送失败：%s\n", strerror(errno));
+            exit(1);
+        }
+    } else {
+        conn = &bench->conns[bench->nextConn];
+        bench->nextConn = (bench->nextConn + 1) % bench->connCount;
+        while (conn->outLen + query->len + 2 > conn->outCap) {
+            conn->outCap *= 2;
+            conn->out = realloc(conn->out, conn->outCap);
+        }
+        conn->out[conn->outLen] = query->len >> 8;
+        conn->out[conn->outLen + 1] = query->len & 0xFF;
+        memcpy(conn->out + conn->outLen + 2, query->packet, query->len);
+        conn->outLen += query->len + 2;
+        if (flushBenchConn(conn) < 0) {
+            printf("TCP连接断开\n");
+            exit(1);
+        }
+    }
+
+    bench->ids[id].sentAt = now;
+    bench->ids[id].active = 1;
+    bench->inflight++;
+    bench->sent++;
+    if (bench->orderCount == bench->orderCap) {
+        //环形队列满了，展开成两倍大的
+        struct BenchOrder* order = malloc(sizeof(struct BenchOrder) * bench->orderCap * 2);
+        int i;
+        for (i = 0; i < bench->orderCount; i++)
+            order[i] = bench->order[(bench->orderHead + i) % bench->orderCap];
+        free(bench->order);
+        bench->order = order;
+        bench->orderHead = 0;
+        bench->orderCap *= 2;
+    }
+    bench->order[(bench->orderHead + bench->orderCount) % bench->orderCap].id = id;
+    bench->order[(bench->orderHead + bench->orderCount) % bench->orderCap].sentAt = now;
+    bench->orderCount++;
+}
+
+//处理一个收到的回复：按ID找到在途的查询，记下延迟和rcode
+void handleBenchReply(struct Bench* bench, uint8_t* reply, int len, long now) {
+    struct BenchInflight* inflight;
+    unsigned short id;
+    unsigned int latency;
+
+    if (len < 12 || !(reply[2] & 0x80)) {
+        bench->malformed++;
+        return;
+    }
+    id = (reply[0] << 8) | reply[1];
+    inflight = &bench->ids[id];
+    if (!inflight->active) {
+        bench->unmatched++;
+        return;
+    }
+    inflight->active = 0;
+    bench->inflight--;
+    bench->received++;
+    bench->rcodes[reply[3] & 0x0F]++;
+
+    latency = now - inflight->sentAt;
+    if (bench->latencyCount == bench->latencyCap) {
+        bench->latencyCap *= 2;
+        bench->latencies = realloc(bench->latencies, sizeof(unsigned int) * bench->latencyCap);
+    }
+    bench->latencies[bench->latencyCount++] = latency;
+    bench->latencySum += latency;
+}
+
+//把socket里已经到了的回复全部读出来
+void receiveBenchReplies(struct Bench* bench) {
+    uint8_t buffer[BUF_SIZE];
+    struct BenchConn* conn;
+    int n, i, frameLen, used;
+
+    if (!bench->useTcp) {
+        while ((n = recv(bench->udpSock, buffer, sizeof(buffer), 0)) >= 0 || errno == EINTR || errno == ECONNREFUSED)
+            if (n >= 0)
+                handleBenchReply(bench, buffer, n, benchNow());
+        return;
+    }
+    for (i = 0; i < bench->connCount; i++) {
+        conn = &bench->conns[i];
+        while (1) {
+            n = recv(conn->fd, conn->in + conn->inLen, BUF_SIZE + 2 - conn->inLen, 0);
+            if (n == 0) {
+                printf("服务器关闭了TCP连接\n");
+                exit(1);
+            }
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            conn->inLen += n;
+            //一次可能收到好几个回复，也可能半个，按前面两个字节的长度切开
+            used = 0;
+            while (conn->inLen - used >= 2) {
+                frameLen = (conn->in[used] << 8) | conn->in[used + 1];
+                if (conn->inLen - used - 2 < frameLen)
+                    break;
+                handleBenchReply(bench, conn->in + used + 2, frameLen, benchNow());
+                used += frameLen + 2;
+            }
+            memmove(conn->in, conn->in + used, conn->inLen - used);
+            conn->inLen -= used;
+        }
+        if (flushBenchConn(conn) < 0) {
+            printf("TCP连接断开\n");
+            exit(1);
+        }
+    }
+}
+
+//从最早发出的看起，超过超时时间还没回复的算超时
+void expireBenchQueries(struct Bench* bench, long now) {
+    struct BenchOrder* head;
+    struct BenchInflight* inflight;
+
+    while (bench->orderCount > 0) {
+        head = &bench->order[bench->orderHead];
+        inflight = &bench->ids[head->id];
+        if (inflight->active && inflight->sentAt == head->sentAt) {
+            if (now - head->sentAt < bench->timeout)
+                break;
+            inflight->active = 0;
+            bench->inflight--;
+            bench->timeouts++;
+        }
+        bench->orderHead = (bench->orderHead + 1) % bench->orderCap;
+        bench->orderCount--;
+    }
+}
+
+int compareLatency(const void* a, const void* b) {
+    unsigned int x = *(const unsigned int*)a;
+    unsigned int y = *(const unsigned int*)b;
+    return x < y ? -1 : (x > y);
+}
+
+//已经排好序的延迟里取第p分位（0~1）
+unsigned int latencyPercentile(struct Bench* bench, double p) {
+    long i = (long)(p * bench->latencyCount);
+    if (i >= bench->latencyCount)
+        i = bench->latencyCount - 1;
+    return bench->latencies[i];
+}
+
+void printBenchReport(struct Bench* bench, long elapsed) {
+    const char* rcodeNames[16] = { "NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED" };
+    double seconds = elapsed / 1000000.0;
+    int i;
+
+    printf("\n压测结果：\n");
+    printf("  协议%s，%d个在途", bench->useTcp ? "TCP" : "UDP", bench->inflightLimit);
+    if (bench->useTcp)
+        printf("，%d个连接", bench->connCount);
+    if (bench->qps > 0)
+        printf("，目标%ld qps", bench->qps);
+    else
+        printf("，不限速");
+    printf("，共%.2f秒\n", seconds);
+    printf("  发出%ld，收到%ld，超时%ld，迟到或对不上的回复%ld，格式错误%ld\n",
+           bench->sent, bench->received, bench->timeouts, bench->unmatched, bench->malformed);
+    printf("  吞吐：%.0f qps\n", bench->received / seconds);
+    if (bench->latencyCount > 0) {
+        qsort(bench->latencies, bench->latencyCount, sizeof(unsigned int), compareLatency);
+        printf("  延迟（微秒）：最小%u 平均%.0f p50 %u p90 %u p99 %u p99.9 %u 最大%u\n",
+               bench->latencies[0], (double)bench->latencySum / bench->latencyCount,
+               latencyPercentile(bench, 0.5), latencyPercentile(bench, 0.9),
+               latencyPercentile(bench, 0.99), latencyPercentile(bench, 0.999),
+               bench->latencies[bench->latencyCount - 1]);
+    }
+    printf("  rcode：");
+    for (i = 0; i < 16; i++) {
+        if (bench->rcodes[i] == 0)
+            continue;
+        if (i < 6)
+            printf("%s %ld  ", rcodeNames[i], bench->rcodes[i]);
+        else
+            printf("rcode%d %ld  ", i, bench->rcodes[i]);
+    }
+    printf("\n");
+}
+
+//压测模式：./client -b <服务器IP> <查询文件> [选项]
+//按查询文件的顺序循环发查询，保持最多inflightLimit个在途，限速的话按目标QPS匀速发，时间到了停止发送，等在途的回复或超时
+int runBenchmark(int argc, char* argv[]) {
+    struct Bench* bench;
+    struct pollfd fds[BENCH_MAX_CONNECTIONS];
+    long start, now, sendEnd, due;
+    int i, nfds, timeout;
+
+    bench = malloc(sizeof(struct Bench));
+    memset(bench, 0, sizeof(struct Bench));
+    bench->inflightLimit = BENCH_DEFAULT_INFLIGHT;
+    bench->connCount = 1;
+    bench->duration = BENCH_DEFAULT_DURATION * 1000000L;
+    bench->timeout = BENCH_DEFAULT_TIMEOUT_MS * 1000L;
+    for (i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+            bench->useTcp = strcmp(argv[++i], "tcp") == 0;
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            bench->inflightLimit = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc)
+            bench->connCount = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc)
+            bench->qps = atol(argv[++i]);
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+            bench->duration = (long)(atof(argv[++i]) * 1000000);
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            bench->timeout = atol(argv[++i]) * 1000L;
+        else
+            printf("忽略无法识别的参数：%s\n", argv[i]);
+    }
+    if (bench->inflightLimit < 1)
+        bench->inflightLimit = 1;
+    if (bench->inflightLimit > BENCH_MAX_INFLIGHT)
+        bench->inflightLimit = BENCH_MAX_INFLIGHT;
+    if (bench->connCount < 1)
+        bench->connCount = 1;
+    if (bench->connCount > BENCH_MAX_CONNECTIONS)
+        bench->connCount = BENCH_MAX_CONNECTIONS;
+
+    if (loadBenchQueries(bench, argv[3]) == 0) {
+        printf("查询文件里没有可用的查询\n");
+        return 1;
+    }
+    bench->srvAddr.sin_family = AF_INET;
+    bench->srvAddr.sin_addr.s_addr = inet_addr(argv[2]);
+    bench->srvAddr.sin_port = htons(53);
+    if (openBenchSockets(bench) < 0) {
+        printf("无法连接服务器%s\n", argv[2]);
+        return 1;
+    }
+    bench->orderCap = 1024;
+    bench->order = malloc(sizeof(struct BenchOrder) * bench->orderCap);
+    bench->latencyCap = 1024;
+    bench->latencies = malloc(sizeof(unsigned int) * bench->latencyCap);
+
+    nfds = bench->useTcp ? bench->connCount : 1;
+    for (i = 0; i < nfds; i++) {
+        fds[i].fd = bench->useTcp ? bench->conns[i].fd : bench->udpSock;
+        fds[i].events = POLLIN;
+    }
+    printf("已读入%d条查询，开始压测%s\n", bench->queryCount, argv[2]);
+
+    start = benchNow();
+    sendEnd = start + bench->duration;
+    now = start;
+    while (now < sendEnd || bench->inflight > 0) {
+        //限速时，到现在为止应该发出去 已过时间*qps 条
+        while (now < sendEnd && bench->inflight < bench->inflightLimit) {
+            if (bench->qps > 0 && bench->sent >= (now - start) * bench->qps / 1000000)
+                break;
+            sendBenchQuery(bench, now);
+        }
+        if (bench->useTcp)
+            for (i = 0; i < nfds; i++)
+                fds[i].events = bench->conns[i].outLen > 0 ? (POLLIN | POLLOUT) : POLLIN;
+
+        //限速而且还能发的话最多睡1毫秒，否则最多睡到最早的查询超时
+        timeout = 100;
+        if (now < sendEnd && bench->qps > 0 && bench->inflight < bench->inflightLimit)
+            timeout = 1;
+        if (bench->orderCount > 0) {
+            due = (bench->order[bench->orderHead].sentAt + bench->timeout - now) / 1000 + 1;
+            if (due < timeout)
+                timeout = due;
+        }
+        if (poll(fds, nfds, timeout) > 0)
+            receiveBenchReplies(bench);
+        now = benchNow();
+        expireBenchQueries(bench, now);
+    }
+    printBenchReport(bench, (sendEnd < now ? sendEnd : now) - start);
+    return 0;
 }
 
 int main(int argc, char* argv[]) {
+    if (argc >= 4 && strcmp(argv[1], "-b") == 0)
+        return runBenchmark(argc, argv);
     if (argc < 4) {
         printf("使用说明: %s <服务器IP> <域名> <类型> ...... \n", argv[0]);
         printf("如: %s 127.0.0.1 北邮.教育.中国 A 北邮.教育.中国 MX 教育.中国 CNAME ...\n", argv[0]);
+        printf("压测: %s -b <服务器IP> <查询文件> [选项]\n", argv[0]);
+        printf("查询文件每行一条查询：域名 类型，循环使用\n");
+        printf("  -p udp|tcp  协议，默认udp（local服务器只接受tcp）\n");
+        printf("  -c <数>     最多同时在途的查询数，默认%d，最大%d\n", BENCH_DEFAULT_INFLIGHT, BENCH_MAX_INFLIGHT);
+        printf("  -k <数>     tcp时开几个连接，查询轮流分给它们，默认1\n");
+        printf("  -q <数>     目标QPS，默认0为不限速\n");
+        printf("  -l <秒>     发送多长时间，默认%d\n", BENCH_DEFAULT_DURATION);
+        printf("  -t <毫秒>   多久没回复算超时，默认%d\n", BENCH_DEFAULT_TIMEOUT_MS);
         exit(1);
     }
 
@@ -942,8 +1464,12 @@ int main(int argc, char* argv[]) {
     freeResourceRecords(msg.additionals);
     memset(&msg, 0, sizeof(struct Message));
     memset(&buffer,0,sizeof(buffer));
-    recv(sock,buffer,sizeof(buffer),0);
-    readBuffer(&msg, buffer);
+    bufLen = recv(sock,buffer,sizeof(buffer),0);
+    if (readBuffer(&msg, buffer, bufLen) < 0) {
+        printf("收到的回复格式错误\n");
+        close(sock);
+        exit(1);
+    }
     printMessage(&msg);
     gettimeofday(&end, NULL );
     int timeuse = 1000000 * ( end.tv_sec - start.tv_sec ) + end.tv_usec - start.tv_usec;
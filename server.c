@@ -1,3 +1,4 @@
+#define _GNU_SOURCE //recvmmsg/sendmmsg
 #include <stdio.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
@@ -8,8 +9,17 @@
 #include <unistd.h>
 #include <time.h>
 #include <sys/time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <sys/random.h>
 
 #define BUF_SIZE 65535
+#define DNS_PORT 53
 
 // Resource Record Types
 #define A_Resource_RecordType 1
@@ -17,6 +27,7 @@
 #define MX_Resource_RecordType 15
 #define PTR_Resource_RecordType 12
 #define NS_Resource_RecordType 2
+#define SOA_Resource_RecordType 6
 
 // Class
 #define IN_Class 1
@@ -32,12 +43,32 @@
 #define Refused_ResponseType 5
 
 
-//用于保存packet中出现的第一个域名的字节码和它相对于header的位置
-//只保存整个packet里的第一个域名，不考虑第二个域名、第三个域名能否用来当做压缩参照的情况
-//考虑那些的话难度实在太大了，压缩指针这块甚至还可以嵌套，太难实现
-struct CompressPointerInfo {
-    unsigned char* name;
-    uint8_t pos;
+//压缩表最多记多少个已经写进报文的后缀，记满了之后写的域名还会压缩，只是不再被后面的域名参照
+#define COMPRESSION_MAX_ENTRIES 1024
+#define COMPRESSION_BUCKETS 2048
+//压缩指针只有14位，报文里超过这个位置的域名不能被指向
+#define COMPRESSION_MAX_OFFSET 0x3FFF
+
+//压缩表里的一个后缀：驻留表里的suffix这个域名写在报文的offset处
+//比如写过6北邮6教育6中国0之后，表里会有"中国"、"教育.中国"、"北邮.教育.中国"三项
+//next是同一个桶里的下一项
+struct CompressionEntry {
+    struct Name* suffix;
+    unsigned short offset;
+    int next;
+};
+
+//写一个报文时用的压缩表，记录报文里已经写过的每一个域名后缀的位置
+//要写的域名先驻留，它的每个后缀就是驻留表里parent链上的一个节点，直接拿指针在表里找，第一个找到的就是最长的已写过的后缀
+//names是写进表里的域名的驻留引用，拿着它们表里的后缀指针才不会被释放掉再被别的域名重用，写完报文再releaseCompressionTable
+//header是报文的开头，为NULL时不压缩
+struct CompressionTable {
+    uint8_t* header;
+    int count;
+    int nameCount;
+    int buckets[COMPRESSION_BUCKETS];
+    struct CompressionEntry entries[COMPRESSION_MAX_ENTRIES];
+    struct Name* names[COMPRESSION_MAX_ENTRIES];
 };
 
 //用于将一个域名存储为一段一段的，如“15邮箱服务器6北邮6教育6中国0”在以下结构体中存储，将会是一个三项的链表：
@@ -80,6 +111,13 @@ union ResourceData {
     struct {
         unsigned char* name;
     } ns_record;
+    struct {
+        unsigned int serial;
+        unsigned int refresh;
+        unsigned int retry;
+        unsigned int expire;
+        unsigned int minimum;
+    } soa_record;
 };
 
 // Resource Record 结构体，其中域名是已经经过函数解析成链表的，而非原本的字节码
@@ -90,7 +128,6 @@ struct ResourceRecord {
     unsigned int ttl;
     unsigned short rd_length;
     union ResourceData rd_data;
-    struct ResourceRecord* next;
 };
 
 //程序收到packet后会先将packet字节码转换成这个Message结构体
@@ -111,10 +148,583 @@ struct Message {
     unsigned short auCount; // Authority Record Count
     unsigned short adCount; // Additional Record Count
 
+    //各个部分都是数组，和所有域名一起分配在arena里，请求回复完了整个arena一次清空
+    struct Arena* arena;
     struct Question* questions;
     struct ResourceRecord* answers;
     struct ResourceRecord* authorities;
     struct ResourceRecord* additionals;
+    unsigned short ansCap;
+    unsigned short auCap;
+    unsigned short adCap;
+    int fromCache;//回复里有从resolverCache查到的记录，TTL会变，不能放进回复缓存
+};
+
+//arena每次向系统要的内存块的大小，一个普通的请求一块就够用
+#define ARENA_BLOCK_SIZE 16384
+
+//arena的一个内存块，data里从前往后分配，used是已经用掉的字节数
+struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+    uint8_t data[];
+};
+
+//一个请求用的内存池，请求的Message、记录、域名的每一段都从这里按顺序切出来，不单独释放
+//请求回复完之后resetArena，只留下第一块给下一个请求接着用，所以正常情况下处理请求时不再调用malloc和free
+struct Arena {
+    struct ArenaBlock* first;
+    struct ArenaBlock* current;
+};
+
+//一个报文最多读多少个问题、多少条记录，多出来的照样检查格式，但是不记进视图，当作没有
+#define VIEW_MAX_QUESTIONS 16
+#define VIEW_MAX_RECORDS 256
+//读一个域名时最多跟几次压缩指针，再多就当作格式错误
+#define MAX_COMPRESSION_HOPS 32
+
+//报文里的一个问题，name是域名在报文里的偏移
+struct QuestionView {
+    unsigned short name;
+    unsigned short type;
+    unsigned short class;
+};
+
+//报文里的一条记录，name和rdata是在报文里的偏移
+//A记录的地址、MX的preference、SOA的minimum直接读出来放在这里，target是MX的exchange或者CNAME的域名在报文里的偏移
+struct RecordView {
+    unsigned short name;
+    unsigned short type;
+    unsigned short class;
+    unsigned int ttl;
+    unsigned short rd_length;
+    unsigned short rdata;
+    uint8_t addr[4];
+    unsigned short preference;
+    unsigned short target;
+    unsigned int minimum;
+};
+
+//不用分配任何内存就能读出来的报文视图，所有域名都只记录在packet里的偏移，用到的时候再去packet里读
+//所以packet在用完视图之前不能被覆盖
+//records按顺序放着回答、权威服务器、附加三个部分，authorityStart和additionalStart是后两部分的起点
+struct MessageView {
+    uint8_t* packet;
+    int len;
+
+    unsigned short id;
+    unsigned short qr;
+    unsigned short opcode;
+    unsigned short aa;
+    unsigned short tc;
+    unsigned short rd;
+    unsigned short ra;
+    unsigned short rcode;
+
+    struct QuestionView questions[VIEW_MAX_QUESTIONS];
+    int questionCount;
+    struct RecordView records[VIEW_MAX_RECORDS];
+    int recordCount;
+    int authorityStart;
+    int additionalStart;
+};
+
+//一个域名最多127段（255字节的域名每段至少1字节加1字节长度）
+#define MAX_LABELS 128
+//域名驻留表分成若干个分片，每个分片一把锁；每个分片初始的桶数，域名数超过桶数的两倍时扩容
+#define NAME_SHARDS 16
+#define NAME_INIT_BUCKETS 1024
+
+//规范化之后驻留的域名，区域索引和缓存的key都是它
+//wire是正常顺序的字节码（6北邮6教育6中国0），ASCII字母全部转成小写，len包括最后的0
+//labels[i]是第i段的长度字节在wire里的位置，hash是整个域名的哈希
+//驻留表里同一个域名只有一个Name，所以两个驻留过的域名是不是一样只需要比较指针
+//parent是去掉第一段之后的域名，也驻留在表里，根域名的parent是NULL
+//refs是引用计数，区域记录、缓存记录、子域名的parent各算一个，归0时从表里删掉
+struct Name {
+    unsigned int hash;
+    int refs;
+    struct Name* parent;
+    struct Name* next;//同一个桶里的下一个
+    uint8_t* labels;
+    uint8_t len;
+    uint8_t labelCount;
+    uint8_t wire[];
+};
+
+//查询时在栈上拼出来的规范化域名，不驻留，用来在驻留表里找它和它的每一个后缀
+//hashes[k]是从第k段开始的后缀的哈希，hashes[labelCount]是根域名的哈希
+struct NameKey {
+    uint8_t wire[256];
+    int len;
+    int labelCount;
+    uint8_t labels[MAX_LABELS];
+    unsigned int hashes[MAX_LABELS + 1];
+};
+
+struct NameShard {
+    pthread_mutex_t lock;
+    struct Name** buckets;
+    unsigned int bucketCount;
+    unsigned int count;
+};
+
+//所有线程共用的域名驻留表
+struct NameTable {
+    struct NameShard shards[NAME_SHARDS];
+};
+//区域索引初始的桶数，记录数超过桶数的两倍时扩容
+#define ZONE_INDEX_INIT_BUCKETS 1024
+
+//区域索引中的一条记录，对应resolve.txt中的一行，owner是驻留过的域名
+struct ZoneRecord {
+    struct Name* owner;
+    unsigned short type;
+    unsigned short class;
+    unsigned int ttl;
+    unsigned short rd_length;
+    union ResourceData rd_data;
+    struct ZoneRecord* next;//同一个桶里的下一条记录
+};
+
+//区域索引，服务器启动时把文件一次性读进内存，之后查询不再读文件
+//用驻留的域名做key，比较只需要比较指针
+//完全匹配查一次哈希表就可以，最佳匹配就从整个域名开始，每次去掉最前面一段往短了查，最多查labelCount次
+struct ZoneIndex {
+    struct ZoneRecord** buckets;
+    unsigned int bucketCount;
+    unsigned int recordCount;
+    struct ZoneImage* image;//有编译好的二进制区域文件时直接查映射进来的镜像，这时上面的哈希表是空的
+};
+
+//二进制区域文件，由 server -c 从文本文件编译出来，启动时只读映射进内存，不用再逐行解析
+//布局是 头部 | 域名表 | 记录表 | 字节池，偏移都相对文件开头（字节池里的偏移相对字节池开头），整数都是本机字节序
+//域名表按(哈希, 域名字节码)排好序，查找时用NameKey里算好的后缀哈希二分查找
+//每个域名的记录在记录表里是连续的一段，按(类型, 类别, 文件中的行号)排序，同样的记录只用第一条，和文本文件的规则一样
+#define ZONE_IMAGE_MAGIC "DNSZONE1"
+
+struct ZoneImageHeader {
+    char magic[8];
+    uint32_t nameCount;
+    uint32_t recordCount;
+    uint32_t namesOffset;
+    uint32_t recordsOffset;
+    uint32_t poolOffset;
+    uint32_t poolSize;
+};
+
+//wire是规范化之后（小写）的域名字节码在字节池里的位置
+struct ZoneImageName {
+    uint32_t hash;
+    uint32_t wire;
+    uint32_t firstRecord;
+    uint32_t recordCount;
+    uint16_t len;
+    uint16_t labelCount;
+};
+
+//rdata是报文里格式的RDATA（不压缩）在字节池里的位置：A为4字节地址，MX为2字节preference加域名字节码，CNAME为域名字节码
+struct ZoneImageRecord {
+    uint16_t type;
+    uint16_t class;
+    uint32_t ttl;
+    uint32_t rdata;
+    uint16_t rdLength;
+    uint16_t reserved;
+};
+
+//映射进来的镜像，所有线程共用，只读；多个进程映射同一个文件时共用page cache
+struct ZoneImage {
+    uint8_t* base;
+    size_t size;
+    struct ZoneImageHeader* header;
+    struct ZoneImageName* names;
+    struct ZoneImageRecord* records;
+    uint8_t* pool;
+};
+
+//标签驻留表，每个不同的标签（如"中国"）只存一份，并分配一个编号
+//所有标签的字节连续存放在bytes里，trie里比较标签的时候只需要比较编号
+struct LabelTable {
+    unsigned char* bytes;
+    unsigned int bytesUsed;
+    unsigned int bytesCap;
+    unsigned int* offsets;//第i个标签在bytes里的位置
+    uint8_t* lens;//第i个标签的长度
+    int* chain;//同一个桶里的下一个标签编号，-1为没有
+    unsigned int count;
+    unsigned int cap;
+    int* buckets;
+    unsigned int bucketCount;
+};
+
+//授权点的一个权威服务器地址
+struct DelegationAddr {
+    uint8_t addr[4];
+    unsigned int ttl;
+};
+
+//压缩后的授权trie的一个节点，所有节点放在一个数组里
+//进入这个节点的边上可能有多个标签（只有一个孩子且不是授权点的节点会被合并掉），存在edgeLabels[edgeStart]开始的edgeLen个位置
+//一个节点的所有孩子在nodes数组里是连续的，按第一个标签的编号排好序，方便二分查找
+//addrCount大于0的节点就是一个授权点，depth是它从根开始的段数，也就是授权点域名的段数
+struct DelegationNode {
+    unsigned int edgeStart;
+    unsigned int childStart;
+    unsigned int addrStart;
+    unsigned short edgeLen;
+    unsigned short childCount;
+    unsigned short addrCount;
+    unsigned short depth;
+};
+
+//由authorised.txt构建的授权trie，nodes[0]是根节点
+//查找最近的授权点只需要沿着倒序的域名往下走一遍
+struct DelegationTrie {
+    struct LabelTable labels;
+    struct DelegationNode* root;//预先查好的"根.网络"授权点，没有的话是NULL
+    struct DelegationNode* nodes;
+    unsigned int nodeCount;
+    unsigned int* edgeLabels;
+    unsigned int edgeLabelCount;
+    struct DelegationAddr* addrs;
+    unsigned int addrCount;
+};
+
+//缓存分成若干个分片，每个分片一把锁，不同分片的查询互不影响
+#define CACHE_SHARDS 16
+//每个分片初始的桶数，条目数超过桶数的两倍时扩容
+#define CACHE_INIT_BUCKETS 256
+//默认的缓存内存上限，单位KB，可以用-m参数修改
+#define DEFAULT_CACHE_BUDGET_KB 65536
+//没有SOA可参考时负缓存的TTL，可以用-n参数修改；RFC 2308建议负缓存最多保存3小时
+#define DEFAULT_NEGATIVE_TTL 300
+#define MAX_NEGATIVE_TTL 10800
+//预取：记录剩下的TTL不到放进缓存时的DEFAULT_PREFETCH_PERCENT%，而且已经被查到过DEFAULT_PREFETCH_HITS次，
+//就在后台重新问一遍上游，可以用-P、-H参数修改，-P 0关闭预取
+#define DEFAULT_PREFETCH_PERCENT 10
+#define DEFAULT_PREFETCH_HITS 3
+
+//缓存里的一条记录，key是(域名, 类型, 类别)，owner是驻留过的域名，记录持有它的一个引用
+//expire是过期的绝对时间（单调时钟的秒数），返回给客户端的TTL是expire减去当前时间
+//referenced是CLOCK淘汰算法用的访问位，clockSlot是它在分片的clock数组里的位置
+//negative为1的是负缓存：上次解析这个域名这个类型失败了，rcode是当时的返回码（NXDOMAIN，或者0表示NODATA）
+struct CacheEntry {
+    struct Name* owner;
+    unsigned short type;
+    unsigned short class;
+    int negative;
+    unsigned short rcode;
+    long expire;
+    unsigned short rd_length;
+    union ResourceData rd_data;
+    unsigned int size;//这条记录大约占了多少字节，用于统计内存
+    int referenced;
+    unsigned int clockSlot;
+    unsigned int ttl;//放进缓存时的TTL，预取用来判断是不是快过期了
+    unsigned int hits;//放进缓存以后被查到的次数
+    int prefetching;//已经为它发起了预取，不要再发
+    int prefetched;//这条是预取放进来的
+    struct CacheEntry* next;//同一个桶里的下一条记录
+};
+
+//缓存的一个分片，clock数组里放着这个分片的所有记录，clockHand是CLOCK算法的指针
+struct CacheShard {
+    pthread_mutex_t lock;
+    struct CacheEntry** buckets;
+    unsigned int bucketCount;
+    struct CacheEntry** clock;
+    unsigned int clockCount;
+    unsigned int clockCap;
+    unsigned int clockHand;
+    size_t memUsed;
+};
+
+//代替cache.txt的内存缓存，超过内存上限就用CLOCK算法淘汰不常用的记录
+struct ResolverCache {
+    struct CacheShard shards[CACHE_SHARDS];
+    size_t shardBudget;//每个分片的内存上限
+};
+
+//事件循环一次epoll_wait最多取回多少个事件
+#define EPOLL_MAX_EVENTS 256
+//TCP连接空闲多少秒之后由服务器关闭，RFC 7766建议几秒到几十秒
+#define TCP_IDLE_TIMEOUT 10
+//向上游请求的重传：第一次等多久由这个服务器的平滑RTT决定，之后每次重传等待时间翻倍
+//没测过RTT的服务器第一次等UPSTREAM_INITIAL_RTO_MS，每次最少等UPSTREAM_MIN_RTO_MS，最多等UPSTREAM_MAX_RTO_MS
+#define UPSTREAM_INITIAL_RTO_MS 800
+#define UPSTREAM_MIN_RTO_MS 100
+#define UPSTREAM_MAX_RTO_MS 3000
+//一步迭代最多发几次请求（包括换服务器重发），都没有回复就回复SERVFAIL
+#define UPSTREAM_MAX_TRIES 4
+//一个区域最多记住几个权威服务器的地址
+#define MAX_UPSTREAM_SERVERS 8
+//服务器RTT表的桶数
+#define RTT_TABLE_BUCKETS 1024
+//每个事件循环有几个向上游发请求的UDP socket，每个绑定一个随机的端口，一直用到进程退出
+#define UPSTREAM_SOCKETS 8
+//按请求ID查找在等回复的请求的哈希表的桶数
+#define UPSTREAM_ID_BUCKETS 4096
+//一次迭代解析最多被上游转给下一个服务器多少次，防止上游互相指来指去
+#define MAX_REFERRALS 16
+//普通服务器的回复缓存每个线程的槽数，直接映射，冲突时新的顶掉旧的
+#define ANSWER_CACHE_SLOTS 16384
+//请求头里会影响回复内容的标志位，是回复缓存key的一部分；现在只有opcode，writeHeader会把它原样写回回复里
+#define ANSWER_CACHE_FLAG_MASK 0x7800
+//普通服务器一次recvmmsg最多收多少个请求、一次sendmmsg最多发多少个回复，可以用-b改
+#define DEFAULT_UDP_BATCH 32
+#define MAX_UDP_BATCH 1024
+//批量接收时每个请求的槽的大小，比它长的请求会被截断，截断的直接丢掉
+#define UDP_REQUEST_SLOT_SIZE 4096
+
+//epoll里注册的每个fd对应一个EventHandle，epoll_event.data.ptr指向它
+//type说明fd是什么，owner指向它所属的TcpConnection或者Resolution
+#define EVENT_LISTEN 0 //local服务器的TCP监听socket
+#define EVENT_SERVER 1 //普通服务器接收请求的UDP socket
+#define EVENT_CLIENT 2 //local服务器的客户端TCP连接
+#define EVENT_UPSTREAM 3 //向上游发请求用的UDP socket，owner为NULL，fd是事件循环的upstreamSockets中的一个
+
+struct EventHandle {
+    int type;
+    int fd;
+    void* owner;
+};
+
+//local服务器的一个客户端TCP连接
+//in里攒着还没凑齐的请求，前两个字节是DNS over TCP的长度；out里是还没发出去的回复
+//同一个连接上可以一个接一个地发多个请求，哪个请求先解析完哪个先回复（RFC 7766允许乱序，客户端按ID对应）
+//pending是这个连接上还在解析中的请求数，连接关闭时如果pending不为0，要等这些解析结束后才能释放
+//prev/next把同一个线程的所有连接串起来，用于关闭空闲连接
+struct TcpConnection {
+    struct EventHandle handle;
+    uint8_t in[BUF_SIZE + 2];
+    int inLen;
+    uint8_t* out;
+    int outLen;
+    int outSent;
+    int outCap;
+    unsigned int events;//现在在epoll里关注的事件
+    int eof;//对方已经不会再发请求了，解析完剩下的请求就关闭
+    int closed;
+    int pending;
+    long lastActive;
+    struct sockaddr_in addr;//客户端的地址，查询日志用
+    struct TcpConnection* prev;
+    struct TcpConnection* next;
+};
+
+//向上游发出的一次请求，重传时换了ID，也可能换了服务器，所以每次都要记下来，
+//早先发出的请求的回复晚到了也认，RTT按那一次发出的时间算
+//回复要(socket, 服务器, 端口, ID, question)都对得上才认，socket和ID都是随机选的，伪造回复很难猜中
+//next把ID落在同一个桶里的请求串起来
+struct UpstreamTry {
+    uint8_t server[4];
+    unsigned short id;
+    int socketIndex;//从事件循环的哪个upstreamSockets发出去的
+    int traceHop;//这次请求在res->trace里是第几步，没开轨迹时为-1
+    int rto;//这次等了多少毫秒
+    struct timeval sentAt;
+    struct Resolution* res;
+    struct UpstreamTry* next;
+};
+
+//解析轨迹：开了-T的话，每个解析把经过的每一步记下来，问过上游的解析回复时写成一行JSON，
+//用来找出慢在哪一级授权、哪个服务器上，原来这些只是散在各处的printf
+#define TRACE_STEP_LOCAL 0//在本地区域数据里查到
+#define TRACE_STEP_CACHE 1//在resolverCache里查到
+#define TRACE_STEP_NEGATIVE 2//负缓存里有，直接失败
+#define TRACE_STEP_DELEGATION 3//从授权trie里找到开始问的区域
+#define TRACE_STEP_QUERY 4//问了一次上游
+#define TRACE_STEP_COALESCED 5//同一个问题别的解析正在问上游，等它的结果
+#define TRACE_RESULT_PENDING 0//还没有回复，解析结束时还是这个说明客户端等不及了
+#define TRACE_RESULT_ANSWER 1
+#define TRACE_RESULT_REFERRAL 2
+#define TRACE_RESULT_REFERRAL_LIMIT 3//引荐次数太多，放弃
+#define TRACE_RESULT_FAILURE 4//NXDOMAIN或者没有数据
+#define TRACE_RESULT_TIMEOUT 5
+#define TRACE_RING_SIZE 1024//每个事件循环一个，必须是2的幂
+#define TRACE_RECENT 1024//最近多少条轨迹可以按ID查
+
+struct TraceHop {
+    struct DomainName* name;//在Resolution的arena里
+    struct DomainName* zone;//TRACE_STEP_DELEGATION时是授权点
+    unsigned short type;
+    unsigned char step;
+    unsigned char result;
+    unsigned short rcode;
+    uint8_t server[4];
+    int rtt;//微秒
+    int nextServers;//授权点或引荐给出的服务器数
+};
+
+//写好的轨迹从事件循环交给日志线程，和查询日志一样一个线程写一个线程读
+struct TraceLine {
+    unsigned short id;
+    char* line;
+};
+
+struct TraceRing {
+    struct TraceLine lines[TRACE_RING_SIZE];
+    unsigned int head;
+    unsigned int tail;
+    unsigned long dropped;
+    unsigned long reportedDrops;
+};
+
+//一个正在解析的客户端请求，相当于以前main函数里处理一个请求的那一整段
+//msg是准备回复给客户端的Message，taskList是这个请求还没解决的question
+//需要向上游请求时，servers是这一步可以问的所有服务器，tried记录这一轮问过了哪些，
+//waiting表示在等上游的回复，tries是已经发出去的请求，deadline是当前这次请求的重传时间，
+//然后这个请求就放进事件循环的定时器堆里，回复到了或者超时了再接着往下解析
+//conn不为NULL时回复写到这个TCP连接上，否则用UDP发回cltAddr
+//msg、taskList和所有的记录、域名都分配在arena里，回复发出去以后清空arena，Resolution放回事件循环的空闲链表，nextFree串起空闲的Resolution
+struct Resolution {
+    struct Arena arena;
+    struct Resolution* nextFree;
+    struct Message msg;
+    struct Question* taskList;
+    int waiting;
+    uint8_t servers[MAX_UPSTREAM_SERVERS][4];
+    int serverCount;
+    unsigned int tried;//第i位是1表示这一轮已经问过servers[i]
+    struct UpstreamTry tries[UPSTREAM_MAX_TRIES];
+    int tryCount;
+    int referrals;
+    int upstreamQueries;//一共向上游发过几次请求，查询日志用来区分答案的来源
+    struct TraceHop* trace;//在arena里，没开轨迹时为NULL
+    int traceCount;
+    int traceCap;
+    long deadline;//单调时钟的毫秒数
+    int timerIndex;//在定时器堆里的位置，-1表示不在堆里
+    struct timeval start;
+    struct TcpConnection* conn;
+    struct sockaddr_in cltAddr;
+    socklen_t cltAddrLen;
+    //合并相同的上游请求：leading为1时这个解析的当前任务在事件循环的inflight表里，followers是等它结果的解析
+    //inflightName是当前任务的域名驻留后的引用，表里按它的指针加上类型比较
+    //跟随的解析waiting为1但不在定时器堆里，领头的解析这一步问完以后把它们放进readyFollowers
+    int leading;
+    struct Question* inflightTask;
+    struct Name* inflightName;
+    struct Resolution* inflightNext;
+    struct Resolution* followers;
+    struct Resolution* nextFollower;
+    int coalesceOutcome;
+    int prefetch;//后台预取，没有客户端在等回复
+    struct Resolution* nextPrefetch;
+};
+
+//同一个线程里，(域名, 类型, 类别)一样的任务同一时间只有一个解析在问上游，其他的等它问完
+//问到了结果会在缓存里，跟随的解析重新解析一遍当前任务就能从缓存里拿到；失败了就照领头的解析的结果失败
+#define INFLIGHT_BUCKETS 1024
+#define COALESCE_RETRY -1//结果已经在缓存里，重新解析当前任务
+#define COALESCE_SKIP -2//这个任务没有结果，跳过，rcode不变
+//其他的值是这个任务失败了，msg的rcode设为这个值再跳过
+
+//一个上游服务器的平滑RTT，单位微秒，按BIND的做法：每次测到新的RTT，srtt = 0.7*srtt + 0.3*rtt；
+//超时了srtt翻倍；没被选中的服务器srtt慢慢变小，过一阵子会被重新试一下
+//measured为0表示还没测过，srtt只是一个随机的小数，让没问过的服务器先被问一次
+struct ServerRtt {
+    uint32_t addr;
+    unsigned int srtt;
+    int measured;
+    struct ServerRtt* next;
+};
+
+//所有线程共用的服务器RTT表，进程运行期间一直保留
+struct RttTable {
+    pthread_mutex_t lock;
+    struct ServerRtt* buckets[RTT_TABLE_BUCKETS];
+};
+
+//普通服务器（服务器类型1）回复缓存的一项，key是(规范化的域名, 类型, 类别, 标志位)
+//response是编好的整个回复报文，命中时只需要把请求的ID和question原样拷进去就能直接发出去
+//question里的域名按请求原样回写，所以大小写和请求一致；回复里指向question的压缩指针位置不变
+struct AnswerCacheEntry {
+    unsigned int hash;
+    unsigned short type;
+    unsigned short class;
+    unsigned short flags;
+    uint8_t qnameLen;
+    uint8_t qname[256];
+    int len;
+    uint8_t response[];
+};
+
+//普通服务器批量收发UDP用的，每个线程一份
+//收到的一批请求放在recvBuffers的各个槽里；回复先依次拷进sendBuffer排队，处理完一批或者队列满了再一次sendmmsg发出去
+struct UdpBatch {
+    int size;
+    struct mmsghdr* recvMsgs;
+    struct iovec* recvIovs;
+    struct sockaddr_in* recvAddrs;
+    uint8_t* recvBuffers;
+    struct mmsghdr* sendMsgs;
+    struct iovec* sendIovs;
+    struct sockaddr_in* sendAddrs;
+    int sendCount;
+    uint8_t* sendBuffer;
+    size_t sendUsed;
+    size_t sendCap;
+};
+
+//查询日志：每个回复了的请求一条记录，服务线程只把记录放进自己事件循环的环形缓冲区，
+//后台的queryLogThread再取出来格式化成一行写进日志文件，服务线程不做任何格式化和I/O
+//每个环形缓冲区只有一个写的线程（它的事件循环）和一个读的线程（queryLogThread），不用锁
+#define QUERY_LOG_RING_SIZE 4096//必须是2的幂
+#define QUERY_LOG_SOURCE_LOCAL 0//本地的区域数据
+#define QUERY_LOG_SOURCE_CACHE 1//resolverCache或负缓存
+#define QUERY_LOG_SOURCE_ANSWER_CACHE 2//回复缓存，耗时记为0
+#define QUERY_LOG_SOURCE_UPSTREAM 3//问过上游
+
+struct QueryLogRecord {
+    struct timeval time;//回复的时间
+    uint8_t client[4];
+    unsigned short port;
+    unsigned char tcp;
+    unsigned char source;
+    unsigned short type;//第一个问题的类型
+    unsigned char rcode;
+    unsigned char qCount;
+    int latency;//微秒
+    int qnameLen;
+    uint8_t qname[256];//第一个问题的域名，报文里的格式，由日志线程转成字符串
+};
+
+struct QueryLogRing {
+    struct QueryLogRecord records[QUERY_LOG_RING_SIZE];
+    unsigned int head;//只有服务线程写
+    unsigned int tail;//只有日志线程写
+    unsigned long dropped;//缓冲区满了丢掉的记录数，只有服务线程写
+    unsigned long reportedDrops;//日志线程已经报告过的丢弃数
+    int sampleCounter;
+};
+
+//每个服务线程一个事件循环
+//server是监听socket（local服务器）或者接收请求的UDP socket（普通服务器）
+struct EventLoop {
+    int epfd;
+    struct EventHandle server;
+    struct TcpConnection* connections;
+    struct TcpConnection* closedConnections;//已经关闭但还不能释放的连接
+    struct EventHandle upstreamSockets[UPSTREAM_SOCKETS];
+    struct UpstreamTry* pendingTries[UPSTREAM_ID_BUCKETS];//所有在等回复的上游请求，按ID哈希
+    struct Resolution** timers;//按deadline排的最小堆，放着所有在等上游回复的解析
+    struct Resolution* freeResolutions;//回复完了可以重新用的Resolution，arena里第一块内存还留着
+    int timerCount;
+    int timerCap;
+    struct AnswerCacheEntry** answerCache;//只有普通服务器有，ANSWER_CACHE_SLOTS个槽，其他类型为NULL
+    struct UdpBatch udp;//local服务器和客户端之间是TCP，用不到
+    unsigned int answerGeneration;//回复缓存里的回复是用哪一代区域数据编出来的
+    unsigned long epoch;//每次进出epoll_wait都加一，奇数表示正睡在epoll_wait里，手上没有区域数据的指针
+    struct QueryLogRing* queryLog;//查询日志关闭时为NULL
+    struct Metrics* metrics;//没开指标时为NULL
+    struct TraceRing* traces;//没开轨迹时为NULL
+    struct Resolution* inflight[INFLIGHT_BUCKETS];//正在问上游的领头解析，按当前任务哈希
+    struct Resolution* readyFollowers;//领头的已经问完、等着接着解析的跟随解析
+    struct Resolution* pendingPrefetches;//查缓存时发现要预取、还没开始问的预取解析
+    uint8_t buffer[BUF_SIZE + 2];//收发用的临时buffer
 };
 
 // Masks 用于读取和写入header，因为C语言的>>和<<的操作特点
@@ -130,15 +740,166 @@ unsigned int RCODE_MASK = 0x000F;
 
 unsigned char* resolveFile;//存储已知域名解析的文件
 unsigned char* serverFile;//存储权威服务器地址的文件
+unsigned char* resolveImageFile;//resolveFile编译成的二进制区域文件，存在而且不比resolveFile旧的话优先用它
+unsigned char* serverImageFile;//serverFile编译成的二进制区域文件
 unsigned char* cacheFile;//存储缓存解析结果的文件
 unsigned char* myIpAddr;//服务器要绑定的ip地址
 int isLocal;//服务器是不是local server，如果是local server，它在serverFile里没找到最佳匹配的话会去询问根。如果不是local server，找不到匹配就返回空了
 int isRecursive;//是否递归，递归实质上和所有的服务器都是local server相似，但递归服务器不会在找不到最佳匹配的情况下去问根
 
+//resolveFile在启动时加载成的内存索引
+struct ZoneIndex* resolveZone;
+//解析结果的内存缓存，启动时从cacheFile加载，之后每隔snapshotInterval秒写回cacheFile，0为不写回
+struct ResolverCache* resolverCache;
+int snapshotInterval;
+unsigned int negativeTtl = DEFAULT_NEGATIVE_TTL;
+int prefetchPercent = DEFAULT_PREFETCH_PERCENT;
+unsigned int prefetchMinHits = DEFAULT_PREFETCH_HITS;
+//serverFile在启动时构建成的授权trie
+//resolveZone和delegationTrie收到SIGHUP后会被换成重新加载的，读的时候每次调用只读一次指针，用局部变量存着
+struct DelegationTrie* delegationTrie;
+struct DomainName* rootDomainName;
+//每换一次区域数据加一，回复缓存发现它变了就整个清空
+unsigned int zoneGeneration;
+//所有事件循环，重新加载时要等它们都经过一次静止点才能释放旧的区域数据
+struct EventLoop** eventLoops;
+int eventLoopCount;
+pthread_mutex_t eventLoopsLock = PTHREAD_MUTEX_INITIALIZER;
+
+//0关闭查询日志，1每个请求记一行，2再像以前一样同步打印每个收发的报文，只用来调试，会大大拖慢服务器
+int queryLogLevel = 1;
+int queryLogSample = 1;//每queryLogSample个请求记一条
+FILE* queryLogFile;//默认是标准输出
+FILE* traceFile;//-T指定的解析轨迹文件，NULL为不记轨迹
+//日志线程保留的最近TRACE_RECENT条轨迹，指标端口上可以按请求ID查
+struct TraceLine recentTraces[TRACE_RECENT];
+unsigned int recentTraceNext;
+pthread_mutex_t recentTracesLock = PTHREAD_MUTEX_INITIALIZER;
+//上游服务器的平滑RTT
+struct RttTable serverRttTable = { .lock = PTHREAD_MUTEX_INITIALIZER };
+//区域索引和缓存共用的域名驻留表
+struct NameTable nameTable;
+
 //一个用来保存当前任务的链表，声明成全局的比较方便
 //如同一个packet携带了多个需要去解决的question
 //或者一个question需要迭代/递归地去解析，那么就需要用到这么一个链表去存储正在解析和接下来需要解析的域名
-struct Question* taskList;
+//现在每个请求的任务链表保存在各自的Resolution里，推进哪个解析时taskList就临时指向哪个解析的任务链表
+//多线程时每个线程同时推进各自的解析，所以taskList是每个线程一份的（__thread）
+__thread struct Question* taskList;
+//每个线程自己的随机数种子，rand()不是线程安全的，用rand_r
+//rand_r只用在挑服务器这种不怕被猜到的地方，请求ID和源端口用secureRandom
+__thread unsigned int randSeed;
+//secureRandom每次从内核取一批随机数放在这里，省得每个请求都做一次系统调用
+#define SECURE_RANDOM_BATCH 64
+__thread uint32_t secureRandomPool[SECURE_RANDOM_BATCH];
+__thread int secureRandomLeft;
+int threadCount = 1;//UDP服务线程数，0为CPU核数
+int udpBatchSize = DEFAULT_UDP_BATCH;//普通服务器每次系统调用最多收发的报文数
+
+//指标：每个事件循环一份计数器和延迟直方图，只有自己的线程写，不用锁也不用原子加，
+//metricsThread读的时候把所有事件循环的加起来，通过-M指定的端口用Prometheus的文本格式输出
+//直方图按HDR的做法分桶：以纳秒为单位，每个2的幂之间再均分成8个桶，误差不超过12.5%
+#define METRICS_SUB_BUCKETS 8
+#define METRICS_BUCKETS 336//最大到2^43纳秒，大约两个半小时
+#define METRICS_STAGE_PARSE 0
+#define METRICS_STAGE_ZONE 1//resolveFile的区域索引
+#define METRICS_STAGE_DELEGATION 2//授权trie
+#define METRICS_STAGE_CACHE 3//resolverCache和负缓存
+#define METRICS_STAGE_UPSTREAM 4//向上游的一次请求，从发出到收到回复
+#define METRICS_STAGE_ENCODE 5
+#define METRICS_STAGE_SEND 6//一次sendmmsg，或者TCP回复的一次发送
+#define METRICS_STAGES 7
+#define METRICS_QTYPES 6//A、NS、CNAME、PTR、MX、其他
+#define METRICS_RCODES 7//0到5、其他
+
+struct LatencyHistogram {
+    unsigned long buckets[METRICS_BUCKETS];
+    unsigned long count;
+    unsigned long sum;//纳秒
+};
+
+struct Metrics {
+    struct LatencyHistogram stages[METRICS_STAGES];
+    struct LatencyHistogram requests[METRICS_QTYPES][METRICS_RCODES];//从收到请求到回复发出，不含回复缓存
+    unsigned long answerCacheHits[METRICS_QTYPES][METRICS_RCODES];
+    unsigned long upstreamTimeouts;
+    unsigned long malformedRequests;
+    unsigned long coalescedQueries;
+    unsigned long cacheHits;
+    unsigned long cacheMisses;
+    unsigned long prefetchesStarted;
+    unsigned long prefetchesRefreshed;//预取问到了结果
+    unsigned long prefetchHits;//从预取放进来的记录回答的缓存命中
+};
+
+int metricsPort;//0为不开指标
+__thread struct Metrics* threadMetrics;//这个线程的事件循环的指标，没开指标时为NULL
+
+//只有一个线程写，读的线程可能同时在读，所以用不带锁前缀的原子写，保证读到的不是写了一半的值
+#define metricsAdd(counter, value) __atomic_store_n(&(counter), (counter) + (value), __ATOMIC_RELAXED)
+
+//没开指标时返回0，不调clock_gettime
+long metricsNow() {
+    struct timespec ts;
+    if (threadMetrics == NULL)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int latencyBucketOf(unsigned long ns) {
+    int k, index;
+    if (ns < METRICS_SUB_BUCKETS)
+        return ns;
+    k = 63 - __builtin_clzl(ns);//ns在[2^k, 2^(k+1))里
+    index = (k - 2) * METRICS_SUB_BUCKETS + ((ns >> (k - 3)) & (METRICS_SUB_BUCKETS - 1));
+    return index < METRICS_BUCKETS ? index : METRICS_BUCKETS - 1;
+}
+
+//第index个桶的上界（不含），纳秒
+unsigned long latencyBucketUpper(int index) {
+    int k, sub;
+    if (index < METRICS_SUB_BUCKETS)
+        return index + 1;
+    k = index / METRICS_SUB_BUCKETS + 2;
+    sub = index % METRICS_SUB_BUCKETS;
+    return (unsigned long)(METRICS_SUB_BUCKETS + sub + 1) << (k - 3);
+}
+
+void observeLatency(struct LatencyHistogram* histogram, long ns) {
+    if (ns < 0)
+        ns = 0;
+    metricsAdd(histogram->buckets[latencyBucketOf(ns)], 1);
+    metricsAdd(histogram->count, 1);
+    metricsAdd(histogram->sum, ns);
+}
+
+//start是metricsNow()的返回值
+void observeStage(int stage, long start) {
+    if (threadMetrics != NULL)
+        observeLatency(&threadMetrics->stages[stage], metricsNow() - start);
+}
+
+int metricsQtypeOf(unsigned short type) {
+    switch (type) {
+        case A_Resource_RecordType:
+            return 0;
+        case NS_Resource_RecordType:
+            return 1;
+        case CNAME_Resource_RecordType:
+            return 2;
+        case PTR_Resource_RecordType:
+            return 3;
+        case MX_Resource_RecordType:
+            return 4;
+        default:
+            return 5;
+    }
+}
+
+int metricsRcodeOf(unsigned short rcode) {
+    return rcode < METRICS_RCODES - 1 ? rcode : METRICS_RCODES - 1;
+}
 
 //内存操作，从buffer中读取1个字节的内容，并将buffer的指针向后移动一位，方便继续读取
 //为什么是**buffer呢，因为如果是buffer，那它就是一个普通的变量，你用这个函数修改它只在这个函数内生效，并不能做到移动指针的效果。
@@ -193,41 +954,71 @@ void put32bits(uint8_t** buffer, unsigned int value) {
     *buffer += 4;
 }
 
+//从arena里分配size字节清零的内存，按8字节对齐；arena为NULL时就是普通的malloc，需要调用者自己释放
+void* arenaAlloc(struct Arena* arena, size_t size) {
+    struct ArenaBlock* block;
+    void* p;
+
+    if (arena == NULL) {
+        p = malloc(size);
+        memset(p, 0, size);
+        return p;
+    }
+    size = (size + 7) & ~(size_t)7;
+    block = arena->current;
+    if (block == NULL || block->used + size > block->size) {
+        block = malloc(sizeof(struct ArenaBlock) + (size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE));
+        block->size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block->used = 0;
+        block->next = NULL;
+        if (arena->current)
+            arena->current->next = block;
+        else
+            arena->first = block;
+        arena->current = block;
+    }
+    p = block->data + block->used;
+    block->used += size;
+    memset(p, 0, size);
+    return p;
+}
+
+//在arena里复制一个以\0结尾的字符串，arena为NULL时等于strdup
+unsigned char* arenaStrdup(struct Arena* arena, unsigned char* str) {
+    size_t len = strlen(str) + 1;
+    unsigned char* copy = arenaAlloc(arena, len);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+//清空arena，之前分配的内存全部作废；第一块留着下次用，其余的还给系统
+void resetArena(struct Arena* arena) {
+    struct ArenaBlock* block;
+    struct ArenaBlock* next;
+
+    if (arena->first == NULL)
+        return;
+    for (block = arena->first->next; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+    arena->first->next = NULL;
+    arena->first->used = 0;
+    arena->current = arena->first;
+}
+
 //删除DomaiName链表，清理内存
+//只用来释放arena为NULL时分配的域名，每一段的字符串也是单独malloc的
 void freeDomainName(struct DomainName* dn) {
     struct DomainName* next;
     while (dn) {
-        if (dn->name != NULL) {
-            //free(dm->name);//有bug，先注释掉，会导致一些内存不被释放，运行时间久了占内存会越来越大，不过这只是一个运行几分钟的大作业而已不会有啥问题……
-        }
+        free(dn->name);
         next = dn->next;
         free(dn);
         dn = next;
     }
 }
 
-//删除ResourceRecord链表，清理内存
-void freeResourceRecords(struct ResourceRecord* rr) {
-    struct ResourceRecord* next;
-    while (rr) {
-        freeDomainName(rr->name);
-        next = rr->next;
-        free(rr);
-        rr = next;
-    }
-}
-
-//删除Question链表，清理内存
-void freeQuestions(struct Question* q) {
-    struct Question* next;
-    while (q) {
-        freeDomainName(q->name);
-        next = q->next;
-        free(q);
-        q = next;
-    }
-}
-
 //在从文件里读取的一整行内容中读取到两个分隔符之间的一个内容，并把指针后移
 unsigned char* readOnePartFromLine(unsigned char** buffer) {
     unsigned char* buf = *buffer;
@@ -282,31 +1073,19 @@ unsigned char* readLastPartFromLine(unsigned char** buffer) {
     return temp;
 }
 
-//将一个域名从15邮箱服务器6北邮6教育6中国0的字节码转换为邮箱服务器.北邮.教育.中国的字符串
-unsigned char* domainBytes2DomainStr(unsigned char* domain) {
-    uint8_t* buf = domain;
-    int i=0, j=0, len=0;
-    unsigned char* name;
-    name = malloc(sizeof(unsigned char)*BUF_SIZE);
-    memset(name,0,sizeof(unsigned char)*BUF_SIZE);
-
-    while (buf[i] != 0) {
-        if (i != 0) {
-            strncat(name, ".", 1);
-            j++;
-        }
-
-        len = buf[i];
-        i++;
-
-        memcpy(name+j, buf+i, len);
-        i += len;
-        j += len;
+//将一个域名从15邮箱服务器6北邮6教育6中国0的字节码转换为邮箱服务器.北邮.教育.中国的字符串，写进out，out至少256字节
+//以前每次都malloc一块BUF_SIZE的内存再strdup，打印一次报文就漏掉几百KB，现在由调用者给一块栈上的buffer
+void domainBytes2DomainStr(unsigned char* domain, unsigned char* out) {
+    int i = 0, j = 0;
+
+    while (domain[i] != 0) {
+        if (i != 0)
+            out[j++] = '.';
+        memcpy(out + j, domain + i + 1, domain[i]);
+        j += domain[i];
+        i += domain[i] + 1;
     }
-
-    name[j] = '\0';
-
-    return strdup(name);//复制这个字符串并返回复制的字符串的指针。之所以要复制这个字符串，是因为C语言同一个函数再次被调用的时候，变量们很大可能会使用跟上次一模一样的内存空间，这样的话上次运行此函数产生的结果就会被覆盖，所以需要把字符串复制一遍，返回这个复制体的指针。
+    out[j] = '\0';
 }
 
 //从北邮.教育.中国的字符串转换为6北邮6教育6中国0的字节码
@@ -334,367 +1113,382 @@ unsigned char* domainStr2DomainBytes(unsigned char* domain) {
     i += len;
     buf[i] = 0;
 
-    return strdup(buf);
+    beg = strdup(buf);
+    free(buf);
+    return beg;
 }
 
 //将字节码倒置后转换为DomainName结构体链表
 //倒置是因为在比较域名是否匹配时，需要从后段开始匹配
 //如北邮.教育.中国，需要先看中国，再看教育，最后看北邮，所以不如存成结构体的时候就倒过来存，方便比较
-//参数中的header是用于解压域名中的压缩指针的
-//因为压缩指针是指向某个域名第一次出现时相对于header的位置偏移，所以需要header的地址来做参照
-//压缩指针是一段两个字节长的内容，其中前两个bit是1，后面是长度，如果只有前两个bit是1，后面都是0的话，那么就是c000，
-//一般长度不会特别长，所以往往压缩指针是c0xx这样的。
-//另外，记得这种实现方式不支持嵌套指针。
-struct DomainName* domainBytes2DomainStructureFromPacket(uint8_t** buffer, uint8_t* header) {
-    uint8_t* buf = *buffer;
-    int i, j, first;
-    uint8_t len = 0;
-    struct DomainName* name = NULL;
-    name = malloc(sizeof(struct DomainName));
-    memset(name, 0, sizeof(struct DomainName));
-    struct DomainName* head = name;//最终返回的是这个head，因为过程中name在变
-    unsigned char* nameStr;
-
-    //用于将字节码反转的变量
-    uint8_t* bufNew;
-    uint8_t** reverse;
-    uint8_t lenReverse;
-    uint8_t* tempReverse;
-    int lenNew;
-    reverse = (uint8_t**)malloc(sizeof(uint8_t*) * BUF_SIZE);
-
-    //用于解压缩的变量
-    uint8_t* bufExpress;
-    int compressPointer = 0;//用来存储压缩指针，注意这个压缩指针不是C语言中的指针而是DNS的指针，它是一个相对于header首字节的位置偏移，所以用int类型存储就可以了
-    uint8_t* copyPointer;//用来存储接下来该读内存的哪里的指针
-    bufExpress = malloc(sizeof(uint8_t)*BUF_SIZE);
-    memset(bufExpress, 0, sizeof(uint8_t)*BUF_SIZE);
-    int bufferMoved = 0;//用来记录buffer到底移动了多少，在别的函数中你读取了多少字节buffer就应该移动多少字节，但是在压缩指针这里，一旦遇到压缩指针，buffer的位移就跟读取的字节数不相等了
-    int bufExpressLen = 0;//记录buf_express到底读了多长，也就用于最后给末尾补0
-
-    copyPointer = buf;
-
-    //开始解压缩
-    i = 0;
-    while (copyPointer[i]!=0) {
-        if (copyPointer[i]>=0xc0) {//大于c0则此处和下一个字节加起来是一个指针
-            compressPointer = copyPointer[i]*(16*16)+copyPointer[i+1]-0xc0*(16*16);//16*16是位移两个字节
-            copyPointer = header + compressPointer;
-            bufferMoved += i + 2;//2为压缩指针的字节数，这种写法只适合没有嵌套指针的情况
-            i = 0;//因为copyPointer变了，又得从那个指针位置之后的0点开始读起了所以需要把i重置为0
-        }
-        len = copyPointer[i];
-        memcpy(bufExpress+bufExpressLen,copyPointer+i,1);
-        i++;
-        bufExpressLen++;
-        memcpy(bufExpress+bufExpressLen,copyPointer+i,len);
-        i += len;
-        bufExpressLen += len;
-    }
-    bufExpress[bufExpressLen] = 0;
-
-    //开始反向存储，即字节码6北邮6教育6中国->6中国6教育6北邮，
-    //反向存储就是先分段存一个数组里，再倒过来从这个数组里取拼成一个字符串
-    bufNew = malloc(sizeof(uint8_t)*(strlen(bufExpress)+1));//因为strlen计算出的长度不包括最后的0所以需要+1
-    memset(bufNew, 0, sizeof(uint8_t)*(strlen(bufExpress)+1));
-    i = 0;
-    j = 0;
-    while (bufExpress[i] != 0) {
-        lenReverse = bufExpress[i];
-        tempReverse = malloc(sizeof(uint8_t)*(lenReverse+1+1));//开头的长度和结尾的\0
-        memset(tempReverse, 0, sizeof(uint8_t)*(lenReverse+1+1));
-        tempReverse[0] = bufExpress[i];
-        i++;
-        memcpy(tempReverse + 1, bufExpress + i, lenReverse);
-        reverse[j] = tempReverse;
-        i += lenReverse;
-        j++;
+//按顺序每读到一段就插到链表最前面，读完自然就是倒序的
+//输入是一段字符串，不会遇到压缩指针；packet里的域名用readNameLabels读
+//节点和每一段的字符串都分配在arena里，arena为NULL时用malloc
+struct DomainName* domainBytes2DomainStructureFromStr(struct Arena* arena, uint8_t* buffer) {
+    struct DomainName* head = NULL;
+    struct DomainName* name;
+    int i = 0;
+
+    while (buffer[i] != 0) {
+        name = arenaAlloc(arena, sizeof(struct DomainName));
+        name->len = buffer[i];
+        name->name = arenaAlloc(arena, name->len + 1);
+        memcpy(name->name, buffer + i + 1, name->len);
+        name->next = head;
+        head = name;
+        i += buffer[i] + 1;
     }
+    if (head == NULL)
+        head = arenaAlloc(arena, sizeof(struct DomainName));//根域名，用一个空的段表示
+    return head;
+}
 
-    lenNew = 0;
-    for(i = j - 1; i >= 0; i--) {
-        memcpy(bufNew + lenNew, reverse[i], strlen(reverse[i]));
-        lenNew += strlen(reverse[i]);
+//把按正常顺序的各段（labels[0]是最左边那段）规范化成key：写成字节码，ASCII字母转成小写，再从后往前算出每个后缀的哈希
+//用的是FNV-1a，每一段先把长度哈希进去，这样"ab"+"c"和"a"+"bc"就不会算成一样的
+//后缀的哈希只和后缀本身有关，所以驻留表里的"教育.中国"和查询"北邮.教育.中国"时算出来的那个后缀的哈希是一样的
+//域名超过255字节返回-1
+int nameKeyFromLabels(unsigned char** labels, uint8_t* lens, int count, struct NameKey* key) {
+    unsigned int hash = 2166136261u;
+    int i, j, len = 0;
+    uint8_t c;
+
+    for (i = 0; i < count; i++) {
+        if (len + 1 + lens[i] + 1 > 255)
+            return -1;
+        key->labels[i] = len;
+        key->wire[len++] = lens[i];
+        for (j = 0; j < lens[i]; j++) {
+            c = labels[i][j];
+            key->wire[len++] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+        }
     }
-
-    //开始将字节码存成链表
-    first = 1;
-    i = 0;
-    while (bufNew[i] != 0) {
-        if (!first) {
-            name->next = malloc(sizeof(struct DomainName));
-            memset(name->next, 0, sizeof(struct DomainName));
-            name = name->next;
+    key->wire[len++] = 0;
+    key->len = len;
+    key->labelCount = count;
+
+    key->hashes[count] = hash;
+    for (i = count - 1; i >= 0; i--) {
+        for (j = key->labels[i]; j < key->labels[i] + 1 + key->wire[key->labels[i]]; j++) {
+            hash ^= key->wire[j];
+            hash *= 16777619u;
         }
-        first = 0;
-        len = bufNew[i];
-        i++;
-        nameStr = malloc(sizeof(unsigned char)*(len+1));
-        memset(nameStr, 0, sizeof(unsigned char)*(len+1));
-        memcpy(nameStr, bufNew+i, len);
-        nameStr[len] = '\0';
-        name->name = nameStr;
-        name->len = len;
-        i += len;
+        key->hashes[i] = hash;
     }
-    if (bufferMoved!=0)
-        *buffer += bufferMoved;
-    else
-        *buffer += i + 1; //+1为最后的0
-
-    name->next = NULL;
-    return head;
+    return 0;
 }
 
-//跟上面那个函数基本一样，区别是输入源是一段字符串因此不需要移动buffer，而且肯定不会遇到压缩指针
-struct DomainName* domainBytes2DomainStructureFromStr(uint8_t* buffer) {
-    uint8_t* buf = buffer;
-    int i, j, first;
-    uint8_t len = 0;
-    struct DomainName* name = NULL;
-    name = malloc(sizeof(struct DomainName));
-    memset(name, 0, sizeof(struct DomainName));
-    struct DomainName* head = name;
-    unsigned char* nameStr;
-
-    //用于将字节码反转的变量
-    uint8_t* bufNew;
-    uint8_t** reverse;
-    uint8_t lenReverse;
-    uint8_t* tempReverse;
-    int lenNew;
-    reverse = (uint8_t**)malloc(sizeof(uint8_t*) * 10);//一个域名最长不会有10段吧
-
-    bufNew = malloc(sizeof(uint8_t)*strlen(buf)+1);//最后的\0
-    memset(bufNew, 0, sizeof(uint8_t)*strlen(buf)+1);
-    i = 0;
-    j = 0;
-    while (buf[i] != 0) {
-        lenReverse = buf[i];
-        tempReverse = malloc(sizeof(uint8_t)*(lenReverse+1+1));
-        memset(tempReverse, 0, sizeof(uint8_t)*(lenReverse+1+1));
-        tempReverse[0] = buf[i];
-        i++;
-        memcpy(tempReverse + 1, buf + i, lenReverse);
-        reverse[j] = tempReverse;
-        i += lenReverse;
-        j += 1;
+//倒序的DomainName链表先倒回正常顺序，再按nameKeyFromLabels规范化
+int nameKeyFromDomainName(struct DomainName* domainName, struct NameKey* key) {
+    unsigned char* labels[MAX_LABELS];
+    uint8_t lens[MAX_LABELS];
+    struct DomainName* label;
+    int count = 0, i;
+
+    for (label = domainName; label != NULL && label->len > 0; label = label->next) {
+        if (count >= MAX_LABELS)
+            return -1;
+        count++;
     }
+    i = count;
+    for (label = domainName; i > 0; label = label->next) {
+        i--;
+        labels[i] = label->name;
+        lens[i] = label->len;
+    }
+    return nameKeyFromLabels(labels, lens, count, key);
+}
 
-    lenNew = 0;
-    for(i = j - 1; i >= 0; i--) {
-        memcpy(bufNew + lenNew, reverse[i], strlen(reverse[i]));
-        lenNew += strlen(reverse[i]);
+void initNameTable(struct NameTable* table) {
+    struct NameShard* shard;
+    int i;
+    for (i = 0; i < NAME_SHARDS; i++) {
+        shard = &table->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->bucketCount = NAME_INIT_BUCKETS;
+        shard->buckets = malloc(sizeof(struct Name*) * shard->bucketCount);
+        memset(shard->buckets, 0, sizeof(struct Name*) * shard->bucketCount);
+        shard->count = 0;
     }
+}
+
+//分片用哈希值的高4位，桶用低位
+struct NameShard* nameShardOf(unsigned int hash) {
+    return &nameTable.shards[hash >> 28];
+}
 
-    first = 1;
-    i = 0;
-    while (bufNew[i] != 0) {
-        if (!first) {
-            name->next = malloc(sizeof(struct DomainName));
-            memset(name->next, 0, sizeof(struct DomainName));
-            name = name->next;
+void growNameShard(struct NameShard* shard) {
+    struct Name** oldBuckets = shard->buckets;
+    unsigned int oldCount = shard->bucketCount;
+    struct Name* name;
+    struct Name* next;
+    unsigned int i, bucket;
+
+    shard->bucketCount = oldCount * 2;
+    shard->buckets = malloc(sizeof(struct Name*) * shard->bucketCount);
+    memset(shard->buckets, 0, sizeof(struct Name*) * shard->bucketCount);
+    for (i = 0; i < oldCount; i++) {
+        for (name = oldBuckets[i]; name; name = next) {
+            next = name->next;
+            bucket = name->hash & (shard->bucketCount - 1);
+            name->next = shard->buckets[bucket];
+            shard->buckets[bucket] = name;
         }
-        first = 0;
-        len = bufNew[i];
-        i++;
-        nameStr = malloc(sizeof(unsigned char)*(len+1));
-        memset(nameStr, 0, sizeof(unsigned char)*(len+1));
-        memcpy(nameStr, bufNew+i, len);
-        nameStr[len] = '\0';
-        name->name = nameStr;
-        name->len = len;
-        i += len;
     }
+    free(oldBuckets);
+}
 
-    name->next = NULL;
-    return head;
+//在分片里找key从第k段开始的后缀，调用者要拿着分片的锁
+struct Name* findNameInShard(struct NameShard* shard, struct NameKey* key, int k) {
+    struct Name* name;
+    unsigned int hash = key->hashes[k];
+    int len = key->len - (k < key->labelCount ? key->labels[k] : key->len - 1);
+
+    for (name = shard->buckets[hash & (shard->bucketCount - 1)]; name; name = name->next)
+        if (name->hash == hash && name->len == len && memcmp(name->wire, key->wire + key->len - len, len) == 0)
+            return name;
+    return NULL;
 }
 
-//将DomainName链表写入buffer
-//参数中包含CompressPointerInfo结构体和header指针，用于DNS的压缩指针
-void putDomainName2Buffer(uint8_t** buffer, struct DomainName* domainName, struct CompressPointerInfo* domainNameStr, uint8_t* header) {
-    uint8_t* buf = *buffer;
-    uint8_t* bufOrig;
-    uint8_t* bufNew;
-    struct DomainName* domain = domainName;
-    int len;
-    int i,j;
-    uint8_t** reverse;
-    uint8_t len_reverse;
-    uint8_t* temp_reverse;
-    int lengthNew = 0;
-    int position = -1;
-    int position2 = -1;
-    unsigned char* substring;
-    unsigned char* substring2;
-    int hasCPflag = 0;
-
-    //读一遍长度，就是为了后面分配内存。。。
-    len = 0;
-    while (domain->next != NULL) {
-        len++;
-        len+=domain->len;
-        domain = domain->next;
-    }
-    len++;
-    len+=domain->len;
-    len++;
-
-    bufOrig = malloc(sizeof(uint8_t)*len);
-    memset(bufOrig,0,sizeof(uint8_t)*len);
-    domain = domainName;
-
-    i = 0;
-
-    while (domain->next != NULL) {
-        bufOrig[i] = domain->len;
-        i++;
-        memcpy(bufOrig+i,domain->name,domain->len);
-        i+=domain->len;
-        domain = domain->next;
-    }
-    bufOrig[i] = domain->len;
-    i++;
-    memcpy(bufOrig+i,domain->name,domain->len);
-
-    i = 0;
-    j = 0;
-    bufNew = malloc(sizeof(uint8_t)*(len+1));
-    memset(bufNew, 0, sizeof(uint8_t)*(len+1));
-    reverse = (uint8_t**)malloc(sizeof(uint8_t*) * BUF_SIZE);
-
-    //开始反向
-    while (bufOrig[i] != 0) {
-        len_reverse = bufOrig[i];
-
-        temp_reverse = malloc(sizeof(uint8_t)*(len_reverse+1+1));//一个是开头的长度，另一个是字符串结尾的\0
-        memset(temp_reverse, 0, sizeof(uint8_t)*(len_reverse+1+1));
-        temp_reverse[0] = bufOrig[i];
-        i += 1;
-        memcpy(temp_reverse + 1, bufOrig + i, len_reverse);
-        reverse[j] = temp_reverse;
-        i += len_reverse;
-        j += 1;
-    }
-    for(i = j - 1; i >= 0; i--) {
-        memcpy(bufNew + lengthNew, reverse[i], strlen(reverse[i]));
-        lengthNew += strlen(reverse[i]);
-    }
-
-    //开始压缩指针
-    if(domainNameStr!=NULL) {
-        if(domainNameStr->pos!=0) {
-            hasCPflag = 1;
-        }
-    }
-    if(hasCPflag) {
-        substring = domainNameStr->name;
-        while (substring[0]!='\0') {
-            substring2 = strstr(bufNew,substring);
-            if (substring2!=NULL) {
-                position = strlen(domainNameStr->name)-strlen(substring2);
-                position2 = strlen(bufNew)-strlen(substring2);
-                break;
-            } else {
-                substring += (uint8_t)substring[0]+1;
-            }
+//在驻留表里找key从第k段开始的后缀，k为0就是整个域名；找到了引用计数加一后返回，用完要releaseName
+//找不到返回NULL，说明区域索引和缓存里都不可能有这个域名
+struct Name* acquireName(struct NameKey* key, int k) {
+    struct NameShard* shard = nameShardOf(key->hashes[k]);
+    struct Name* name;
+
+    pthread_mutex_lock(&shard->lock);
+    name = findNameInShard(shard, key, k);
+    if (name)
+        name->refs++;
+    pthread_mutex_unlock(&shard->lock);
+    return name;
+}
+
+//引用计数减一，归0的话从表里删掉，再放掉它对parent的引用
+void releaseName(struct Name* name) {
+    struct NameShard* shard;
+    struct Name** pos;
+    struct Name* parent;
+
+    while (name) {
+        shard = nameShardOf(name->hash);
+        pthread_mutex_lock(&shard->lock);
+        if (--name->refs > 0) {
+            pthread_mutex_unlock(&shard->lock);
+            return;
         }
+        pos = &shard->buckets[name->hash & (shard->bucketCount - 1)];
+        while (*pos != name)
+            pos = &(*pos)->next;
+        *pos = name->next;
+        shard->count--;
+        pthread_mutex_unlock(&shard->lock);
+        parent = name->parent;
+        free(name);
+        name = parent;
     }
-    else if (header!=NULL) {
-        //如果header不是null却没有cp，那么就是希望现在将当前的domainName填入cp里
-        domainNameStr->name = strdup(bufNew);
-        domainNameStr->pos = *buffer - header;
-    }
-    if (position>=0 && position2>=0) {
-        memcpy(buf, bufNew, position2);//position2是子串在原字符串的相对位置，也就是长度
-        *buffer += position2;
-        int fields = 0;
-        fields |= (1 << 15) & 0x8000;
-        fields |= (1 << 14) & 0x4000;
-        fields += domainNameStr->pos+position;//指针真正指向的位置，是原本的pos加上position偏移
-        put16bits(buffer,fields);
+}
+
+//把key从第k段开始的后缀驻留进表里，已经有了就直接用，返回时引用计数已经加一
+//新建的时候先把去掉第一段的parent驻留好，子域名持有parent的一个引用
+struct Name* internName(struct NameKey* key, int k) {
+    struct NameShard* shard = nameShardOf(key->hashes[k]);
+    struct Name* name;
+    struct Name* parent = NULL;
+    unsigned int bucket;
+    int len, i;
+
+    name = acquireName(key, k);
+    if (name)
+        return name;
+    if (k < key->labelCount)
+        parent = internName(key, k + 1);
+
+    pthread_mutex_lock(&shard->lock);
+    name = findNameInShard(shard, key, k);//没拿锁的这段时间里可能已经被别的线程驻留了
+    if (name) {
+        name->refs++;
+        pthread_mutex_unlock(&shard->lock);
+        if (parent)
+            releaseName(parent);
+        return name;
     }
-    else {
-        memcpy(buf, bufNew, len);
-        buf[len] = 0;
-        *buffer += len;
+    len = key->len - (k < key->labelCount ? key->labels[k] : key->len - 1);
+    name = malloc(sizeof(struct Name) + len + (key->labelCount - k));
+    name->hash = key->hashes[k];
+    name->refs = 1;
+    name->parent = parent;
+    name->len = len;
+    name->labelCount = key->labelCount - k;
+    memcpy(name->wire, key->wire + key->len - len, len);
+    name->labels = name->wire + len;
+    for (i = 0; i < name->labelCount; i++)
+        name->labels[i] = key->labels[k + i] - key->labels[k];
+    bucket = name->hash & (shard->bucketCount - 1);
+    name->next = shard->buckets[bucket];
+    shard->buckets[bucket] = name;
+    shard->count++;
+    if (shard->count > shard->bucketCount * 2)
+        growNameShard(shard);
+    pthread_mutex_unlock(&shard->lock);
+    return name;
+}
+
+//把驻留的域名变成倒序的DomainName链表，节点用调用者给的nodes（至少MAX_LABELS个），每段的name直接指向wire，不分配内存
+//要留下来的话用copyDomainName复制
+struct DomainName* name2DomainName(struct Name* name, struct DomainName* nodes) {
+    int count = name->labelCount, i;
+    uint8_t* label;
+
+    if (count == 0)
+        return NULL;
+    for (i = 0; i < count; i++) {
+        label = name->wire + name->labels[count - 1 - i];
+        nodes[i].name = label + 1;
+        nodes[i].len = label[0];
+        nodes[i].next = (i + 1 < count) ? &nodes[i + 1] : NULL;
     }
+    return nodes;
 }
 
-//用于MX、CNAME以及可能的NS、PTR，和上面的类似，将域名存入buffer，不同的是参数是一个已经整理好的6北邮6教育6中国的字节码而非结构体，
-//且具有返回值，是长度，因为可能会用上压缩指针导致长度发生变化
-int putDomainNameOfRD2Buffer(uint8_t** buffer, unsigned char* bufNew, struct CompressPointerInfo* cp, uint8_t* header) {
-    uint8_t* buf = *buffer;
-    int len = strlen(bufNew)+1;
-
-    int position = -1;
-    int position2 = -1;
-    unsigned char* substring;
-    unsigned char* substring2;
-
-    int hasCPflag = 0;
-    if(cp!=NULL){
-        if(cp->pos!=0) {
-            hasCPflag = 1;
-        }
-    }
-    if(hasCPflag) {
-        substring = cp->name;
-        while (substring[0]!='\0') {
-            substring2 = strstr(bufNew,substring);
-            if (substring2!=NULL) {
-                position = strlen(cp->name)-strlen(substring2);
-                position2 = strlen(bufNew)-strlen(substring2);
+//开始写一个报文之前清空压缩表，header是报文的开头，压缩指针都是相对它的偏移
+void initCompressionTable(struct CompressionTable* table, uint8_t* header) {
+    table->header = header;
+    table->count = 0;
+    table->nameCount = 0;
+    memset(table->buckets, 0xff, sizeof(table->buckets));//全部置为-1
+}
+
+//报文写完之后放掉压缩表拿着的驻留引用
+void releaseCompressionTable(struct CompressionTable* table) {
+    int i;
+    for (i = 0; i < table->nameCount; i++)
+        releaseName(table->names[i]);
+    table->nameCount = 0;
+}
+
+//在压缩表里找suffix这个后缀，返回它的编号，没有返回-1
+int findCompressionEntry(struct CompressionTable* table, struct Name* suffix) {
+    int i;
+
+    for (i = table->buckets[suffix->hash & (COMPRESSION_BUCKETS - 1)]; i >= 0; i = table->entries[i].next)
+        if (table->entries[i].suffix == suffix)
+            return i;
+    return -1;
+}
+
+//把一个域名按正常顺序的各段（labels[0]是最左边那段）写进buffer，能压缩就压缩，返回写了多少字节
+//先把域名驻留，从整个域名开始沿parent链在压缩表里找最长的已经写过的后缀，前面没匹配上的段原样写出来，匹配上的部分换成一个指向它的压缩指针
+//比较的是驻留后的指针，所以大小写不同的同一个域名也能压缩
+//新写出来的每一段和它后面的部分又是一个新的后缀，加进压缩表给后面的域名参照；表记满了之后写的域名还会压缩，只是不再加进去
+int putLabels2Buffer(uint8_t** buffer, unsigned char** labels, uint8_t* lens, int count, struct CompressionTable* table) {
+    uint8_t* start = *buffer;
+    unsigned short offsets[MAX_LABELS];
+    struct Name* suffixes[MAX_LABELS];
+    struct Name* leaf = NULL;
+    struct Name* suffix;
+    struct CompressionEntry* entry;
+    struct NameKey key;
+    unsigned int bucket;
+    int i, matched = count, found = -1, added = 0;
+
+    if (table != NULL && table->header != NULL && nameKeyFromLabels(labels, lens, count, &key) == 0)
+        leaf = internName(&key, 0);
+    if (leaf) {
+        for (i = 0, suffix = leaf; i < count; i++, suffix = suffix->parent) {
+            found = findCompressionEntry(table, suffix);
+            if (found >= 0) {
+                matched = i;
                 break;
-            } else {
-                substring += (uint8_t)substring[0]+1;
             }
+            suffixes[i] = suffix;
         }
     }
-    else if (header!=NULL) {
-        //如果header不是null却没有cp，那么就是希望现在将当前的domainName填入cp里
-        cp->name = strdup(bufNew);
-        cp->pos = *buffer - header;
-    }
 
-    if (position>=0 && position2>=0) {
-        memcpy(buf, bufNew, position2);//position2是子串在原字符串的相对位置，也就是长度
-        *buffer += position2;
-        int fields = 0;
-        fields |= (1 << 15) & 0x8000;
-        fields |= (1 << 14) & 0x4000;
-        fields += cp->pos+position;//指针真正指向的位置，是原本的pos加上position偏移
-        put16bits(buffer,fields);
-        return position2+2;//2是fields的长度，也就是压缩指针的长度
+    for (i = 0; i < matched; i++) {
+        if (leaf)
+            offsets[i] = (*buffer - table->header) > COMPRESSION_MAX_OFFSET ? 0 : *buffer - table->header;
+        put8bits(buffer, lens[i]);
+        memcpy(*buffer, labels[i], lens[i]);
+        *buffer += lens[i];
     }
-    else {
-        memcpy(buf, bufNew, len);
-        buf[len] = 0;
-        *buffer += len;
-        return len;
+    if (matched < count)
+        put16bits(buffer, 0xc000 | table->entries[found].offset);
+    else
+        put8bits(buffer, 0);
+
+    if (leaf) {
+        for (i = 0; i < matched && table->count < COMPRESSION_MAX_ENTRIES; i++) {
+            if (offsets[i] == 0)
+                continue;//超出了指针能指到的范围，不能被指向
+            bucket = suffixes[i]->hash & (COMPRESSION_BUCKETS - 1);
+            entry = &table->entries[table->count];
+            entry->suffix = suffixes[i];
+            entry->offset = offsets[i];
+            entry->next = table->buckets[bucket];
+            table->buckets[bucket] = table->count++;
+            added = 1;
+        }
+        if (added)
+            table->names[table->nameCount++] = leaf;//每个域名至少加了一项才留着引用，所以names不会比entries先满
+        else
+            releaseName(leaf);
+    }
+    return *buffer - start;
+}
+
+//将DomainName链表写入buffer，table不为NULL时用它压缩，并把写出来的后缀加进去
+//链表是倒序的（中国->教育->北邮），写进报文要倒回来
+void putDomainName2Buffer(uint8_t** buffer, struct DomainName* domainName, struct CompressionTable* table) {
+    unsigned char* labels[MAX_LABELS];
+    uint8_t lens[MAX_LABELS];
+    struct DomainName* domain;
+    int count = 0, i;
+
+    for (domain = domainName; domain != NULL && count < MAX_LABELS; domain = domain->next)
+        count++;
+    i = count;
+    for (domain = domainName; domain != NULL && i > 0; domain = domain->next) {
+        i--;
+        labels[i] = domain->name;
+        lens[i] = domain->len;
     }
+    putLabels2Buffer(buffer, labels, lens, count, table);
 }
 
-unsigned char* domainStructure2DomainBytes(struct DomainName* domainName) {
-    struct DomainName* domain = domainName;
-    unsigned char* nameStr;
-    nameStr = malloc(sizeof(unsigned char)*BUF_SIZE);
-    memset(nameStr, 0, sizeof(unsigned char)*BUF_SIZE);
-    unsigned char* origNameStr = nameStr;//指针的原位置，因为putDomainName2Buffer函数会移动指针
-    putDomainName2Buffer(&nameStr, domain, NULL, NULL);//这个函数在将domain写入nameStr的时候，会移动nameStr的指针的位置
-    return origNameStr;
+//用于MX、CNAME、NS、PTR这些rdata里的域名，和上面的类似，不同的是参数是一个已经整理好的6北邮6教育6中国0的字节码而非结构体，
+//且具有返回值，是长度，因为可能会用上压缩指针导致长度发生变化
+int putDomainNameOfRD2Buffer(uint8_t** buffer, unsigned char* bytes, struct CompressionTable* table) {
+    unsigned char* labels[MAX_LABELS];
+    uint8_t lens[MAX_LABELS];
+    int count = 0, i = 0;
+
+    while (bytes[i] != 0 && count < MAX_LABELS) {
+        lens[count] = bytes[i];
+        labels[count] = bytes + i + 1;
+        i += bytes[i] + 1;
+        count++;
+    }
+    return putLabels2Buffer(buffer, labels, lens, count, table);
 }
 
-unsigned char* getDomainNameStr(struct DomainName* domainName) {
-    return strdup(domainBytes2DomainStr(domainStructure2DomainBytes(domainName)));
+//把域名写成北邮.教育.中国这样的字符串，out至少256字节
+void getDomainNameStr(struct DomainName* domainName, unsigned char* out) {
+    uint8_t bytes[256];
+    uint8_t* p = bytes;
+    putDomainName2Buffer(&p, domainName, NULL);//这个函数在将domain写入bytes的时候，会移动p的位置
+    domainBytes2DomainStr(bytes, out);
 }
 
-void printRR(struct ResourceRecord* rr) {
-    int i;
-    while (rr) {
+//打印一个部分的count条记录
+void printRR(struct ResourceRecord* records, int count) {
+    struct ResourceRecord* rr;
+    unsigned char name[256];
+    int i, j;
+    for (j = 0; j < count; j++) {
+        rr = &records[j];
+        getDomainNameStr(rr->name, name);
         printf("RR 名称:%s，类型:%u，类别:%u，TTL:%d，rd_length:%u，",
-               getDomainNameStr(rr->name),
+               name,
                rr->type,
                rr->class,
                rr->ttl,
@@ -709,54 +1503,58 @@ void printRR(struct ResourceRecord* rr) {
                 printf("\n");
                 break;
             case CNAME_Resource_RecordType:
-                printf("CNAME name:%s\n", getDomainNameStr(domainBytes2DomainStructureFromStr(rd->cname_record.name)));
+                domainBytes2DomainStr(rd->cname_record.name, name);
+                printf("CNAME name:%s\n", name);
                 break;
             case PTR_Resource_RecordType:
                 printf("PTR name:%s\n", rd->ptr_record.name);
                 break;
             case MX_Resource_RecordType:
-                printf("MX preference:%u exchange:%s\n", rd->mx_record.preference, getDomainNameStr(domainBytes2DomainStructureFromStr(rd->mx_record.exchange)));
+                domainBytes2DomainStr(rd->mx_record.exchange, name);
+                printf("MX preference:%u exchange:%s\n", rd->mx_record.preference, name);
                 break;
             default:
                 printf("未知类型\n");
         }
-        rr = rr->next;
     }
 }
 
 void printMessage(struct Message* msg) {
+    unsigned char name[256];
     printf("请求ID: %02x，", msg->id);
     printf("问题数: %u，", msg->qCount);
     printf("回答数: %u，", msg->ansCount);
     printf("权威服务器数: %u，", msg->auCount);
     printf("附加数: %u\n", msg->adCount);
     printf("\n");
-    struct Question* q = msg->questions;
-    while (q) {
-        printf("问题:名称:%s，", getDomainNameStr(q->name));
-        printf("类型:%u，",q->type);
-        printf("类别:%u\n",q->class);
-        q = q->next;
+    int i;
+    for (i = 0; i < msg->qCount; i++) {
+        getDomainNameStr(msg->questions[i].name, name);
+        printf("问题:名称:%s，", name);
+        printf("类型:%u，",msg->questions[i].type);
+        printf("类别:%u\n",msg->questions[i].class);
     }
     if(msg->ansCount>0) {
         printf("\n回答:\n");
-        printRR(msg->answers);
+        printRR(msg->answers, msg->ansCount);
     }
     if(msg->auCount>0) {
         printf("\n权威服务器:\n");
-        printRR(msg->authorities);
+        printRR(msg->authorities, msg->auCount);
     }
     if(msg->adCount>0) {
         printf("\n附加:\n");
-        printRR(msg->additionals);
+        printRR(msg->additionals, msg->adCount);
     }
 }
 
-void writeRR(struct ResourceRecord* rr, uint8_t** buffer, struct CompressPointerInfo* cp, uint8_t* header) {
-    int i,new_rd_length;
+void writeRR(struct ResourceRecord* records, int count, uint8_t** buffer, struct CompressionTable* table) {
+    struct ResourceRecord* rr;
+    int i,j,new_rd_length;
     uint8_t* rd_length_pos;
-    while (rr) {
-        putDomainName2Buffer(buffer, rr->name, cp, header);
+    for (j = 0; j < count; j++) {
+        rr = &records[j];
+        putDomainName2Buffer(buffer, rr->name, table);
         put16bits(buffer, rr->type);
         put16bits(buffer, rr->class);
         put32bits(buffer, rr->ttl);
@@ -770,18 +1568,18 @@ void writeRR(struct ResourceRecord* rr, uint8_t** buffer, struct CompressPointer
                 break;
             case MX_Resource_RecordType:
                 put16bits(buffer,rr->rd_data.mx_record.preference);
-                new_rd_length = putDomainNameOfRD2Buffer(buffer, rr->rd_data.mx_record.exchange, cp, header);
+                new_rd_length = putDomainNameOfRD2Buffer(buffer, rr->rd_data.mx_record.exchange, table);
                 put16bits(&rd_length_pos,new_rd_length+2);//2为preference长度
                 break;
             case CNAME_Resource_RecordType:
-                new_rd_length = putDomainNameOfRD2Buffer(buffer, rr->rd_data.cname_record.name, cp, header);
+                new_rd_length = putDomainNameOfRD2Buffer(buffer, rr->rd_data.cname_record.name, table);
                 put16bits(&rd_length_pos,new_rd_length);
                 break;
             default:
-                printf("未知类型 %u, 忽略\n", rr->type);
+                if (queryLogLevel >= 2)
+                    printf("未知类型 %u, 忽略\n", rr->type);
                 break;
         }
-        rr = rr->next;
     }
 }
 
@@ -791,6 +1589,7 @@ void writeHeader(struct Message* msg, uint8_t** buffer) {
         msg->rcode = NameError_ResponseType;
     int fields = 0;
     fields |= (msg->qr << 15) & QR_MASK;
+    fields |= (msg->opcode << 11) & OPCODE_MASK;//回复里的opcode和请求一样
     fields |= (msg->aa << 10) & AA_MASK;
     fields |= (msg->rd << 8) & RD_MASK;
     fields |= (msg->ra << 7) & RA_MASK;
@@ -802,790 +1601,4516 @@ void writeHeader(struct Message* msg, uint8_t** buffer) {
     put16bits(buffer, msg->adCount);
 }
 
-void readSection(struct Message* msg, uint8_t** buffer, int section, unsigned short count, uint8_t* header) {
-    if (count<=0)
-        return;
-    int i,j;
-    struct ResourceRecord* rr;
-    for (i = 0; i < count; ++i) {
-        rr = malloc(sizeof(struct ResourceRecord));
-        memset(rr, 0, sizeof(struct ResourceRecord));
-        rr->name = domainBytes2DomainStructureFromPacket(buffer, header);
-        rr->type = get16bits(buffer);
-        rr->class = get16bits(buffer);
-        rr->ttl = get32bits(buffer);
-        rr->rd_length = get16bits(buffer);
-        switch (rr->type) {
-            case A_Resource_RecordType:
-                for(j = 0; j < 4; ++j)
-                    rr->rd_data.a_record.addr[j] = get8bits(buffer);
-                break;
-
-            case MX_Resource_RecordType:
-                rr->rd_data.mx_record.preference = get16bits(buffer);
-                rr->rd_data.mx_record.exchange = domainStructure2DomainBytes(
-                        domainBytes2DomainStructureFromPacket(buffer, header));
-                break;
-
-            case CNAME_Resource_RecordType:
-                rr->rd_data.cname_record.name = domainStructure2DomainBytes(
-                        domainBytes2DomainStructureFromPacket(buffer, header));
-                break;
-
-            default:
-                printf("未知类型 %u, 忽略\n", rr->type);
-                break;
-        }
-        if (section == 1) {
-            rr->next = msg->answers;
-            msg->answers = rr;
-        }
-        else if (section == 2) {
-            rr->next = msg->authorities;
-            msg->authorities = rr;
-        }
-        else if (section == 3) {
-            rr->next = msg->additionals;
-            msg->additionals = rr;
-        }
+void writeBuffer(struct Message* msg, uint8_t** buffer) {
+    struct CompressionTable table;
+    int i;
+    initCompressionTable(&table, *buffer);
+    writeHeader(msg, buffer);
+    for (i = 0; i < msg->qCount; i++) {
+        putDomainName2Buffer(buffer, msg->questions[i].name, &table);
+        put16bits(buffer, msg->questions[i].type);
+        put16bits(buffer, msg->questions[i].class);
     }
+    writeRR(msg->answers, msg->ansCount, buffer, &table);
+    writeRR(msg->authorities, msg->auCount, buffer, &table);
+    writeRR(msg->additionals, msg->adCount, buffer, &table);
+    releaseCompressionTable(&table);
 }
 
-void readQuestion(struct Message* msg, uint8_t** buffer, uint8_t* header) {
-    int i;
-    for (i = 0; i < msg->qCount; ++i) {
-        struct Question* q;
-        q = malloc(sizeof(struct Question));
-        memset(q, 0, sizeof(struct Question));
-        q->name = domainBytes2DomainStructureFromPacket(buffer, header);
-        q->type = get16bits(buffer);
-        q->class = get16bits(buffer);
-        q->next = msg->questions;
-        msg->questions = q;
-    }
-}
-
-void readHeader(struct Message* msg, uint8_t** buffer) {
-    msg->id = get16bits(buffer);
-    unsigned int fields = get16bits(buffer);
-    msg->qr = (fields & QR_MASK) >> 15;
-    msg->opcode = (fields & OPCODE_MASK) >> 11;
-    msg->aa = (fields & AA_MASK) >> 10;
-    msg->tc = (fields & TC_MASK) >> 9;
-    msg->rd = (fields & RD_MASK) >> 8;
-    msg->ra = (fields & RA_MASK) >> 7;
-    msg->rcode = (fields & RCODE_MASK) >> 0;
-    msg->qCount = get16bits(buffer);
-    msg->ansCount = get16bits(buffer);
-    msg->auCount = get16bits(buffer);
-    msg->adCount = get16bits(buffer);
+//在msg的一个部分（answers、authorities或additionals）末尾加一条清零的记录，返回它的指针
+//数组满了就在arena里分配一个两倍大的新数组，把原来的记录搬过去，旧的那块等arena清空时一起回收
+struct ResourceRecord* addRecord(struct Message* msg, struct ResourceRecord** section, unsigned short* count, unsigned short* cap) {
+    struct ResourceRecord* records;
+
+    if (*count >= *cap) {
+        *cap = *cap ? *cap * 2 : 4;
+        records = arenaAlloc(msg->arena, sizeof(struct ResourceRecord) * *cap);
+        if (*count > 0)
+            memcpy(records, *section, sizeof(struct ResourceRecord) * *count);
+        *section = records;
+    }
+    records = &(*section)[(*count)++];
+    memset(records, 0, sizeof(struct ResourceRecord));
+    return records;
 }
 
-void writeBuffer(struct Message* msg, uint8_t** buffer) {
-    struct Question* q;
-    uint8_t* header = *buffer;
-    struct CompressPointerInfo cp;
-    writeHeader(msg, buffer);
-    q = msg->questions;
-    while (q) {
-        putDomainName2Buffer(buffer, q->name, &cp, header);
-        put16bits(buffer, q->type);
-        put16bits(buffer, q->class);
-        q = q->next;
+//复制一个DomainName链表的前count段，索引里存的链表和查询结果里的链表互相独立，各自释放
+//查询结果复制进请求的arena，arena为NULL时用malloc
+struct DomainName* copyDomainNamePrefix(struct Arena* arena, struct DomainName* domainName, int count) {
+    struct DomainName* head = NULL;
+    struct DomainName** tail = &head;
+    struct DomainName* name;
+    while (domainName && count > 0) {
+        name = arenaAlloc(arena, sizeof(struct DomainName));
+        name->name = arenaAlloc(arena, domainName->len+1);
+        memcpy(name->name, domainName->name, domainName->len);
+        name->len = domainName->len;
+        *tail = name;
+        tail = &name->next;
+        domainName = domainName->next;
+        count--;
     }
-    writeRR(msg->answers, buffer, &cp, header);
-    writeRR(msg->authorities, buffer, &cp, header);
-    writeRR(msg->additionals, buffer, &cp, header);
+    return head;
 }
 
-void readBuffer(struct Message* msg, uint8_t* buffer) {
-    uint8_t* header = buffer;
-    readHeader(msg, &buffer);
-    readQuestion(msg, &buffer, header);
-    readSection(msg, &buffer, 1, msg->ansCount, header);
-    readSection(msg, &buffer, 2, msg->auCount, header);
-    readSection(msg, &buffer, 3, msg->adCount, header);
+//完整复制一个DomainName链表
+struct DomainName* copyDomainName(struct Arena* arena, struct DomainName* domainName) {
+    return copyDomainNamePrefix(arena, domainName, MAX_LABELS);
 }
 
-//从文件里读取信息
-//返回有-1、1、2，-1为未找到，1为有最佳匹配，2为有完全匹配
-//从文件中查找类型、class完全一致的，以及域名最佳匹配或完全匹配的条目，并把它的信息写入rr结构体中
-//用了两个DomainName结构体来存储目标域名和读取域名，来判断它们是否匹配
-int getRecordFromFile(struct ResourceRecord* rr, struct DomainName* targetDomainName, unsigned char* fileName) {
-    unsigned char* type;
-    unsigned char* class;
-    FILE* fd = NULL;
-    unsigned char* buf;
-    int bufsize = BUF_SIZE;
-    int bestMatchCount = 0;
-    int hasBestMatch = 0;
-    int gotTarget = 0;
-    int matchCount = 0;
-    int len, count;
-    int lineDomainReachEnd = 0;
-    int compareResult;
-    struct DomainName* domainNamePos;
-    struct DomainName* domainName2;
-    struct DomainName* domainName2head;
-    unsigned char* edgePos;
-    unsigned char* bufDomain;
+//将文件里的类型字符串转换为类型，不认识的类型返回0
+unsigned short typeStr2Type(unsigned char* type) {
+    if (strcmp(type, "A") == 0)
+        return A_Resource_RecordType;
+    if (strcmp(type, "NS") == 0)
+        return NS_Resource_RecordType;
+    if (strcmp(type, "CNAME") == 0)
+        return CNAME_Resource_RecordType;
+    if (strcmp(type, "PTR") == 0)
+        return PTR_Resource_RecordType;
+    if (strcmp(type, "MX") == 0)
+        return MX_Resource_RecordType;
+    return 0;
+}
 
-    switch (rr->type) {
+//将文件里的类别字符串转换为类别，不认识的类别返回0
+unsigned short classStr2Class(unsigned char* class) {
+    if (strcmp(class, "IN") == 0)
+        return IN_Class;
+    if (strcmp(class, "CH") == 0)
+        return CH_Class;
+    if (strcmp(class, "HS") == 0)
+        return HS_Class;
+    return 0;
+}
+
+//读packet里从offset开始的一个域名，把每一段的长度字节在packet里的位置按顺序写进labels，返回段数
+//压缩指针可以一个接一个，但是只能往前指，而且最多跟MAX_COMPRESSION_HOPS次，这样恶意的报文也不会让这里死循环
+//end不是NULL时写上域名在原位置之后的偏移，也就是下一个字段的开始
+//越界、指针往后指、域名超过255字节都返回-1
+int readNameLabels(uint8_t* packet, int len, int offset, unsigned short* labels, int* end) {
+    int count = 0, hops = 0, total = 1, pointer;
+
+    if (end)
+        *end = -1;
+    while (1) {
+        if (offset >= len)
+            return -1;
+        if (packet[offset] == 0) {
+            if (end && *end < 0)
+                *end = offset + 1;
+            return count;
+        }
+        if ((packet[offset] & 0xc0) == 0xc0) {
+            if (offset + 1 >= len || ++hops > MAX_COMPRESSION_HOPS)
+                return -1;
+            pointer = ((packet[offset] & 0x3f) << 8) | packet[offset + 1];
+            if (pointer >= offset)
+                return -1;
+            if (end && *end < 0)
+                *end = offset + 2;
+            offset = pointer;
+            continue;
+        }
+        if ((packet[offset] & 0xc0) != 0 || count >= MAX_LABELS)
+            return -1;//01和10开头的是扩展标签，不支持
+        total += packet[offset] + 1;
+        if (total > 255 || offset + 1 + packet[offset] > len)
+            return -1;
+        labels[count++] = offset;
+        offset += packet[offset] + 1;
+    }
+}
+
+//读出报文的header和所有问题、记录，不分配内存，返回0；报文格式错误返回-1
+//超过VIEW_MAX_QUESTIONS、VIEW_MAX_RECORDS的部分也要走一遍检查格式，只是不记下来，questionCount、recordCount最多就是这两个数
+int readMessageView(struct MessageView* view, uint8_t* packet, int len) {
+    unsigned short labels[MAX_LABELS];
+    unsigned short qCount, counts[3];
+    struct QuestionView skippedQuestion;
+    struct QuestionView* qv;
+    struct RecordView skippedRecord;
+    struct RecordView* rv;
+    uint8_t* p;
+    unsigned int fields;
+    int offset, i, section;
+
+    if (len < 12)
+        return -1;
+    view->packet = packet;
+    view->len = len;
+    p = packet;
+    view->id = get16bits(&p);
+    fields = get16bits(&p);
+    view->qr = (fields & QR_MASK) >> 15;
+    view->opcode = (fields & OPCODE_MASK) >> 11;
+    view->aa = (fields & AA_MASK) >> 10;
+    view->tc = (fields & TC_MASK) >> 9;
+    view->rd = (fields & RD_MASK) >> 8;
+    view->ra = (fields & RA_MASK) >> 7;
+    view->rcode = (fields & RCODE_MASK) >> 0;
+    qCount = get16bits(&p);
+    counts[0] = get16bits(&p);
+    counts[1] = get16bits(&p);
+    counts[2] = get16bits(&p);
+    offset = 12;
+
+    view->questionCount = 0;
+    for (i = 0; i < qCount; i++) {
+        qv = i < VIEW_MAX_QUESTIONS ? &view->questions[i] : &skippedQuestion;
+        qv->name = offset;
+        if (readNameLabels(packet, len, offset, labels, &offset) < 0 || offset + 4 > len)
+            return -1;
+        p = packet + offset;
+        qv->type = get16bits(&p);
+        qv->class = get16bits(&p);
+        offset += 4;
+        if (qv != &skippedQuestion)
+            view->questionCount++;
+    }
+
+    view->recordCount = 0;
+    for (section = 0; section < 3; section++) {
+        if (section == 1)
+            view->authorityStart = view->recordCount;
+        else if (section == 2)
+            view->additionalStart = view->recordCount;
+        for (i = 0; i < counts[section]; i++) {
+            rv = view->recordCount < VIEW_MAX_RECORDS ? &view->records[view->recordCount] : &skippedRecord;
+            memset(rv, 0, sizeof(struct RecordView));
+            rv->name = offset;
+            if (readNameLabels(packet, len, offset, labels, &offset) < 0 || offset + 10 > len)
+                return -1;
+            p = packet + offset;
+            rv->type = get16bits(&p);
+            rv->class = get16bits(&p);
+            rv->ttl = get32bits(&p);
+            rv->rd_length = get16bits(&p);
+            offset += 10;
+            rv->rdata = offset;
+            if (offset + rv->rd_length > len)
+                return -1;
+            switch (rv->type) {
+                case A_Resource_RecordType:
+                    if (rv->rd_length != 4)
+                        return -1;
+                    memcpy(rv->addr, packet + offset, 4);
+                    break;
+                case MX_Resource_RecordType:
+                    if (rv->rd_length < 3)
+                        return -1;
+                    p = packet + offset;
+                    rv->preference = get16bits(&p);
+                    rv->target = offset + 2;
+                    if (readNameLabels(packet, offset + rv->rd_length, rv->target, labels, NULL) < 0)
+                        return -1;
+                    break;
+                case CNAME_Resource_RecordType:
+                    rv->target = offset;
+                    if (readNameLabels(packet, offset + rv->rd_length, rv->target, labels, NULL) < 0)
+                        return -1;
+                    break;
+                case SOA_Resource_RecordType:
+                    //MNAME和RNAME用不上，负缓存只需要最后的minimum
+                    if (rv->rd_length < 22)
+                        return -1;
+                    p = packet + offset + rv->rd_length - 4;
+                    rv->minimum = get32bits(&p);
+                    break;
+                default:
+                    break;//不认识的类型直接跳过rdata
+            }
+            offset += rv->rd_length;
+            if (rv != &skippedRecord)
+                view->recordCount++;
+        }
+    }
+    return 0;
+}
+
+//比较报文里offset处的域名和一个倒序的DomainName链表是否完全一样
+int viewNameEqual(struct MessageView* view, int offset, struct DomainName* domainName) {
+    unsigned short labels[MAX_LABELS];
+    uint8_t* label;
+    int count;
+
+    count = readNameLabels(view->packet, view->len, offset, labels, NULL);
+    if (count < 0)
+        return 0;
+    while (count > 0 && domainName) {
+        label = view->packet + labels[--count];
+        if (label[0] != domainName->len || memcmp(label + 1, domainName->name, domainName->len) != 0)
+            return 0;
+        domainName = domainName->next;
+    }
+    return count == 0 && domainName == NULL;
+}
+
+//把报文里offset处的域名变成倒序的DomainName链表，链表的节点用调用者给的nodes（至少MAX_LABELS个），
+//每段的name直接指向packet里的内容（没有\0结尾，要按len用），不分配内存
+//copyDomainName会把它完整复制一份，所以可以直接拿去放进缓存
+struct DomainName* viewName2DomainName(struct MessageView* view, int offset, struct DomainName* nodes) {
+    unsigned short labels[MAX_LABELS];
+    int count, i;
+
+    count = readNameLabels(view->packet, view->len, offset, labels, NULL);
+    if (count <= 0)
+        return NULL;
+    for (i = 0; i < count; i++) {
+        nodes[i].name = view->packet + labels[count - 1 - i] + 1;
+        nodes[i].len = view->packet[labels[count - 1 - i]];
+        nodes[i].next = (i + 1 < count) ? &nodes[i + 1] : NULL;
+    }
+    return nodes;
+}
+
+//把报文里offset处的域名解压成6北邮6教育6中国0这样的字节码写进out（至少256字节），返回写了多少字节
+int viewName2DomainBytes(struct MessageView* view, int offset, unsigned char* out) {
+    unsigned short labels[MAX_LABELS];
+    int count, i, len = 0;
+
+    count = readNameLabels(view->packet, view->len, offset, labels, NULL);
+    for (i = 0; i < count; i++) {
+        memcpy(out + len, view->packet + labels[i], view->packet[labels[i]] + 1);
+        len += view->packet[labels[i]] + 1;
+    }
+    out[len++] = 0;
+    return len;
+}
+
+//把报文里offset处的域名写成北邮.教育.中国这样的字符串，out至少256字节
+void viewName2Str(struct MessageView* view, int offset, unsigned char* out) {
+    unsigned short labels[MAX_LABELS];
+    int count, i, len = 0;
+
+    count = readNameLabels(view->packet, view->len, offset, labels, NULL);
+    for (i = 0; i < count; i++) {
+        if (i != 0)
+            out[len++] = '.';
+        memcpy(out + len, view->packet + labels[i] + 1, view->packet[labels[i]]);
+        len += view->packet[labels[i]];
+    }
+    out[len] = '\0';
+}
+
+//把视图里的问题复制成Question数组，顺序和报文里一样，数组和域名都分配在arena里
+//解析一个请求的过程中要一直用到这些问题，而packet很快会被下一个报文覆盖，所以这里必须复制出来
+struct Question* viewQuestions2Questions(struct MessageView* view, struct Arena* arena) {
+    struct DomainName nodes[MAX_LABELS];
+    struct Question* questions;
+    int i;
+
+    questions = arenaAlloc(arena, sizeof(struct Question) * view->questionCount);
+    for (i = 0; i < view->questionCount; i++) {
+        questions[i].name = copyDomainName(arena, viewName2DomainName(view, view->questions[i].name, nodes));
+        questions[i].type = view->questions[i].type;
+        questions[i].class = view->questions[i].class;
+    }
+    return questions;
+}
+
+//把视图里的第i条记录填进栈上的rr，域名的节点用nodes，CNAME和MX的域名字节码写进rdBuf（至少256字节），不分配内存
+//rr只在调用者的这一小段代码里有效，要留下来的话（比如放进缓存）得复制
+void viewRecord2ResourceRecord(struct MessageView* view, int i, struct ResourceRecord* rr, struct DomainName* nodes, unsigned char* rdBuf) {
+    struct RecordView* rv = &view->records[i];
+
+    memset(rr, 0, sizeof(struct ResourceRecord));
+    rr->name = viewName2DomainName(view, rv->name, nodes);
+    rr->type = rv->type;
+    rr->class = rv->class;
+    rr->ttl = rv->ttl;
+    rr->rd_length = rv->rd_length;
+    switch (rv->type) {
         case A_Resource_RecordType:
-            type = "A";
+            memcpy(rr->rd_data.a_record.addr, rv->addr, 4);
             break;
-        case NS_Resource_RecordType:
-            type = "NS";
+        case MX_Resource_RecordType:
+            rr->rd_data.mx_record.preference = rv->preference;
+            viewName2DomainBytes(view, rv->target, rdBuf);
+            rr->rd_data.mx_record.exchange = rdBuf;
             break;
         case CNAME_Resource_RecordType:
-            type = "CNAME";
+            viewName2DomainBytes(view, rv->target, rdBuf);
+            rr->rd_data.cname_record.name = rdBuf;
             break;
-        case PTR_Resource_RecordType:
-            type = "PTR";
+        case SOA_Resource_RecordType:
+            rr->rd_data.soa_record.minimum = rv->minimum;
+            break;
+    }
+}
+
+void printRecordView(struct MessageView* view, int i) {
+    struct RecordView* rv = &view->records[i];
+    unsigned char name[256];
+
+    viewName2Str(view, rv->name, name);
+    printf("RR 名称:%s，类型:%u，类别:%u，TTL:%d，rd_length:%u，", name, rv->type, rv->class, rv->ttl, rv->rd_length);
+    switch (rv->type) {
+        case A_Resource_RecordType:
+            printf("A address:%u.%u.%u.%u\n", rv->addr[0], rv->addr[1], rv->addr[2], rv->addr[3]);
+            break;
+        case CNAME_Resource_RecordType:
+            viewName2Str(view, rv->target, name);
+            printf("CNAME name:%s\n", name);
             break;
         case MX_Resource_RecordType:
-            type = "MX";
+            viewName2Str(view, rv->target, name);
+            printf("MX preference:%u exchange:%s\n", rv->preference, name);
             break;
         default:
-            type = "A";
+            printf("未知类型\n");
     }
-    switch (rr->class) {
-        case IN_Class:
-            class = "IN";
+}
+
+//和printMessage的格式一样，打印一个报文视图
+void printMessageView(struct MessageView* view) {
+    unsigned char name[256];
+    int i;
+
+    printf("请求ID: %02x，", view->id);
+    printf("问题数: %u，", view->questionCount);
+    printf("回答数: %u，", view->authorityStart);
+    printf("权威服务器数: %u，", view->additionalStart - view->authorityStart);
+    printf("附加数: %u\n", view->recordCount - view->additionalStart);
+    printf("\n");
+    for (i = 0; i < view->questionCount; i++) {
+        viewName2Str(view, view->questions[i].name, name);
+        printf("问题:名称:%s，", name);
+        printf("类型:%u，", view->questions[i].type);
+        printf("类别:%u\n", view->questions[i].class);
+    }
+    if (view->authorityStart > 0) {
+        printf("\n回答:\n");
+        for (i = 0; i < view->authorityStart; i++)
+            printRecordView(view, i);
+    }
+    if (view->additionalStart > view->authorityStart) {
+        printf("\n权威服务器:\n");
+        for (i = view->authorityStart; i < view->additionalStart; i++)
+            printRecordView(view, i);
+    }
+    if (view->recordCount > view->additionalStart) {
+        printf("\n附加:\n");
+        for (i = view->additionalStart; i < view->recordCount; i++)
+            printRecordView(view, i);
+    }
+}
+
+unsigned int zoneBucketOf(struct ZoneIndex* zone, unsigned int hash, unsigned short type, unsigned short class) {
+    return (hash ^ (type * 2654435761u) ^ ((unsigned int)class << 24)) & (zone->bucketCount - 1);
+}
+
+struct ZoneIndex* createZoneIndex() {
+    struct ZoneIndex* zone;
+    zone = malloc(sizeof(struct ZoneIndex));
+    memset(zone, 0, sizeof(struct ZoneIndex));
+    zone->bucketCount = ZONE_INDEX_INIT_BUCKETS;//必须是2的幂，这样取桶号可以直接用&
+    zone->buckets = malloc(sizeof(struct ZoneRecord*) * zone->bucketCount);
+    memset(zone->buckets, 0, sizeof(struct ZoneRecord*) * zone->bucketCount);
+    return zone;
+}
+
+//桶数翻倍，把所有记录重新分到新的桶里，记录本身不用复制
+void growZoneIndex(struct ZoneIndex* zone) {
+    struct ZoneRecord** oldBuckets = zone->buckets;
+    unsigned int oldCount = zone->bucketCount;
+    struct ZoneRecord* rec;
+    struct ZoneRecord* next;
+    unsigned int i, bucket;
+
+    zone->bucketCount = oldCount * 2;
+    zone->buckets = malloc(sizeof(struct ZoneRecord*) * zone->bucketCount);
+    memset(zone->buckets, 0, sizeof(struct ZoneRecord*) * zone->bucketCount);
+    for (i = 0; i < oldCount; i++) {
+        rec = oldBuckets[i];
+        while (rec) {
+            next = rec->next;
+            bucket = zoneBucketOf(zone, rec->owner->hash, rec->type, rec->class);
+            rec->next = zone->buckets[bucket];
+            zone->buckets[bucket] = rec;
+            rec = next;
+        }
+    }
+    free(oldBuckets);
+}
+
+//在索引里找域名、类型、类别都一致的记录，owner是驻留过的域名，直接比较指针
+struct ZoneRecord* findZoneRecord(struct ZoneIndex* zone, struct Name* owner, unsigned short type, unsigned short class) {
+    struct ZoneRecord* rec = zone->buckets[zoneBucketOf(zone, owner->hash, type, class)];
+    while (rec) {
+        if (rec->owner == owner && rec->type == type && rec->class == class)
+            return rec;
+        rec = rec->next;
+    }
+    return NULL;
+}
+
+//把rr加入索引，返回1；如果同样域名、类型、类别的记录已经在索引里了，就不加，返回0
+//这和原来逐行读文件时的规则一样：同样的记录只有文件里的第一行会被用到
+int addZoneRecord(struct ZoneIndex* zone, struct ResourceRecord* rr) {
+    struct NameKey key;
+    struct ZoneRecord* rec;
+    struct Name* owner;
+    unsigned int bucket;
+
+    if (nameKeyFromDomainName(rr->name, &key) < 0 || key.labelCount == 0)
+        return 0;
+    owner = internName(&key, 0);
+    if (findZoneRecord(zone, owner, rr->type, rr->class) != NULL) {
+        releaseName(owner);
+        return 0;
+    }
+
+    rec = malloc(sizeof(struct ZoneRecord));
+    memset(rec, 0, sizeof(struct ZoneRecord));
+    rec->owner = owner;
+    rec->type = rr->type;
+    rec->class = rr->class;
+    rec->ttl = rr->ttl;
+    rec->rd_length = rr->rd_length;
+    rec->rd_data = rr->rd_data;
+    //域名类的数据复制一份，索引里的记录不能跟着Message一起被释放
+    if (rr->type == CNAME_Resource_RecordType)
+        rec->rd_data.cname_record.name = strdup(rr->rd_data.cname_record.name);
+    else if (rr->type == MX_Resource_RecordType)
+        rec->rd_data.mx_record.exchange = strdup(rr->rd_data.mx_record.exchange);
+
+    bucket = zoneBucketOf(zone, owner->hash, rec->type, rec->class);
+    rec->next = zone->buckets[bucket];
+    zone->buckets[bucket] = rec;
+    zone->recordCount++;
+    if (zone->recordCount > zone->bucketCount * 2)
+        growZoneIndex(zone);
+    return 1;
+}
+
+//在镜像的域名表里二分查找key从第k段开始的后缀，返回它在域名表里的下标，没有返回-1
+int findZoneImageName(struct ZoneImage* image, struct NameKey* key, int k) {
+    unsigned int hash = key->hashes[k];
+    int len = key->len - (k < key->labelCount ? key->labels[k] : key->len - 1);
+    uint8_t* wire = key->wire + key->len - len;
+    struct ZoneImageName* names = image->names;
+    unsigned int lo = 0, hi = image->header->nameCount, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (names[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (; lo < image->header->nameCount && names[lo].hash == hash; lo++)
+        if (names[lo].len == len && memcmp(image->pool + names[lo].wire, wire, len) == 0)
+            return lo;
+    return -1;
+}
+
+//把镜像里预先编好的RDATA填进rr，域名类的数据直接指向字节池，不复制
+void zoneImageRecord2ResourceRecord(struct ZoneImage* image, struct ZoneImageRecord* rec, struct ResourceRecord* rr) {
+    uint8_t* rdata = image->pool + rec->rdata;
+
+    rr->ttl = rec->ttl;
+    rr->rd_length = rec->rdLength;
+    switch (rec->type) {
+        case CNAME_Resource_RecordType:
+            rr->rd_data.cname_record.name = rdata;
             break;
-        case CH_Class:
-            class = "CH";
+        case MX_Resource_RecordType:
+            rr->rd_data.mx_record.preference = (rdata[0] << 8) | rdata[1];
+            rr->rd_data.mx_record.exchange = rdata + 2;
             break;
-        case HS_Class:
-            class = "HS";
+        default:
+            memcpy(rr->rd_data.a_record.addr, rdata, 4);
+    }
+}
+
+//查到的记录里域名类的数据复制进arena，这样回复就不再引用区域数据，重新加载后旧的区域数据可以放心释放
+void copyZoneRdata2Arena(struct ResourceRecord* rr, struct Arena* arena) {
+    if (rr->type == CNAME_Resource_RecordType)
+        rr->rd_data.cname_record.name = arenaStrdup(arena, rr->rd_data.cname_record.name);
+    else if (rr->type == MX_Resource_RecordType)
+        rr->rd_data.mx_record.exchange = arenaStrdup(arena, rr->rd_data.mx_record.exchange);
+}
+
+//在镜像里找key从第k段开始的后缀有没有类型、类别一致的记录，有的话写入rr，返回1，没有返回0
+int getRecordFromZoneImage(struct ResourceRecord* rr, struct NameKey* key, int k, unsigned short type, unsigned short class, struct ZoneImage* image, struct Arena* arena) {
+    struct ZoneImageName* name;
+    struct ZoneImageRecord* rec;
+    unsigned int i;
+    int idx;
+
+    idx = findZoneImageName(image, key, k);
+    if (idx < 0)
+        return 0;
+    name = &image->names[idx];
+    for (i = 0; i < name->recordCount; i++) {
+        rec = &image->records[name->firstRecord + i];
+        if (rec->type != type || rec->class != class)
+            continue;
+        rr->name = domainBytes2DomainStructureFromStr(arena, image->pool + name->wire);
+        zoneImageRecord2ResourceRecord(image, rec, rr);
+        copyZoneRdata2Arena(rr, arena);
+        return 1;
+    }
+    return 0;
+}
+
+//从区域索引里查找信息，代替原来每次查询都逐行读一遍文件
+//返回有-1、1、2，-1为未找到，1为有最佳匹配，2为有完全匹配
+//查找类型、class完全一致的，以及域名最佳匹配或完全匹配的条目，并把它的信息写入rr结构体中
+//先把目标域名规范化，再从整个域名开始每次去掉最前面一段，第一个查到的就是最佳匹配
+//驻留表里没有的后缀说明索引里也没有，直接跳过；映射了二进制区域文件的话在镜像里二分查找
+int searchZoneIndex(struct ResourceRecord* rr, struct DomainName* targetDomainName, struct ZoneIndex* zone, struct Arena* arena) {
+    struct DomainName nodes[MAX_LABELS];
+    struct NameKey key;
+    unsigned short type = rr->type;
+    unsigned short class = rr->class;
+    struct ZoneRecord* rec;
+    struct Name* name;
+    int k;
+
+    //和原来读文件时一样，不认识的类型当A查，不认识的类别当IN查
+    switch (type) {
+        case A_Resource_RecordType:
+        case NS_Resource_RecordType:
+        case CNAME_Resource_RecordType:
+        case PTR_Resource_RecordType:
+        case MX_Resource_RecordType:
             break;
         default:
-            class = "IN";
+            type = A_Resource_RecordType;
+    }
+    if (class != IN_Class && class != CH_Class && class != HS_Class)
+        class = IN_Class;
+
+    if (nameKeyFromDomainName(targetDomainName, &key) < 0)
+        return -1;
+    for (k = 0; k < key.labelCount; k++) {
+        if (zone->image) {
+            if (getRecordFromZoneImage(rr, &key, k, type, class, zone->image, arena))
+                return k == 0 ? 2 : 1;
+            continue;
+        }
+        name = acquireName(&key, k);
+        if (name == NULL)
+            continue;
+        rec = findZoneRecord(zone, name, type, class);
+        releaseName(name);//索引里的记录自己持有域名的引用，放掉这次查找的引用之后rec->owner还在
+        if (rec == NULL)
+            continue;
+        rr->name = copyDomainName(arena, name2DomainName(rec->owner, nodes));
+        rr->ttl = rec->ttl;
+        rr->rd_length = rec->rd_length;
+        rr->rd_data = rec->rd_data;
+        copyZoneRdata2Arena(rr, arena);
+        if (k == 0)
+            return 2;
+        return 1;
+    }
+    return -1;
+}
+
+//开了指标的话把查找区域索引的耗时记进zone阶段
+int getRecordFromZone(struct ResourceRecord* rr, struct DomainName* targetDomainName, struct ZoneIndex* zone, struct Arena* arena) {
+    long start = metricsNow();
+    int rc = searchZoneIndex(rr, targetDomainName, zone, arena);
+    observeStage(METRICS_STAGE_ZONE, start);
+    return rc;
+}
+
+//把文件中的一行解析成rr，格式为 类型\t类别\t域名\t数据\tTTL
+//解析失败返回0
+int parseZoneLine(unsigned char* line, struct ResourceRecord* rr) {
+    unsigned char* buf = line;
+    unsigned char* typeStr;
+    unsigned char* classStr;
+    unsigned char* domainStr;
+    unsigned char* data;
+    unsigned char* pos;
+    unsigned int ip[4];
+    int i, ok = 1;
+
+    memset(rr, 0, sizeof(struct ResourceRecord));
+    typeStr = readOnePartFromLine(&buf);
+    classStr = typeStr ? readOnePartFromLine(&buf) : NULL;
+    domainStr = classStr ? readOnePartFromLine(&buf) : NULL;
+    data = domainStr ? readOnePartFromLine(&buf) : NULL;
+    if (data == NULL) {
+        ok = 0;
+    } else {
+        rr->type = typeStr2Type(typeStr);
+        rr->class = classStr2Class(classStr);
+        rr->ttl = strtoul(buf, NULL, 10);//最后一段是TTL，后面有没有\n都可以
+        if (rr->type == 0 || rr->class == 0)
+            ok = 0;
+    }
+    if (ok) {
+        switch (rr->type) {
+            case CNAME_Resource_RecordType:
+                rr->rd_data.cname_record.name = domainStr2DomainBytes(data);
+                rr->rd_length = strlen(rr->rd_data.cname_record.name)+1;//+1为\0预留
+                break;
+            case MX_Resource_RecordType:
+                pos = strchr(data, ',');//根据逗号分割，取前半部分为邮件服务器域名，取后半部分为preference
+                if (pos == NULL) {
+                    ok = 0;
+                    break;
+                }
+                *pos = '\0';
+                rr->rd_data.mx_record.preference = atoi(pos + 1);
+                rr->rd_data.mx_record.exchange = domainStr2DomainBytes(data);
+                rr->rd_length = strlen(rr->rd_data.mx_record.exchange) + 1 + 2;//+1为域名字节码末尾的0，+2为preference固定的2字节
+                break;
+            default:
+                if (sscanf(data, "%u.%u.%u.%u", &ip[0], &ip[1], &ip[2], &ip[3]) != 4) {
+                    ok = 0;
+                    break;
+                }
+                for (i = 0; i < 4; i++)
+                    rr->rd_data.a_record.addr[i] = ip[i];
+                rr->rd_length = 4;
+        }
+    }
+    if (ok) {
+        pos = domainStr2DomainBytes(domainStr);
+        rr->name = domainBytes2DomainStructureFromStr(NULL, pos);
+        free(pos);
     }
+    free(typeStr);
+    free(classStr);
+    free(domainStr);
+    free(data);
+    return ok;
+}
+
+//启动时把一个文件整个读进区域索引，文件打不开的话返回一个空的索引
+struct ZoneIndex* loadZoneFromFile(unsigned char* fileName) {
+    struct ZoneIndex* zone = createZoneIndex();
+    struct ResourceRecord rr;
+    FILE* fd;
+    unsigned char* buf;
+
     fd = fopen(fileName, "r");
+    if (fd == NULL) {
+        printf("无法打开文件%s\n", fileName);
+        return zone;
+    }
+    buf = malloc(sizeof(unsigned char)*BUF_SIZE);
+    memset(buf, 0, sizeof(unsigned char)*BUF_SIZE);
+    while (fgets(buf, BUF_SIZE, fd) != NULL) {
+        if (strlen(buf)<5)//如果buf太小，则此行无效，跳过
+            continue;
+        if (!parseZoneLine(buf, &rr))
+            continue;
+        addZoneRecord(zone, &rr);//addZoneRecord复制了rdata里的域名，这里的要释放掉
+        if (rr.type == CNAME_Resource_RecordType)
+            free(rr.rd_data.cname_record.name);
+        else if (rr.type == MX_Resource_RecordType)
+            free(rr.rd_data.mx_record.exchange);
+        freeDomainName(rr.name);
+    }
+    fclose(fd);
+    free(buf);
+    printf("已从%s加载%u条记录\n", fileName, zone->recordCount);
+    return zone;
+}
+
+//把二进制区域文件只读映射进来，检查头部，不存在、格式不对或者比文本文件旧都返回NULL，调用者改为读文本文件
+//映射之后不再读文件，查询时才按需把用到的页读进内存，所以启动几乎不花时间
+struct ZoneImage* openZoneImage(unsigned char* imageName, unsigned char* textName) {
+    struct ZoneImage* image;
+    struct ZoneImageHeader* header;
+    struct stat imageStat, textStat;
+    uint8_t* base;
+    int fd;
+
+    fd = open(imageName, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &imageStat) < 0 || (size_t)imageStat.st_size < sizeof(struct ZoneImageHeader)) {
+        close(fd);
+        printf("%s不是有效的二进制区域文件\n", imageName);
+        return NULL;
+    }
+    if (stat(textName, &textStat) == 0 && textStat.st_mtime > imageStat.st_mtime) {
+        close(fd);
+        printf("%s比%s旧，改为读文本文件，请重新编译\n", imageName, textName);
+        return NULL;
+    }
+    base = mmap(NULL, imageStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        printf("无法映射%s\n", imageName);
+        return NULL;
+    }
+
+    header = (struct ZoneImageHeader*)base;
+    if (memcmp(header->magic, ZONE_IMAGE_MAGIC, 8) != 0
+        || header->namesOffset + (uint64_t)header->nameCount * sizeof(struct ZoneImageName) > header->recordsOffset
+        || header->recordsOffset + (uint64_t)header->recordCount * sizeof(struct ZoneImageRecord) > header->poolOffset
+        || header->poolOffset + (uint64_t)header->poolSize > (uint64_t)imageStat.st_size) {
+        munmap(base, imageStat.st_size);
+        printf("%s不是有效的二进制区域文件\n", imageName);
+        return NULL;
+    }
+    madvise(base, imageStat.st_size, MADV_RANDOM);//查询是随机访问，不要预读
+
+    image = malloc(sizeof(struct ZoneImage));
+    image->base = base;
+    image->size = imageStat.st_size;
+    image->header = header;
+    image->names = (struct ZoneImageName*)(base + header->namesOffset);
+    image->records = (struct ZoneImageRecord*)(base + header->recordsOffset);
+    image->pool = base + header->poolOffset;
+    return image;
+}
+
+void closeZoneImage(struct ZoneImage* image) {
+    munmap(image->base, image->size);
+    free(image);
+}
+
+//有可用的二进制区域文件就映射它作为区域索引，没有返回NULL
+struct ZoneIndex* loadZoneImage(unsigned char* imageName, unsigned char* textName) {
+    struct ZoneImage* image = openZoneImage(imageName, textName);
+    struct ZoneIndex* zone;
+
+    if (image == NULL)
+        return NULL;
+    zone = createZoneIndex();
+    zone->image = image;
+    printf("已映射%s，%u个域名%u条记录\n", imageName, image->header->nameCount, image->header->recordCount);
+    return zone;
+}
+
+//释放整个区域索引，重新加载换下来的旧索引等所有线程都不再用它以后由这里释放
+void freeZoneIndex(struct ZoneIndex* zone) {
+    struct ZoneRecord* rec;
+    struct ZoneRecord* next;
+    unsigned int i;
+
+    for (i = 0; i < zone->bucketCount; i++) {
+        for (rec = zone->buckets[i]; rec; rec = next) {
+            next = rec->next;
+            if (rec->type == CNAME_Resource_RecordType)
+                free(rec->rd_data.cname_record.name);
+            else if (rec->type == MX_Resource_RecordType)
+                free(rec->rd_data.mx_record.exchange);
+            releaseName(rec->owner);
+            free(rec);
+        }
+    }
+    free(zone->buckets);
+    if (zone->image)
+        closeZoneImage(zone->image);
+    free(zone);
+}
+
+//编译时每一行记录先放在这里，全部读完排好序再写文件
+struct ZoneCompileEntry {
+    unsigned int hash;
+    uint8_t* wire;
+    uint8_t len;
+    uint8_t labelCount;
+    unsigned short type;
+    unsigned short class;
+    unsigned int ttl;
+    uint32_t rdata;//RDATA读到的时候就追加进字节池了，这里只记位置
+    unsigned short rdLength;
+    unsigned int line;
+};
+
+//按(哈希, 域名字节码, 类型, 类别, 行号)排序，哈希一样的域名挨在一起，同一个域名的记录挨在一起
+int compareZoneCompileEntry(const void* a, const void* b) {
+    const struct ZoneCompileEntry* x = a;
+    const struct ZoneCompileEntry* y = b;
+    int c;
+
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    if (x->len != y->len)
+        return x->len - y->len;
+    c = memcmp(x->wire, y->wire, x->len);
+    if (c != 0)
+        return c;
+    if (x->type != y->type)
+        return x->type - y->type;
+    if (x->class != y->class)
+        return x->class - y->class;
+    return x->line < y->line ? -1 : (x->line > y->line);
+}
+
+//往字节池里追加一段，返回它在字节池里的位置
+uint32_t appendZoneImagePool(uint8_t** pool, uint32_t* size, uint32_t* cap, uint8_t* data, int len) {
+    uint32_t offset = *size;
+    while (*size + len > *cap) {
+        *cap *= 2;
+        *pool = realloc(*pool, *cap);
+    }
+    memcpy(*pool + *size, data, len);
+    *size += len;
+    return offset;
+}
+
+//把文本区域文件编译成二进制区域文件，成功返回0
+//先写到临时文件再rename，正在运行的服务器映射着的旧文件不会被改写
+int compileZoneFile(unsigned char* textName, unsigned char* imageName) {
+    struct ZoneCompileEntry* entries;
+    struct ZoneCompileEntry* e;
+    struct ZoneImageHeader header;
+    struct ZoneImageName* names;
+    struct ZoneImageRecord* records;
+    struct ResourceRecord rr;
+    struct NameKey key;
+    unsigned int count = 0, cap = 1024, line = 0, nameCount = 0, i;
+    uint32_t poolSize = 0, poolCap = 65536;
+    uint8_t* pool;
+    uint8_t rdata[258];
+    uint8_t* pos;
+    unsigned char* buf;
+    unsigned char* tempName;
+    FILE* fd;
+    int n, ok = 1;
+
+    fd = fopen(textName, "r");
+    if (fd == NULL) {
+        printf("无法打开文件%s\n", textName);
+        return -1;
+    }
+    entries = malloc(sizeof(struct ZoneCompileEntry) * cap);
+    pool = malloc(poolCap);
     buf = malloc(sizeof(unsigned char)*BUF_SIZE);
     memset(buf, 0, sizeof(unsigned char)*BUF_SIZE);
-    while(fgets(buf,bufsize,fd)>0) {
+    while (fgets(buf, BUF_SIZE, fd) != NULL) {
+        line++;
         if (strlen(buf)<5)
             continue;
-        unsigned char* origBufPos = buf;
-        if (strcmp(type,readOnePartFromLine(&buf))==0) {//第一次得到的是type
-            if (strcmp(class,readOnePartFromLine(&buf))==0) {//第二次得到的是class
-                domainNamePos = targetDomainName;
-                matchCount = 0;
-                lineDomainReachEnd = 0;
-
-                edgePos = strchr(buf,'\t');
-                len = edgePos - buf;
-                count = len;
-                bufDomain = malloc(sizeof(unsigned char)*(len+1));//1为\0预留
-                memset(bufDomain, 0, sizeof(unsigned char)*(len+1));
-                memcpy(bufDomain, buf, len);//bufDomain=北邮.教育.中国\t
-                domainName2 = domainBytes2DomainStructureFromStr(domainStr2DomainBytes(bufDomain));
-                domainName2head = domainName2;
-
-                buf += count + 1;//跳过分隔符
-                while (1) {
-                    if (domainName2 == NULL || domainNamePos == NULL)
-                        break;
-                    if (domainName2->next == NULL )
-                        lineDomainReachEnd = 1;//已达到从文件读取的域名的末尾，可以开始计算最佳/完全匹配。如果没有达到末尾，不能计算匹配，因为南邮.教育.中国不能匹配北邮.教育.中国
-                    compareResult = strcmp(domainNamePos->name,domainName2->name);
-                    if ( compareResult != 0 )
-                        break;
-                    matchCount += 1;
-                    if (lineDomainReachEnd) {
-                        if (matchCount > bestMatchCount) {
-                            if (domainNamePos->next == NULL)
-                                gotTarget = 1;
-                            rr->name = domainName2head;
-                            bestMatchCount = matchCount;
-                            hasBestMatch = 1;
-                            if (rr->type == CNAME_Resource_RecordType) {
-                                unsigned char* nameOfCNAME = readOnePartFromLine(&buf);
-                                rr->ttl = atol(readLastPartFromLine(&buf));
-                                rr->rd_data.cname_record.name = domainStr2DomainBytes(nameOfCNAME);
-                                rr->rd_length = strlen(rr->rd_data.cname_record.name)+1;//+1为\0预留
-                            }
-                            else if (rr->type == MX_Resource_RecordType) {
-                                unsigned char* nameOfMX = readOnePartFromLine(&buf);
-                                unsigned char* bufMX = nameOfMX;
-                                unsigned char* posMX;
-                                int lenMX = 0;
-
-                                posMX = strchr(bufMX,',');//根据逗号分割，取前半部分为邮件服务器域名，取后半部分为preference
-                                lenMX = posMX - bufMX;
-                                nameOfMX = malloc(lenMX + sizeof(unsigned char));
-                                memset(nameOfMX, 0, lenMX + sizeof(unsigned char));
-                                memcpy(nameOfMX, bufMX, lenMX);
-                                nameOfMX[lenMX]='\0';
-                                bufMX += lenMX + 1;//跳过分隔符
-                                rr->rd_data.mx_record.preference = atoi(bufMX);
-                                rr->ttl = atol(readLastPartFromLine(&buf));
-                                rr->rd_data.mx_record.exchange = domainStr2DomainBytes(nameOfMX);
-                                rr->rd_length = strlen(rr->rd_data.mx_record.exchange) + 1 + 2;//+1为域名字节码末尾的0，+2为preference固定的2字节
-                            }
-                            else {
-                                unsigned char* addr = rr->rd_data.a_record.addr;
-                                unsigned char* ipAddr = readOnePartFromLine(&buf);
-                                rr->ttl = atol(readLastPartFromLine(&buf));
-                                rr->rd_length = 4;
-                                addr[0] = atoi(readOnePartOfIP(&ipAddr));
-                                addr[1] = atoi(readOnePartOfIP(&ipAddr));
-                                addr[2] = atoi(readOnePartOfIP(&ipAddr));
-                                addr[3] = atoi(readOnePartOfIP(&ipAddr));
-                            }
-                        }
-                        break;
-                    }
-                    domainNamePos = domainNamePos->next;
-                    domainName2 = domainName2->next;
-                }
+        if (!parseZoneLine(buf, &rr))
+            continue;
+        if (nameKeyFromDomainName(rr.name, &key) == 0 && key.labelCount > 0) {
+            if (count == cap) {
+                cap *= 2;
+                entries = realloc(entries, sizeof(struct ZoneCompileEntry) * cap);
+            }
+            e = &entries[count++];
+            e->hash = key.hashes[0];
+            e->len = key.len;
+            e->labelCount = key.labelCount;
+            e->wire = malloc(key.len);
+            memcpy(e->wire, key.wire, key.len);
+            e->type = rr.type;
+            e->class = rr.class;
+            e->ttl = rr.ttl;
+            e->line = line;
+            pos = rdata;
+            if (rr.type == CNAME_Resource_RecordType) {
+                e->rdLength = strlen(rr.rd_data.cname_record.name) + 1;
+                memcpy(pos, rr.rd_data.cname_record.name, e->rdLength);
+            } else if (rr.type == MX_Resource_RecordType) {
+                put16bits(&pos, rr.rd_data.mx_record.preference);
+                e->rdLength = strlen(rr.rd_data.mx_record.exchange) + 1 + 2;
+                memcpy(pos, rr.rd_data.mx_record.exchange, e->rdLength - 2);
+            } else {
+                e->rdLength = 4;
+                memcpy(pos, rr.rd_data.a_record.addr, 4);
             }
+            e->rdata = appendZoneImagePool(&pool, &poolSize, &poolCap, rdata, e->rdLength);
         }
-        buf = origBufPos;
+        if (rr.type == CNAME_Resource_RecordType)
+            free(rr.rd_data.cname_record.name);
+        else if (rr.type == MX_Resource_RecordType)
+            free(rr.rd_data.mx_record.exchange);
+        freeDomainName(rr.name);
     }
     fclose(fd);
-    if (gotTarget)
-        return 2;
-    if (hasBestMatch)
-        return 1;
-    return -1;
+    free(buf);
+
+    qsort(entries, count, sizeof(struct ZoneCompileEntry), compareZoneCompileEntry);
+    names = malloc(sizeof(struct ZoneImageName) * (count ? count : 1));
+    records = malloc(sizeof(struct ZoneImageRecord) * (count ? count : 1));
+    for (i = 0; i < count; i++) {
+        e = &entries[i];
+        if (i == 0 || e->hash != entries[i-1].hash || e->len != entries[i-1].len || memcmp(e->wire, entries[i-1].wire, e->len) != 0) {
+            names[nameCount].hash = e->hash;
+            names[nameCount].wire = appendZoneImagePool(&pool, &poolSize, &poolCap, e->wire, e->len);
+            names[nameCount].firstRecord = i;
+            names[nameCount].recordCount = 0;
+            names[nameCount].len = e->len;
+            names[nameCount].labelCount = e->labelCount;
+            nameCount++;
+        }
+        names[nameCount-1].recordCount++;
+        records[i].type = e->type;
+        records[i].class = e->class;
+        records[i].ttl = e->ttl;
+        records[i].rdLength = e->rdLength;
+        records[i].reserved = 0;
+        records[i].rdata = e->rdata;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ZONE_IMAGE_MAGIC, 8);
+    header.nameCount = nameCount;
+    header.recordCount = count;
+    header.namesOffset = sizeof(header);
+    header.recordsOffset = header.namesOffset + sizeof(struct ZoneImageName) * nameCount;
+    header.poolOffset = header.recordsOffset + sizeof(struct ZoneImageRecord) * count;
+    header.poolSize = poolSize;
+
+    n = strlen(imageName);
+    tempName = malloc(n + 5);
+    memcpy(tempName, imageName, n);
+    memcpy(tempName + n, ".tmp", 5);
+    fd = fopen(tempName, "wb");
+    if (fd == NULL) {
+        printf("无法写入文件%s\n", tempName);
+        ok = 0;
+    } else {
+        if (fwrite(&header, sizeof(header), 1, fd) != 1
+            || fwrite(names, sizeof(struct ZoneImageName), nameCount, fd) != nameCount
+            || fwrite(records, sizeof(struct ZoneImageRecord), count, fd) != count
+            || fwrite(pool, 1, poolSize, fd) != poolSize)
+            ok = 0;
+        if (fclose(fd) != 0)
+            ok = 0;
+        if (ok && rename(tempName, imageName) != 0)
+            ok = 0;
+        if (!ok) {
+            printf("写入%s失败\n", imageName);
+            unlink(tempName);
+        }
+    }
+    if (ok)
+        printf("已把%s编译成%s，%u个域名%u条记录\n", textName, imageName, nameCount, count);
+
+    for (i = 0; i < count; i++)
+        free(entries[i].wire);
+    free(entries);
+    free(names);
+    free(records);
+    free(pool);
+    free(tempName);
+    return ok ? 0 : -1;
 }
 
-//将得到的结果存入缓存文件
-//只存和请求的内容一模一样的返回结果，或者如果forceSave是1，那么所有结果都存
-//同时统计请求的内容是否在返回结果里，如果在，返回值是1
-int saveRecord2File(struct ResourceRecord* rr, struct DomainName* query_domain, unsigned char* fileName, int queryType, int forceSave) {
-    FILE* fd = NULL;
-    unsigned char* buf;
-    unsigned char* line2Save;
-    unsigned char* line2Search;
-    unsigned char* type;
-    unsigned char* class;
-    unsigned char* rrResult;
-    int bufSize = BUF_SIZE;
-    int hasTask = 0;
-    int found = 0;
+//标签的哈希值，FNV-1a
+unsigned int hashLabel(unsigned char* name, uint8_t len) {
+    unsigned int hash = 2166136261u;
+    int i;
+    for (i = 0; i < len; i++) {
+        hash ^= name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-    fd = fopen(fileName, "r+");
-    buf = malloc(sizeof(unsigned char)*BUF_SIZE);
-    memset(buf, 0, sizeof(unsigned char)*BUF_SIZE);
+void initLabelTable(struct LabelTable* table) {
+    memset(table, 0, sizeof(struct LabelTable));
+    table->bucketCount = 1024;
+    table->buckets = malloc(sizeof(int) * table->bucketCount);
+    memset(table->buckets, 0xff, sizeof(int) * table->bucketCount);//全部置为-1
+}
+
+//标签数超过桶数的两倍时，桶数翻倍，所有标签重新分桶
+void growLabelTable(struct LabelTable* table) {
+    unsigned int i, bucket;
+    free(table->buckets);
+    table->bucketCount *= 2;
+    table->buckets = malloc(sizeof(int) * table->bucketCount);
+    memset(table->buckets, 0xff, sizeof(int) * table->bucketCount);
+    for (i = 0; i < table->count; i++) {
+        bucket = hashLabel(table->bytes + table->offsets[i], table->lens[i]) & (table->bucketCount - 1);
+        table->chain[i] = table->buckets[bucket];
+        table->buckets[bucket] = i;
+    }
+}
+
+//查找标签的编号，create为1时找不到就新加一个，create为0时找不到返回-1
+//查询的时候用create为0，查询里出现的新标签不会被加进表里
+//和驻留的域名一样，标签先把ASCII字母转成小写，大小写不同的标签是同一个编号
+int internLabel(struct LabelTable* table, unsigned char* label, uint8_t len, int create) {
+    unsigned char name[256];
+    unsigned int bucket;
+    int id, i;
+
+    for (i = 0; i < len; i++)
+        name[i] = (label[i] >= 'A' && label[i] <= 'Z') ? label[i] + ('a' - 'A') : label[i];
+    bucket = hashLabel(name, len) & (table->bucketCount - 1);
+    id = table->buckets[bucket];
+    while (id >= 0) {
+        if (table->lens[id] == len && memcmp(table->bytes + table->offsets[id], name, len) == 0)
+            return id;
+        id = table->chain[id];
+    }
+    if (!create)
+        return -1;
+
+    if (table->count == table->cap) {
+        table->cap = table->cap ? table->cap * 2 : 256;
+        table->offsets = realloc(table->offsets, sizeof(unsigned int) * table->cap);
+        table->lens = realloc(table->lens, sizeof(uint8_t) * table->cap);
+        table->chain = realloc(table->chain, sizeof(int) * table->cap);
+    }
+    if (table->bytesUsed + len > table->bytesCap) {
+        table->bytesCap = table->bytesCap ? table->bytesCap * 2 : 4096;
+        while (table->bytesUsed + len > table->bytesCap)
+            table->bytesCap *= 2;
+        table->bytes = realloc(table->bytes, table->bytesCap);
+    }
+    id = table->count;
+    memcpy(table->bytes + table->bytesUsed, name, len);
+    table->offsets[id] = table->bytesUsed;
+    table->lens[id] = len;
+    table->chain[id] = table->buckets[bucket];
+    table->buckets[bucket] = id;
+    table->bytesUsed += len;
+    table->count++;
+    if (table->count > table->bucketCount * 2)
+        growLabelTable(table);
+    return id;
+}
+
+//构建授权trie时临时用的节点，每条边只有一个标签，孩子是指针数组
+//全部插入完以后再压缩成DelegationTrie里连续存放的形式，之后就释放掉
+struct DelegationBuildNode {
+    int label;
+    struct DelegationBuildNode** children;
+    int childCount;
+    int childCap;
+    struct DelegationAddr* addrs;
+    int addrCount;
+    int addrCap;
+};
+
+struct DelegationBuildNode* newDelegationBuildNode(int label) {
+    struct DelegationBuildNode* node;
+    node = malloc(sizeof(struct DelegationBuildNode));
+    memset(node, 0, sizeof(struct DelegationBuildNode));
+    node->label = label;
+    return node;
+}
+
+//找到标签为label的孩子，没有就新建一个
+struct DelegationBuildNode* getDelegationBuildChild(struct DelegationBuildNode* node, int label) {
+    int i;
+    for (i = 0; i < node->childCount; i++) {
+        if (node->children[i]->label == label)
+            return node->children[i];
+    }
+    if (node->childCount == node->childCap) {
+        node->childCap = node->childCap ? node->childCap * 2 : 4;
+        node->children = realloc(node->children, sizeof(struct DelegationBuildNode*) * node->childCap);
+    }
+    node->children[node->childCount] = newDelegationBuildNode(label);
+    return node->children[node->childCount++];
+}
+
+void addDelegationBuildAddr(struct DelegationBuildNode* node, struct ResourceRecord* rr) {
+    if (node->addrCount == node->addrCap) {
+        node->addrCap = node->addrCap ? node->addrCap * 2 : 2;
+        node->addrs = realloc(node->addrs, sizeof(struct DelegationAddr) * node->addrCap);
+    }
+    memcpy(node->addrs[node->addrCount].addr, rr->rd_data.a_record.addr, 4);
+    node->addrs[node->addrCount].ttl = rr->ttl;
+    node->addrCount++;
+}
+
+void freeDelegationBuildNode(struct DelegationBuildNode* node) {
+    int i;
+    for (i = 0; i < node->childCount; i++)
+        freeDelegationBuildNode(node->children[i]);
+    free(node->children);
+    free(node->addrs);
+    free(node);
+}
+
+int compareDelegationBuildNode(const void* a, const void* b) {
+    int labelA = (*(struct DelegationBuildNode**)a)->label;
+    int labelB = (*(struct DelegationBuildNode**)b)->label;
+    return labelA - labelB;
+}
+
+//把临时的trie压缩成连续存放的形式
+//按广度优先的顺序给节点编号，这样每个节点的孩子在nodes数组里一定是挨着的
+//只有一个孩子而且不是授权点的节点，会和它的孩子合并成一条有多个标签的边
+void freezeDelegationTrie(struct DelegationTrie* trie, struct DelegationBuildNode* buildRoot) {
+    struct DelegationBuildNode** queue;
+    unsigned int* queueIndex;
+    unsigned int head = 0, tail = 0, queueCap = 64, nodeCap = 64, edgeCap = 64, addrCap = 64;
+    struct DelegationBuildNode* build;
+    struct DelegationBuildNode* rep;
+    struct DelegationNode* node;
+    unsigned int f, idx;
+    int k;
+
+    queue = malloc(sizeof(struct DelegationBuildNode*) * queueCap);
+    queueIndex = malloc(sizeof(unsigned int) * queueCap);
+    trie->nodes = malloc(sizeof(struct DelegationNode) * nodeCap);
+    trie->edgeLabels = malloc(sizeof(unsigned int) * edgeCap);
+    trie->addrs = malloc(sizeof(struct DelegationAddr) * addrCap);
+
+    memset(&trie->nodes[0], 0, sizeof(struct DelegationNode));
+    trie->nodeCount = 1;
+    queue[tail] = buildRoot;
+    queueIndex[tail] = 0;
+    tail++;
+
+    while (head < tail) {
+        build = queue[head];
+        f = queueIndex[head];
+        head++;
+
+        qsort(build->children, build->childCount, sizeof(struct DelegationBuildNode*), compareDelegationBuildNode);
+        if (trie->nodeCount + build->childCount > nodeCap) {
+            while (trie->nodeCount + build->childCount > nodeCap)
+                nodeCap *= 2;
+            trie->nodes = realloc(trie->nodes, sizeof(struct DelegationNode) * nodeCap);
+        }
+        trie->nodes[f].childStart = trie->nodeCount;
+        trie->nodes[f].childCount = build->childCount;
+        trie->nodeCount += build->childCount;
+
+        for (k = 0; k < build->childCount; k++) {
+            idx = trie->nodes[f].childStart + k;
+            node = &trie->nodes[idx];
+            memset(node, 0, sizeof(struct DelegationNode));
+            node->edgeStart = trie->edgeLabelCount;
+
+            rep = build->children[k];
+            while (1) {
+                if (trie->edgeLabelCount == edgeCap) {
+                    edgeCap *= 2;
+                    trie->edgeLabels = realloc(trie->edgeLabels, sizeof(unsigned int) * edgeCap);
+                }
+                trie->edgeLabels[trie->edgeLabelCount++] = rep->label;
+                node->edgeLen++;
+                if (rep->childCount != 1 || rep->addrCount != 0)
+                    break;
+                rep = rep->children[0];
+            }
+            node->depth = trie->nodes[f].depth + node->edgeLen;
+
+            if (trie->addrCount + rep->addrCount > addrCap) {
+                while (trie->addrCount + rep->addrCount > addrCap)
+                    addrCap *= 2;
+                trie->addrs = realloc(trie->addrs, sizeof(struct DelegationAddr) * addrCap);
+            }
+            node->addrStart = trie->addrCount;
+            node->addrCount = rep->addrCount;
+            memcpy(&trie->addrs[trie->addrCount], rep->addrs, sizeof(struct DelegationAddr) * rep->addrCount);
+            trie->addrCount += rep->addrCount;
+
+            if (tail == queueCap) {
+                queueCap *= 2;
+                queue = realloc(queue, sizeof(struct DelegationBuildNode*) * queueCap);
+                queueIndex = realloc(queueIndex, sizeof(unsigned int) * queueCap);
+            }
+            queue[tail] = rep;
+            queueIndex[tail] = idx;
+            tail++;
+        }
+    }
+    free(queue);
+    free(queueIndex);
+}
+
+//沿着倒序的域名在授权trie里往下走一遍，返回路上最深的授权点，没有的话返回NULL
+//孩子按第一个标签的编号排好序，用二分查找；查询里的标签要是不在标签表里，说明再往下不可能匹配了
+struct DelegationNode* findDelegation(struct DelegationTrie* trie, struct DomainName* target) {
+    struct DelegationNode* node = &trie->nodes[0];
+    struct DelegationNode* best = NULL;
+    struct DelegationNode* child;
+    struct DomainName* label = target;
+    unsigned int first;
+    int id, lo, hi, mid, i;
+
+    while (label != NULL && node->childCount > 0) {
+        id = internLabel(&trie->labels, label->name, label->len, 0);
+        if (id < 0)
+            break;
+        child = NULL;
+        lo = 0;
+        hi = node->childCount - 1;
+        while (lo <= hi) {
+            mid = (lo + hi) / 2;
+            first = trie->edgeLabels[trie->nodes[node->childStart + mid].edgeStart];
+            if (first == (unsigned int)id) {
+                child = &trie->nodes[node->childStart + mid];
+                break;
+            }
+            if (first < (unsigned int)id)
+                lo = mid + 1;
+            else
+                hi = mid - 1;
+        }
+        if (child == NULL)
+            break;
+        label = label->next;
+        //边上剩下的标签也要全部匹配上才能走到这个孩子
+        for (i = 1; i < child->edgeLen; i++) {
+            if (label == NULL)
+                return best;
+            id = internLabel(&trie->labels, label->name, label->len, 0);
+            if (id < 0 || trie->edgeLabels[child->edgeStart + i] != (unsigned int)id)
+                return best;
+            label = label->next;
+        }
+        node = child;
+        if (node->addrCount > 0)
+            best = node;
+    }
+    return best;
+}
+
+//把一条记录加进构建中的授权trie，只有IN类别的A记录才是权威服务器的地址
+void addDelegationBuildRecord(struct DelegationTrie* trie, struct DelegationBuildNode* buildRoot, struct ResourceRecord* rr) {
+    struct DelegationBuildNode* node = buildRoot;
+    struct DomainName* label;
+
+    if (rr->type != A_Resource_RecordType || rr->class != IN_Class)
+        return;
+    for (label = rr->name; label != NULL; label = label->next)
+        node = getDelegationBuildChild(node, internLabel(&trie->labels, label->name, label->len, 1));
+    addDelegationBuildAddr(node, rr);
+}
+
+//启动时把serverFile读成授权trie，有编译好的二进制区域文件的话从镜像里读，读完就解除映射
+//同一个域名写了多行的话，这些地址都会存在同一个授权点里
+struct DelegationTrie* loadDelegationTrie(unsigned char* fileName, unsigned char* imageName) {
+    struct DelegationTrie* trie;
+    struct DelegationBuildNode* buildRoot;
+    struct ZoneImage* image;
+    struct ZoneImageName* name;
+    struct ResourceRecord rr;
+    FILE* fd;
+    unsigned char* buf;
+    unsigned int i, j;
+
+    trie = malloc(sizeof(struct DelegationTrie));
+    memset(trie, 0, sizeof(struct DelegationTrie));
+    initLabelTable(&trie->labels);
+    buildRoot = newDelegationBuildNode(-1);
+
+    image = openZoneImage(imageName, fileName);
+    if (image != NULL) {
+        for (i = 0; i < image->header->nameCount; i++) {
+            name = &image->names[i];
+            memset(&rr, 0, sizeof(rr));
+            rr.name = domainBytes2DomainStructureFromStr(NULL, image->pool + name->wire);
+            for (j = 0; j < name->recordCount; j++) {
+                rr.type = image->records[name->firstRecord + j].type;
+                rr.class = image->records[name->firstRecord + j].class;
+                zoneImageRecord2ResourceRecord(image, &image->records[name->firstRecord + j], &rr);
+                addDelegationBuildRecord(trie, buildRoot, &rr);
+            }
+            freeDomainName(rr.name);
+        }
+        closeZoneImage(image);
+        fileName = imageName;
+    } else if ((fd = fopen(fileName, "r")) == NULL) {
+        printf("无法打开文件%s\n", fileName);
+    } else {
+        buf = malloc(sizeof(unsigned char)*BUF_SIZE);
+        memset(buf, 0, sizeof(unsigned char)*BUF_SIZE);
+        while (fgets(buf, BUF_SIZE, fd) != NULL) {
+            if (strlen(buf)<5)
+                continue;
+            if (!parseZoneLine(buf, &rr))
+                continue;
+            addDelegationBuildRecord(trie, buildRoot, &rr);//只用A记录，CNAME、MX的rdata也要释放
+            if (rr.type == CNAME_Resource_RecordType)
+                free(rr.rd_data.cname_record.name);
+            else if (rr.type == MX_Resource_RecordType)
+                free(rr.rd_data.mx_record.exchange);
+            freeDomainName(rr.name);
+        }
+        fclose(fd);
+        free(buf);
+    }
+
+    freezeDelegationTrie(trie, buildRoot);
+    freeDelegationBuildNode(buildRoot);
+    trie->root = findDelegation(trie, rootDomainName);
+    printf("已从%s加载%u个权威服务器地址，授权trie共%u个节点\n", fileName, trie->addrCount, trie->nodeCount);
+    return trie;
+}
+
+void freeDelegationTrie(struct DelegationTrie* trie) {
+    free(trie->labels.bytes);
+    free(trie->labels.offsets);
+    free(trie->labels.lens);
+    free(trie->labels.chain);
+    free(trie->labels.buckets);
+    free(trie->nodes);
+    free(trie->edgeLabels);
+    free(trie->addrs);
+    free(trie);
+}
+
+//查找离target最近的授权点，把授权点的域名和它的第一个权威服务器地址写进rr
+//返回值和getRecordFromZone一样，-1为未找到，1为有最佳匹配，2为有完全匹配
+//fallbackToRoot为1时，没找到就直接用加载trie时查好的"根.网络"授权点，不用再查一遍
+int searchDelegationTrie(struct ResourceRecord* rr, struct DomainName* target, int fallbackToRoot, struct Arena* arena) {
+    struct DelegationTrie* trie = delegationTrie;
+    struct DelegationNode* node;
+    struct DelegationAddr* addr;
+    struct DomainName* label;
+    int labelCount = 0;
+    int rc;
+
+    node = findDelegation(trie, target);
+    if (node != NULL) {
+        for (label = target; label != NULL; label = label->next)
+            labelCount++;
+        rr->name = copyDomainNamePrefix(arena, target, node->depth);
+        rc = (node->depth == labelCount) ? 2 : 1;
+    } else if (fallbackToRoot && trie->root != NULL) {
+        node = trie->root;
+        rr->name = copyDomainNamePrefix(arena, rootDomainName, node->depth);
+        rc = 2;
+    } else {
+        return -1;
+    }
+    addr = &trie->addrs[node->addrStart];
+    memcpy(rr->rd_data.a_record.addr, addr->addr, 4);
+    rr->ttl = addr->ttl;
+    rr->rd_length = 4;
+    return rc;
+}
+
+int getDelegationRecord(struct ResourceRecord* rr, struct DomainName* target, int fallbackToRoot, struct Arena* arena) {
+    long start = metricsNow();
+    int rc = searchDelegationTrie(rr, target, fallbackToRoot, arena);
+    observeStage(METRICS_STAGE_DELEGATION, start);
+    return rc;
+}
+
+//rr是getDelegationRecord找到的权威服务器记录，这个区域如果还有别的权威服务器，每个地址做成一条记录加到msg的authority section
+//这些记录和rr共用同一个域名，域名在arena里，不会被单独释放
+void addOtherDelegationRecords(struct Message* msg, struct ResourceRecord* rr) {
+    struct DelegationTrie* trie = delegationTrie;
+    struct DelegationNode* node;
+    struct DelegationAddr* addr;
+    struct ResourceRecord* other;
+    int i;
+
+    node = findDelegation(trie, rr->name);
+    if (node == NULL)
+        return;
+    for (i = 1; i < node->addrCount; i++) {
+        addr = &trie->addrs[node->addrStart + i];
+        other = addRecord(msg, &msg->authorities, &msg->auCount, &msg->auCap);
+        other->name = rr->name;
+        other->type = rr->type;
+        other->class = rr->class;
+        other->ttl = addr->ttl;
+        other->rd_length = 4;
+        memcpy(other->rd_data.a_record.addr, addr->addr, 4);
+    }
+}
+
+//单调时钟的秒数，缓存的过期时间都用它来算，不受系统改时间的影响
+long monotonicSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+//释放缓存记录，放掉它对域名的引用，数据里的域名也一起释放
+void freeCacheEntry(struct CacheEntry* entry) {
+    releaseName(entry->owner);
+    if (entry->type == CNAME_Resource_RecordType)
+        free(entry->rd_data.cname_record.name);
+    else if (entry->type == MX_Resource_RecordType)
+        free(entry->rd_data.mx_record.exchange);
+    free(entry);
+}
+
+struct ResolverCache* createResolverCache(size_t budget) {
+    struct ResolverCache* cache;
+    struct CacheShard* shard;
+    int i;
+    cache = malloc(sizeof(struct ResolverCache));
+    memset(cache, 0, sizeof(struct ResolverCache));
+    cache->shardBudget = budget / CACHE_SHARDS;
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        shard = &cache->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->bucketCount = CACHE_INIT_BUCKETS;
+        shard->buckets = malloc(sizeof(struct CacheEntry*) * shard->bucketCount);
+        memset(shard->buckets, 0, sizeof(struct CacheEntry*) * shard->bucketCount);
+    }
+    return cache;
+}
+
+//分片用哈希值的高4位，桶用低位，两者互不相关
+struct CacheShard* cacheShardOf(struct ResolverCache* cache, unsigned int hash) {
+    return &cache->shards[hash >> 28];
+}
+
+unsigned int cacheBucketOf(struct CacheShard* shard, unsigned int hash, unsigned short type, unsigned short class) {
+    return (hash ^ (type * 2654435761u) ^ ((unsigned int)class << 20)) & (shard->bucketCount - 1);
+}
+
+void growCacheShard(struct CacheShard* shard) {
+    struct CacheEntry** oldBuckets = shard->buckets;
+    unsigned int oldCount = shard->bucketCount;
+    struct CacheEntry* entry;
+    struct CacheEntry* next;
+    unsigned int i, bucket;
+
+    shard->bucketCount = oldCount * 2;
+    shard->buckets = malloc(sizeof(struct CacheEntry*) * shard->bucketCount);
+    memset(shard->buckets, 0, sizeof(struct CacheEntry*) * shard->bucketCount);
+    for (i = 0; i < oldCount; i++) {
+        entry = oldBuckets[i];
+        while (entry) {
+            next = entry->next;
+            bucket = cacheBucketOf(shard, entry->owner->hash, entry->type, entry->class);
+            entry->next = shard->buckets[bucket];
+            shard->buckets[bucket] = entry;
+            entry = next;
+        }
+    }
+    free(oldBuckets);
+}
+
+//把记录从桶和clock数组里摘掉并释放，调用前需要持有分片的锁
+void removeCacheEntry(struct CacheShard* shard, struct CacheEntry* entry) {
+    struct CacheEntry** pos = &shard->buckets[cacheBucketOf(shard, entry->owner->hash, entry->type, entry->class)];
+    struct CacheEntry* last;
+    while (*pos != entry)
+        pos = &(*pos)->next;
+    *pos = entry->next;
+
+    //用clock数组的最后一项填上空出来的位置
+    shard->clockCount--;
+    if (entry->clockSlot != shard->clockCount) {
+        last = shard->clock[shard->clockCount];
+        shard->clock[entry->clockSlot] = last;
+        last->clockSlot = entry->clockSlot;
+    }
+    if (shard->clockHand >= shard->clockCount)
+        shard->clockHand = 0;
+    shard->memUsed -= entry->size;
+    freeCacheEntry(entry);
+}
+
+//CLOCK淘汰：指针转一圈，访问位是1的清成0给它第二次机会，访问位是0的（或者已经过期的）淘汰掉
+//直到内存回到上限以下，调用前需要持有分片的锁
+void evictCacheShard(struct CacheShard* shard, size_t budget, long now) {
+    struct CacheEntry* entry;
+    while (shard->memUsed > budget && shard->clockCount > 0) {
+        if (shard->clockHand >= shard->clockCount)
+            shard->clockHand = 0;
+        entry = shard->clock[shard->clockHand];
+        if (entry->referenced && entry->expire >= now) {
+            entry->referenced = 0;
+            shard->clockHand++;
+            continue;
+        }
+        removeCacheEntry(shard, entry);
+    }
+}
+
+//owner是驻留过的域名，直接比较指针
+struct CacheEntry* findCacheEntry(struct CacheShard* shard, struct Name* owner, unsigned short type, unsigned short class) {
+    struct CacheEntry* entry = shard->buckets[cacheBucketOf(shard, owner->hash, type, class)];
+    while (entry) {
+        if (entry->owner == owner && entry->type == type && entry->class == class)
+            return entry;
+        entry = entry->next;
+    }
+    return NULL;
+}
+
+//估算一条记录占的内存，包括驻留的域名和数据里的域名，负缓存没有数据
+//驻留的域名可能和别的记录共用，这里按不共用算，宁可多算
+unsigned int cacheEntrySize(struct ResourceRecord* rr, struct Name* owner, int negative) {
+    unsigned int size = sizeof(struct CacheEntry) + sizeof(struct Name) + owner->len + owner->labelCount;
+    if (negative)
+        return size;
+    if (rr->type == CNAME_Resource_RecordType)
+        size += strlen(rr->rd_data.cname_record.name) + 1;
+    else if (rr->type == MX_Resource_RecordType)
+        size += strlen(rr->rd_data.mx_record.exchange) + 1;
+    return size;
+}
+
+//把rr放进缓存，过期时间是当前时间加上rr的TTL
+//已经有同样域名、类型、类别的记录的话（不管是正的还是负的），用新的替换旧的
+//negative为1时放进去的是负缓存，只用到rr的域名、类型、类别和TTL
+void insertCacheEntry(struct ResolverCache* cache, struct ResourceRecord* rr, int negative, unsigned short rcode, int prefetched) {
+    struct NameKey key;
+    struct CacheShard* shard;
+    struct CacheEntry* entry;
+    unsigned int bucket;
+    long now = monotonicSeconds();
+
+    if (nameKeyFromDomainName(rr->name, &key) < 0 || key.labelCount == 0)
+        return;
+
+    entry = malloc(sizeof(struct CacheEntry));
+    memset(entry, 0, sizeof(struct CacheEntry));
+    entry->owner = internName(&key, 0);
+    entry->type = rr->type;
+    entry->class = rr->class;
+    entry->negative = negative;
+    entry->rcode = rcode;
+    entry->expire = now + rr->ttl;
+    entry->ttl = rr->ttl;
+    entry->prefetched = prefetched;
+    if (negative) {
+        entry->size = cacheEntrySize(rr, entry->owner, 1);
+    } else {
+        entry->rd_length = rr->rd_length;
+        entry->rd_data = rr->rd_data;
+        if (rr->type == CNAME_Resource_RecordType)
+            entry->rd_data.cname_record.name = strdup(rr->rd_data.cname_record.name);
+        else if (rr->type == MX_Resource_RecordType)
+            entry->rd_data.mx_record.exchange = strdup(rr->rd_data.mx_record.exchange);
+        entry->size = cacheEntrySize(rr, entry->owner, 0);
+    }
+
+    shard = cacheShardOf(cache, entry->owner->hash);
+    pthread_mutex_lock(&shard->lock);
+    struct CacheEntry* old = findCacheEntry(shard, entry->owner, rr->type, rr->class);
+    if (old != NULL)
+        removeCacheEntry(shard, old);
+
+    bucket = cacheBucketOf(shard, entry->owner->hash, entry->type, entry->class);
+    entry->next = shard->buckets[bucket];
+    shard->buckets[bucket] = entry;
+    if (shard->clockCount == shard->clockCap) {
+        shard->clockCap = shard->clockCap ? shard->clockCap * 2 : 64;
+        shard->clock = realloc(shard->clock, sizeof(struct CacheEntry*) * shard->clockCap);
+    }
+    entry->clockSlot = shard->clockCount;
+    shard->clock[shard->clockCount++] = entry;
+    shard->memUsed += entry->size;
+    if (shard->clockCount > shard->bucketCount * 2)
+        growCacheShard(shard);
+    evictCacheShard(shard, cache->shardBudget, now);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+//prefetched为1表示这条记录是预取问回来的，之后从它回答的命中算作预取命中
+void cacheInsert(struct ResolverCache* cache, struct ResourceRecord* rr, int prefetched) {
+    insertCacheEntry(cache, rr, 0, 0, prefetched);
+}
+
+//记录一次解析失败（RFC 2308的负缓存），key是(域名, 类型, 类别)，ttl秒内同样的请求直接返回rcode，不再去问上游
+void cacheNegative(struct ResolverCache* cache, struct DomainName* name, unsigned short type, unsigned short class, unsigned short rcode, unsigned int ttl) {
+    struct ResourceRecord rr;
+    memset(&rr, 0, sizeof(struct ResourceRecord));
+    rr.name = name;
+    rr.type = type;
+    rr.class = class;
+    rr.ttl = ttl;
+    insertCacheEntry(cache, &rr, 1, rcode, 0);
+}
+
+//在缓存里查找和rr的类型、类别一致，域名和target完全一致的记录
+//找到了返回2，把信息写进rr，TTL是剩下的秒数；没找到或者已经过期返回-1，过期的记录顺手删掉
+//缓存里只有完全匹配，所以返回值只有2和-1两种
+//fromPrefetch为1表示是预取解析自己在查，不算客户端的命中
+//prefetch不为NULL时，命中的记录常用而且快过期了就把*prefetch置1，调用者要在后台把它刷新；同一条记录只会让一个调用者去刷新
+int searchResolverCache(struct ResolverCache* cache, struct ResourceRecord* rr, struct DomainName* target, struct Arena* arena, int fromPrefetch, int* prefetch) {
+    struct DomainName nodes[MAX_LABELS];
+    struct NameKey key;
+    struct CacheShard* shard;
+    struct CacheEntry* entry;
+    struct Name* owner;
+    int rc = -1;
+    long now = monotonicSeconds();
+
+    if (prefetch)
+        *prefetch = 0;
+    if (nameKeyFromDomainName(target, &key) < 0 || key.labelCount == 0)
+        return -1;
+    owner = acquireName(&key, 0);
+    if (owner == NULL)
+        return -1;//没驻留过的域名不可能在缓存里
+    shard = cacheShardOf(cache, owner->hash);
+    pthread_mutex_lock(&shard->lock);
+    entry = findCacheEntry(shard, owner, rr->type, rr->class);
+    if (entry != NULL && entry->expire < now) {
+        removeCacheEntry(shard, entry);
+        entry = NULL;
+    }
+    if (entry != NULL && !entry->negative) {
+        entry->referenced = 1;
+        if (!fromPrefetch) {
+            entry->hits++;
+            if (entry->prefetched && threadMetrics)
+                metricsAdd(threadMetrics->prefetchHits, 1);
+        }
+        //常用的记录快过期了，在它过期之前到上游重新问一遍，这样客户端就不会碰上它过期后的那次缓存未命中
+        if (prefetch && !fromPrefetch && prefetchPercent > 0 && !entry->prefetching
+            && entry->hits >= prefetchMinHits && (entry->expire - now) * 100 <= (long)entry->ttl * prefetchPercent) {
+            entry->prefetching = 1;
+            *prefetch = 1;
+        }
+        rr->name = copyDomainName(arena, name2DomainName(owner, nodes));
+        rr->ttl = entry->expire - now;
+        rr->rd_length = entry->rd_length;
+        rr->rd_data = entry->rd_data;
+        //记录随时可能被别的请求替换或者淘汰，所以数据里的域名要复制一份出来
+        if (rr->type == CNAME_Resource_RecordType)
+            rr->rd_data.cname_record.name = arenaStrdup(arena, entry->rd_data.cname_record.name);
+        else if (rr->type == MX_Resource_RecordType)
+            rr->rd_data.mx_record.exchange = arenaStrdup(arena, entry->rd_data.mx_record.exchange);
+        rc = 2;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    releaseName(owner);
+    return rc;
+}
+
+int cacheLookup(struct ResolverCache* cache, struct ResourceRecord* rr, struct DomainName* target, struct Arena* arena, int fromPrefetch, int* prefetch) {
+    long start = metricsNow();
+    int rc = searchResolverCache(cache, rr, target, arena, fromPrefetch, prefetch);
+    observeStage(METRICS_STAGE_CACHE, start);
+    if (threadMetrics && !fromPrefetch) {
+        if (rc == 2)
+            metricsAdd(threadMetrics->cacheHits, 1);
+        else
+            metricsAdd(threadMetrics->cacheMisses, 1);
+    }
+    return rc;
+}
+
+//查找负缓存，(target, type, class)上次解析失败而且还没过期的话返回1，并把当时的返回码写进rcode
+int searchNegativeCache(struct ResolverCache* cache, struct DomainName* target, unsigned short type, unsigned short class, unsigned short* rcode) {
+    struct NameKey key;
+    struct CacheShard* shard;
+    struct CacheEntry* entry;
+    struct Name* owner;
+    int rc = 0;
+    long now = monotonicSeconds();
+
+    if (nameKeyFromDomainName(target, &key) < 0 || key.labelCount == 0)
+        return 0;
+    owner = acquireName(&key, 0);
+    if (owner == NULL)
+        return 0;
+    shard = cacheShardOf(cache, owner->hash);
+    pthread_mutex_lock(&shard->lock);
+    entry = findCacheEntry(shard, owner, type, class);
+    if (entry != NULL && entry->negative && entry->expire >= now) {
+        entry->referenced = 1;
+        *rcode = entry->rcode;
+        rc = 1;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    releaseName(owner);
+    return rc;
+}
+
+int negativeCacheLookup(struct ResolverCache* cache, struct DomainName* target, unsigned short type, unsigned short class, unsigned short* rcode) {
+    long start = metricsNow();
+    int rc = searchNegativeCache(cache, target, type, class, rcode);
+    observeStage(METRICS_STAGE_CACHE, start);
+    return rc;
+}
+
+//根据上游的回复算负缓存的TTL
+//authority section里有SOA的话，按RFC 2308取SOA本身的TTL和SOA的MINIMUM中较小的那个，没有的话用negativeTtl
+unsigned int negativeTtlOf(struct MessageView* view) {
+    struct RecordView* rv;
+    unsigned int ttl;
+    int i;
+    for (i = view->authorityStart; i < view->additionalStart; i++) {
+        rv = &view->records[i];
+        if (rv->type == SOA_Resource_RecordType) {
+            ttl = rv->ttl < rv->minimum ? rv->ttl : rv->minimum;
+            return ttl < MAX_NEGATIVE_TTL ? ttl : MAX_NEGATIVE_TTL;
+        }
+    }
+    return negativeTtl;
+}
+
+//把rr写成文件里一行的格式：类型\t类别\t域名\t数据\tTTL\n
+void formatRecordLine(struct ResourceRecord* rr, unsigned char* line) {
+    unsigned char* type;
+    unsigned char* class;
+    unsigned char rrResult[BUF_SIZE];
+    unsigned char name[256];
+
+    switch (rr->type) {
+        case A_Resource_RecordType:
+            type = "A";
+            break;
+        case NS_Resource_RecordType:
+            type = "NS";
+            break;
+        case CNAME_Resource_RecordType:
+            type = "CNAME";
+            break;
+        case PTR_Resource_RecordType:
+            type = "PTR";
+            break;
+        case MX_Resource_RecordType:
+            type = "MX";
+            break;
+        default:
+            type = "A";
+    }
+    switch (rr->class) {
+        case IN_Class:
+            class = "IN";
+            break;
+        case CH_Class:
+            class = "CH";
+            break;
+        case HS_Class:
+            class = "HS";
+            break;
+        default:
+            class = "IN";
+    }
+
+    switch (rr->type) {
+        case CNAME_Resource_RecordType:
+            domainBytes2DomainStr(rr->rd_data.cname_record.name, rrResult);
+            break;
+        case MX_Resource_RecordType:
+            domainBytes2DomainStr(rr->rd_data.mx_record.exchange, rrResult);
+            sprintf(rrResult + strlen(rrResult), ",%u", rr->rd_data.mx_record.preference);
+            break;
+        default:
+            sprintf(rrResult,"%u.%u.%u.%u",
+                    rr->rd_data.a_record.addr[0],
+                    rr->rd_data.a_record.addr[1],
+                    rr->rd_data.a_record.addr[2],
+                    rr->rd_data.a_record.addr[3]
+                    );
+    }
+    getDomainNameStr(rr->name, name);
+    sprintf(line,"%s\t%s\t%s\t%s\t%d\n",type,class, name,rrResult,rr->ttl);
+}
+
+//启动时把cacheFile读进缓存，文件里的TTL当作从现在开始还剩下的秒数
+void loadCacheFromFile(struct ResolverCache* cache, unsigned char* fileName) {
+    struct ResourceRecord rr;
+    FILE* fd;
+    unsigned char* buf;
+    int count = 0;
+
+    fd = fopen(fileName, "r");
+    if (fd == NULL) {
+        printf("无法打开文件%s\n", fileName);
+        return;
+    }
+    buf = malloc(sizeof(unsigned char)*BUF_SIZE);
+    memset(buf, 0, sizeof(unsigned char)*BUF_SIZE);
+    while (fgets(buf, BUF_SIZE, fd) != NULL) {
+        if (strlen(buf)<5)
+            continue;
+        if (!parseZoneLine(buf, &rr))
+            continue;
+        cacheInsert(cache, &rr, 0);//insertCacheEntry自己复制一份rdata，解析出来的这份释放掉
+        if (rr.type == CNAME_Resource_RecordType)
+            free(rr.rd_data.cname_record.name);
+        else if (rr.type == MX_Resource_RecordType)
+            free(rr.rd_data.mx_record.exchange);
+        freeDomainName(rr.name);
+        count++;
+    }
+    fclose(fd);
+    free(buf);
+    printf("已从%s加载%d条缓存\n", fileName, count);
+}
+
+//把缓存里还没过期的记录写进cacheFile，TTL写剩下的秒数
+//先写到临时文件里再rename过去，写到一半的时候cacheFile还是完整的旧文件
+//每次只锁一个分片，锁住的时候只把记录格式化成一行，写文件在锁外面做
+void snapshotCache(struct ResolverCache* cache, unsigned char* fileName) {
+    unsigned char tempFile[BUF_SIZE];
+    unsigned char line[BUF_SIZE];
+    struct CacheShard* shard;
+    struct CacheEntry* entry;
+    struct ResourceRecord rr;
+    struct DomainName nodes[MAX_LABELS];
+    unsigned char* lines;
+    size_t linesLen, linesCap;
+    unsigned int i;
+    int s, count = 0;
+    long now = monotonicSeconds();
+    FILE* fd;
+
+    snprintf(tempFile, sizeof(tempFile), "%s.tmp", fileName);
+    fd = fopen(tempFile, "w");
+    if (fd == NULL) {
+        printf("无法写入缓存快照%s\n", tempFile);
+        return;
+    }
+    for (s = 0; s < CACHE_SHARDS; s++) {
+        shard = &cache->shards[s];
+        linesLen = 0;
+        linesCap = 4096;
+        lines = malloc(linesCap);
+        pthread_mutex_lock(&shard->lock);
+        for (i = 0; i < shard->clockCount; i++) {
+            entry = shard->clock[i];
+            if (entry->expire < now || entry->negative)//负缓存没法用文件的格式表示，不写回
+                continue;
+            memset(&rr, 0, sizeof(struct ResourceRecord));
+            rr.name = name2DomainName(entry->owner, nodes);
+            rr.type = entry->type;
+            rr.class = entry->class;
+            rr.ttl = entry->expire - now;
+            rr.rd_data = entry->rd_data;
+            formatRecordLine(&rr, line);
+            while (linesLen + strlen(line) + 1 > linesCap) {
+                linesCap *= 2;
+                lines = realloc(lines, linesCap);
+            }
+            memcpy(lines + linesLen, line, strlen(line));
+            linesLen += strlen(line);
+            count++;
+        }
+        pthread_mutex_unlock(&shard->lock);
+        fwrite(lines, 1, linesLen, fd);
+        free(lines);
+    }
+    fclose(fd);
+    rename(tempFile, fileName);
+    printf("已将%d条缓存写入%s\n", count, fileName);
+}
+
+//后台线程，每隔snapshotInterval秒把缓存写回cacheFile一次
+void* cacheSnapshotThread(void* arg) {
+    while (1) {
+        sleep(snapshotInterval);
+        snapshotCache(resolverCache, cacheFile);
+    }
+    return NULL;
+}
+
+//将得到的结果存入缓存
+//只存和请求的内容一模一样的返回结果，或者如果forceSave是1，那么所有结果都存
+//同时统计请求的内容是否在返回结果里，如果在，返回值是1
+//只放进内存里的缓存，不碰文件，文件由后台线程定期写回
+//看的是view里第start到第end-1条记录，记录在栈上临时拼出来，缓存自己会复制一份
+//prefetched为1表示这是预取问回来的回复
+int saveRecord2Cache(struct MessageView* view, int start, int end, struct DomainName* query_domain, int queryType, int forceSave, int prefetched) {
+    struct DomainName nodes[MAX_LABELS];
+    unsigned char rdBuf[256];
+    struct ResourceRecord rr;
+    struct RecordView* rv;
+    int i, hasTask = 0;
+    for (i = start; i < end; i++) {
+        rv = &view->records[i];
+        if ((queryType == rv->type && viewNameEqual(view, rv->name, query_domain)) || forceSave == 1) {
+            hasTask = 1;
+            switch (rv->type) {
+                case A_Resource_RecordType:
+                case CNAME_Resource_RecordType:
+                case MX_Resource_RecordType:
+                    viewRecord2ResourceRecord(view, i, &rr, nodes, rdBuf);
+                    cacheInsert(resolverCache, &rr, prefetched);
+                    break;
+                default:
+                    if (queryLogLevel >= 2)
+                        printf("Unknown Resource Record\n");
+            }
+        }
+    }
+    return hasTask;
+}
+
+//将msg中的question按顺序加入全局变量taskList中
+//任务在解析过程中会被改类型，所以任务是单独的一份，域名则直接和msg里的问题共用，都在arena里
+void putQuestionsInMsgToTaskList(struct Message* msg) {
+    struct Question** tail = &taskList;
+    struct Question* pq;
+    int i;
+
+    while (*tail)
+        tail = &(*tail)->next;
+    for (i = 0; i < msg->qCount; i++) {
+        pq = arenaAlloc(msg->arena, sizeof(struct Question));
+        pq->name = msg->questions[i].name;
+        pq->type = msg->questions[i].type;
+        pq->class = msg->questions[i].class;
+        *tail = pq;
+        tail = &pq->next;
+    }
+}
+
+//单调时钟的毫秒数，用于上游请求的超时
+long monotonicMillis() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//从内核取一个不可预测的随机数，用来生成向上游请求的ID和源端口，防止回复被伪造
+//rand_r的种子只能从时间之类的东西来，猜到启动时间就能算出所有的ID和端口
+uint32_t secureRandom() {
+    ssize_t n;
+    size_t got = 0;
+    int fd;
+
+    if (secureRandomLeft == 0) {
+        while (got < sizeof(secureRandomPool)) {
+            n = getrandom((uint8_t*)secureRandomPool + got, sizeof(secureRandomPool) - got, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                break;
+            got += n;
+        }
+        if (got < sizeof(secureRandomPool)) {
+            //内核太旧没有getrandom的话读/dev/urandom，再不行就没法安全地发请求了
+            fd = open("/dev/urandom", O_RDONLY);
+            if (fd < 0 || read(fd, secureRandomPool, sizeof(secureRandomPool)) != sizeof(secureRandomPool)) {
+                printf("无法获取随机数\n");
+                exit(1);
+            }
+            close(fd);
+        }
+        secureRandomLeft = SECURE_RANDOM_BATCH;
+    }
+    return secureRandomPool[--secureRandomLeft];
+}
+
+//创建一个向上游发请求用的非阻塞UDP socket，失败返回-1
+//端口是随机挑的，被占用了就换一个，实在不行才交给系统分配
+int openUpstreamSocket() {
+    int sock, i;
+
+    sock = socket(PF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+    if (sock < 0)
+        return -1;
+
+    //讲道理此时作为一个客户端是不需要bind的，但是如果不bind，发出去的包的ip地址会是127.0.0.1，就看不出来这个包是哪个服务器发的了，
+    //所以bind一下好看些，顺便把端口随机化，防止回复被伪造
+    struct sockaddr_in cltBindAddr;
+    memset(&cltBindAddr,0,sizeof(cltBindAddr));
+    cltBindAddr.sin_family = AF_INET;
+    cltBindAddr.sin_addr.s_addr = inet_addr(myIpAddr);
+    for (i = 0; i < 16; i++) {
+        cltBindAddr.sin_port = htons(1024 + secureRandom() % (65536 - 1024));
+        if (bind(sock, (struct sockaddr *) &cltBindAddr, sizeof(cltBindAddr)) == 0)
+            return sock;
+    }
+    cltBindAddr.sin_port = 0;
+    bind(sock, (struct sockaddr *) &cltBindAddr, sizeof(cltBindAddr));
+    return sock;
+}
+
+//以UDP协议从sock将对query_domain的请求发给remote_ip，不等回复，回复由事件循环收
+//请求的ID写进queryId，发送失败返回-1
+int sendQuery(int sock, unsigned char* remote_ip, struct DomainName* query_domain, int query_type, unsigned short* queryId) {
+    uint8_t buffer[BUF_SIZE];
+    struct Message msg;
+    struct sockaddr_in dnsSvrAddr;
+    unsigned short dnsSvrPort = 53;
+    uint8_t* pointerForLength;
+    int bufLen;
+
+    memset(&dnsSvrAddr, 0, sizeof(dnsSvrAddr));/*Zero out structure*/
+    dnsSvrAddr.sin_family = AF_INET;
+    dnsSvrAddr.sin_addr.s_addr = inet_addr(remote_ip);
+    dnsSvrAddr.sin_port = htons(dnsSvrPort);
+
+    memset(&msg, 0, sizeof(struct Message));
+
+    //准备header
+    msg.id = secureRandom() & 0xffff;
+    msg.qr = 0;//这是一条Query
+    msg.aa = 0;
+    if (isRecursive) {
+        msg.rd = 1; //期望递归
+        msg.ra = 1; //能够递归
+    }
+    else {
+        msg.rd = 0;
+        msg.ra = 0;
+    }
+    msg.rcode = 0;
+
+    //报文写完就不再用这个问题了，直接放在栈上，域名也不用复制
+    struct Question q;
+    memset(&q, 0, sizeof(struct Question));
+    q.name = query_domain;
+    q.type = query_type;
+    q.class = IN_Class;
+    msg.questions = &q;
+    msg.qCount = 1;
+
+    pointerForLength = buffer;
+    writeBuffer(&msg, &pointerForLength);
+    bufLen = pointerForLength - buffer;
+    *queryId = msg.id;
+
+    if ((sendto(sock, buffer, bufLen, 0, (struct sockaddr *) &dnsSvrAddr, sizeof(dnsSvrAddr)))!= bufLen) {
+        if (queryLogLevel >= 2)
+            printf("sendto() sent a different number of bytes than expected.\n");
+        return -1;
+    }
+    return 0;
+}
+
+//删掉当前任务，将下一个任务提到当前来
+//任务在请求的arena里，不用释放，跟着arena一起回收
+void moveTaskList2Next() {
+    taskList = taskList->next;
+}
+
+//给解析的轨迹加一步，问题是taskList现在的任务，没开轨迹时返回NULL
+//返回的指针在下一次addTraceHop之前有效，之后要用的话记下标
+struct TraceHop* addTraceHop(struct Resolution* res, int step) {
+    struct TraceHop* hops;
+    struct TraceHop* hop;
+
+    if (traceFile == NULL)
+        return NULL;
+    if (res->traceCount == res->traceCap) {
+        res->traceCap = res->traceCap ? res->traceCap * 2 : 8;
+        hops = arenaAlloc(&res->arena, sizeof(struct TraceHop) * res->traceCap);
+        if (res->traceCount > 0)
+            memcpy(hops, res->trace, sizeof(struct TraceHop) * res->traceCount);
+        res->trace = hops;
+    }
+    hop = &res->trace[res->traceCount++];
+    memset(hop, 0, sizeof(struct TraceHop));
+    hop->step = step;
+    hop->name = taskList->name;
+    hop->type = taskList->type;
+    return hop;
+}
+
+//一次上游请求对应的那一步，没记的话返回NULL
+struct TraceHop* traceHopOf(struct Resolution* res, int index) {
+    return index >= 0 && index < res->traceCount ? &res->trace[index] : NULL;
+}
+
+//在RTT表里找一个服务器，找不到就新建一个，调用者要拿着锁
+struct ServerRtt* findServerRtt(uint8_t* server) {
+    struct ServerRtt* entry;
+    uint32_t addr;
+    unsigned int bucket;
+
+    memcpy(&addr, server, 4);
+    bucket = (addr * 2654435761u) >> 22;//1024个桶，取乘法哈希的高10位
+    for (entry = serverRttTable.buckets[bucket]; entry; entry = entry->next)
+        if (entry->addr == addr)
+            return entry;
+    entry = malloc(sizeof(struct ServerRtt));
+    memset(entry, 0, sizeof(struct ServerRtt));
+    entry->addr = addr;
+    entry->srtt = 1000 + rand_r(&randSeed) % 31000;//没问过的服务器给一个1到32毫秒的随机值，这样它们会先被各问一次
+    entry->next = serverRttTable.buckets[bucket];
+    serverRttTable.buckets[bucket] = entry;
+    return entry;
+}
+
+//测到了一次RTT，更新平滑RTT
+void updateServerRtt(uint8_t* server, unsigned int rtt) {
+    struct ServerRtt* entry;
+
+    pthread_mutex_lock(&serverRttTable.lock);
+    entry = findServerRtt(server);
+    if (entry->measured)
+        entry->srtt = (entry->srtt * 7 + rtt * 3) / 10;
+    else
+        entry->srtt = rtt;
+    entry->measured = 1;
+    pthread_mutex_unlock(&serverRttTable.lock);
+}
+
+//请求超时了，平滑RTT翻倍，至少是这次等待的时间
+void penalizeServerRtt(uint8_t* server, unsigned int rto) {
+    struct ServerRtt* entry;
+
+    pthread_mutex_lock(&serverRttTable.lock);
+    entry = findServerRtt(server);
+    entry->srtt *= 2;
+    if (entry->srtt < rto)
+        entry->srtt = rto;
+    if (entry->srtt > UPSTREAM_MAX_RTO_MS * 1000)
+        entry->srtt = UPSTREAM_MAX_RTO_MS * 1000;
+    entry->measured = 1;
+    pthread_mutex_unlock(&serverRttTable.lock);
+}
+
+//从res->servers里选出这一轮还没问过的、平滑RTT最小的服务器，都问过了就开始新的一轮
+//没被选中的服务器平滑RTT乘0.98，慢下来的服务器过一阵子还会被重新试一下
+//返回选中的服务器的下标，rto里写上这次要等多少毫秒
+int selectUpstreamServer(struct Resolution* res, int* rto) {
+    struct ServerRtt* entry;
+    unsigned int srtt[MAX_UPSTREAM_SERVERS];
+    int measured[MAX_UPSTREAM_SERVERS];
+    int i, best = -1;
+
+    if ((res->tried & ((1u << res->serverCount) - 1)) == ((1u << res->serverCount) - 1))
+        res->tried = 0;
+    pthread_mutex_lock(&serverRttTable.lock);
+    for (i = 0; i < res->serverCount; i++) {
+        entry = findServerRtt(res->servers[i]);
+        srtt[i] = entry->srtt;
+        measured[i] = entry->measured;
+        if (!(res->tried & (1u << i)) && (best < 0 || srtt[i] < srtt[best]))
+            best = i;
+    }
+    for (i = 0; i < res->serverCount; i++) {
+        if (i != best) {
+            entry = findServerRtt(res->servers[i]);
+            entry->srtt = entry->srtt * 98 / 100;
+        }
+    }
+    pthread_mutex_unlock(&serverRttTable.lock);
+
+    res->tried |= 1u << best;
+    //第一次等两倍的平滑RTT，之后每次重传翻倍
+    *rto = measured[best] ? srtt[best] * 2 / 1000 : UPSTREAM_INITIAL_RTO_MS;
+    if (*rto < UPSTREAM_MIN_RTO_MS)
+        *rto = UPSTREAM_MIN_RTO_MS;
+    *rto <<= res->tryCount;
+    if (*rto > UPSTREAM_MAX_RTO_MS)
+        *rto = UPSTREAM_MAX_RTO_MS;
+    return best;
+}
+
+//定时器堆里交换两个位置
+void swapTimers(struct EventLoop* loop, int i, int j) {
+    struct Resolution* res = loop->timers[i];
+    loop->timers[i] = loop->timers[j];
+    loop->timers[j] = res;
+    loop->timers[i]->timerIndex = i;
+    loop->timers[j]->timerIndex = j;
+}
+
+//定时器堆里第i个位置的deadline变了，上浮或者下沉到正确的位置
+void fixTimer(struct EventLoop* loop, int i) {
+    int child;
+
+    while (i > 0 && loop->timers[(i - 1) / 2]->deadline > loop->timers[i]->deadline) {
+        swapTimers(loop, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while ((child = 2 * i + 1) < loop->timerCount) {
+        if (child + 1 < loop->timerCount && loop->timers[child + 1]->deadline < loop->timers[child]->deadline)
+            child++;
+        if (loop->timers[child]->deadline >= loop->timers[i]->deadline)
+            break;
+        swapTimers(loop, i, child);
+        i = child;
+    }
+}
+
+//设定res的重传时间，不在堆里就加进去
+void setTimer(struct EventLoop* loop, struct Resolution* res, long deadline) {
+    res->deadline = deadline;
+    if (res->timerIndex < 0) {
+        if (loop->timerCount == loop->timerCap) {
+            loop->timerCap = loop->timerCap ? loop->timerCap * 2 : 64;
+            loop->timers = realloc(loop->timers, sizeof(struct Resolution*) * loop->timerCap);
+        }
+        res->timerIndex = loop->timerCount++;
+        loop->timers[res->timerIndex] = res;
+    }
+    fixTimer(loop, res->timerIndex);
+}
+
+//把res从定时器堆里拿掉
+void cancelTimer(struct EventLoop* loop, struct Resolution* res) {
+    int i = res->timerIndex;
+
+    if (i < 0)
+        return;
+    res->timerIndex = -1;
+    loop->timerCount--;
+    if (i != loop->timerCount) {
+        loop->timers[i] = loop->timers[loop->timerCount];
+        loop->timers[i]->timerIndex = i;
+        fixTimer(loop, i);
+    }
+}
+
+//不再等上游的回复：这一步发出的请求都从pendingTries里删掉，取消重传定时器
+//之后再到的回复都对不上，会被丢掉
+void stopWaitingUpstream(struct EventLoop* loop, struct Resolution* res) {
+    struct UpstreamTry** link;
+    int i;
+
+    for (i = 0; i < res->tryCount; i++) {
+        link = &loop->pendingTries[res->tries[i].id % UPSTREAM_ID_BUCKETS];
+        while (*link && *link != &res->tries[i])
+            link = &(*link)->next;
+        if (*link)
+            *link = res->tries[i].next;
+    }
+    res->waiting = 0;
+    cancelTimer(loop, res);
+}
+
+//选一个服务器，从随机的一个upstreamSockets请求当前任务的解析，然后设定重传定时器等回复
+//之前几次请求也还在pendingTries里，它们的回复晚到了也能收到
+//发不出去返回-1
+int sendUpstreamQuery(struct EventLoop* loop, struct Resolution* res) {
+    unsigned char ipStr[16];
+    struct UpstreamTry* try;
+    struct TraceHop* hop;
+    uint8_t* addr;
+    int rto, sock;
+
+    if (res->serverCount == 0)
+        return -1;
+    addr = res->servers[selectUpstreamServer(res, &rto)];
+    try = &res->tries[res->tryCount];
+    try->socketIndex = rand_r(&randSeed) % UPSTREAM_SOCKETS;
+    sock = loop->upstreamSockets[try->socketIndex].fd;
+    sprintf(ipStr,"%u.%u.%u.%u",addr[0],addr[1],addr[2],addr[3]);
+    gettimeofday(&try->sentAt, NULL);
+    if (sock < 0 || sendQuery(sock, ipStr, taskList->name, taskList->type, &try->id) < 0) {
+        if (res->waiting)
+            stopWaitingUpstream(loop, res);
+        return -1;
+    }
+    memcpy(try->server, addr, 4);
+    try->rto = rto;
+    try->res = res;
+    try->traceHop = -1;
+    hop = addTraceHop(res, TRACE_STEP_QUERY);
+    if (hop) {
+        memcpy(hop->server, addr, 4);
+        try->traceHop = res->traceCount - 1;
+    }
+    try->next = loop->pendingTries[try->id % UPSTREAM_ID_BUCKETS];
+    loop->pendingTries[try->id % UPSTREAM_ID_BUCKETS] = try;
+    res->tryCount++;
+    res->upstreamQueries++;
+    res->waiting = 1;
+    setTimer(loop, res, monotonicMillis() + rto);
+    return 0;
+}
+
+//这一步迭代要问的服务器换成一组新的，之前的请求记录清空
+void resetUpstreamServers(struct Resolution* res) {
+    res->serverCount = 0;
+    res->tried = 0;
+    res->tryCount = 0;
+}
+
+//往这一步迭代要问的服务器里加一个，重复的和超过上限的不要
+void addUpstreamServer(struct Resolution* res, uint8_t* addr) {
+    int i;
+
+    for (i = 0; i < res->serverCount; i++)
+        if (memcmp(res->servers[i], addr, 4) == 0)
+            return;
+    if (res->serverCount < MAX_UPSTREAM_SERVERS)
+        memcpy(res->servers[res->serverCount++], addr, 4);
+}
+
+//驻留的域名已经有哈希了，混进类型和类就行
+unsigned int inflightBucketOf(struct Name* name, unsigned short type, unsigned short class) {
+    unsigned int hash = name->hash ^ ((unsigned int)type << 16 | class);
+    hash *= 16777619u;
+    return hash % INFLIGHT_BUCKETS;
+}
+
+//taskList现在的任务有没有别的解析正在问上游，有的话返回那个领头的解析
+//领头的解析都拿着自己域名的驻留引用，驻留表里没有这个域名的话肯定没有
+struct Resolution* findInflight(struct EventLoop* loop) {
+    struct Resolution* leader;
+    struct Name* name;
+    struct NameKey key;
+
+    if (nameKeyFromDomainName(taskList->name, &key) < 0)
+        return NULL;
+    name = acquireName(&key, 0);
+    if (name == NULL)
+        return NULL;
+    for (leader = loop->inflight[inflightBucketOf(name, taskList->type, taskList->class)]; leader != NULL; leader = leader->inflightNext) {
+        if (leader->inflightName == name && leader->inflightTask->type == taskList->type && leader->inflightTask->class == taskList->class)
+            break;
+    }
+    releaseName(name);
+    return leader;
+}
+
+//res的当前任务第一个发出了上游请求，登记成领头的解析，域名驻留不了的话就不领头，自己问自己的
+void addInflight(struct EventLoop* loop, struct Resolution* res) {
+    struct NameKey key;
+    unsigned int bucket;
+
+    if (nameKeyFromDomainName(taskList->name, &key) < 0)
+        return;
+    res->leading = 1;
+    res->inflightTask = taskList;
+    res->inflightName = internName(&key, 0);
+    bucket = inflightBucketOf(res->inflightName, taskList->type, taskList->class);
+    res->inflightNext = loop->inflight[bucket];
+    loop->inflight[bucket] = res;
+}
+
+//领头的解析这一步问完了，outcome是COALESCE_RETRY、COALESCE_SKIP或者失败的rcode
+//跟随的解析放进readyFollowers，由事件循环接着推进，不在这里推进是因为调用者还拿着taskList
+void finishInflight(struct EventLoop* loop, struct Resolution* res, int outcome) {
+    struct Resolution** link;
+    struct Resolution* follower;
+
+    if (!res->leading)
+        return;
+    link = &loop->inflight[inflightBucketOf(res->inflightName, res->inflightTask->type, res->inflightTask->class)];
+    while (*link != res)
+        link = &(*link)->inflightNext;
+    *link = res->inflightNext;
+    while (res->followers != NULL) {
+        follower = res->followers;
+        res->followers = follower->nextFollower;
+        follower->coalesceOutcome = outcome;
+        follower->nextFollower = loop->readyFollowers;
+        loop->readyFollowers = follower;
+    }
+    res->leading = 0;
+    res->inflightTask = NULL;
+    releaseName(res->inflightName);
+    res->inflightName = NULL;
+}
+
+//先在授权trie中查找最佳匹配的权威服务器，如果找到了，就向它发出请求，之后的事情交给事件循环：
+//回复到了以后由handleUpstreamResponse处理，如果回复里给了新的权威服务器IP，再向新IP请求解析，循环直到得到请求的域名的解析为止。
+//注意每次请求的域名都是一模一样的，比如你请求的是北邮.教育.中国的MX，那么你问根、中国、教育的时候，question section里的内容永远都是北邮.教育.中国的MX。
+//如果没找到但是服务器是local server，那么就从"根.网络"开始请求，这一步和查找合在一次trie查找里
+//如果没找到服务器也不是local server，此题无解，删除跳过
+void queryAsAClient(struct EventLoop* loop, struct Resolution* res, struct ResourceRecord* rr) {
+    struct DelegationTrie* trie = delegationTrie;
+    struct DelegationNode* node;
+    struct TraceHop* hop;
+    struct Resolution* leader;
+    int rc, i;
+
+    //同一个问题已经有别的解析在问了，跟着它，不再自己从头问一遍
+    leader = findInflight(loop);
+    if (leader != NULL) {
+        addTraceHop(res, TRACE_STEP_COALESCED);
+        if (loop->metrics)
+            metricsAdd(loop->metrics->coalescedQueries, 1);
+        res->nextFollower = leader->followers;
+        leader->followers = res;
+        res->waiting = 1;
+        return;
+    }
+
+    rc = getDelegationRecord(rr, taskList->name, isLocal, res->msg.arena);//查找最佳匹配的权威服务器
+    if (rc > 0) {
+        //这个区域的所有权威服务器都可以问，按平滑RTT挑最快的，没回复就换下一个
+        //trie和getDelegationRecord用的可能不是同一个（中间重新加载了），所以这里还要再判断一次找没找到
+        node = findDelegation(trie, taskList->name);
+        if (node == NULL)
+            node = trie->root;
+        if (node == NULL) {
+            res->msg.rcode = ServerFailure_ResponseType;
+            moveTaskList2Next();
+            return;
+        }
+        resetUpstreamServers(res);
+        for (i = 0; i < node->addrCount; i++)
+            addUpstreamServer(res, trie->addrs[node->addrStart + i].addr);
+        res->referrals = 0;
+        hop = addTraceHop(res, TRACE_STEP_DELEGATION);
+        if (hop) {
+            hop->zone = rr->name;
+            hop->nextServers = res->serverCount;
+        }
+        if (sendUpstreamQuery(loop, res) < 0) {
+            res->msg.rcode = ServerFailure_ResponseType;
+            moveTaskList2Next();
+        }
+        else
+            addInflight(loop, res);
+    }
+    else {
+        //没有在serverFile内找到最佳匹配的权威服务器，此题无解，记进负缓存然后删除跳过。
+        cacheNegative(resolverCache, taskList->name, taskList->type, taskList->class, NameError_ResponseType, negativeTtl);
+        moveTaskList2Next();
+    }
+}
+
+//当前任务找到了解析结果rr：删掉任务，把rr放进answer section，MX的话再把邮件服务器的IP找出来放进additional section
+//fromPrefetch的意思和cacheLookup的一样
+void addAnswer(struct Message* msg, struct ResourceRecord* rr, int fromPrefetch) {
+    struct ResourceRecord rr_mx;
+    struct DomainName* exchange;
+    int rc;
+
+    moveTaskList2Next();
+    *addRecord(msg, &msg->answers, &msg->ansCount, &msg->ansCap) = *rr;
+
+    if (rr->type == MX_Resource_RecordType) {
+        exchange = domainBytes2DomainStructureFromStr(msg->arena, rr->rd_data.mx_record.exchange);
+        memset(&rr_mx, 0, sizeof(struct ResourceRecord));
+        rr_mx.type = A_Resource_RecordType;
+        rr_mx.class = rr->class;
+        rc = getRecordFromZone(&rr_mx, exchange, resolveZone, msg->arena);
+        if (rc != 2) {
+            memset(&rr_mx, 0, sizeof(struct ResourceRecord));
+            rr_mx.type = A_Resource_RecordType;
+            rr_mx.class = rr->class;
+            rc = cacheLookup(resolverCache, &rr_mx, exchange, msg->arena, fromPrefetch, NULL);
+            if (rc > 0)
+                msg->fromCache = 1;
+        }
+        if ( rc > 0 )
+            *addRecord(msg, &msg->additionals, &msg->adCount, &msg->adCap) = rr_mx;
+    }
+}
+
+//解析过程函数
+//逻辑是先从resolveFile文件和cacheFile文件中查找完全匹配，如果找到了，将此任务移出taskList，将rr放入answer section，
+//如果请求类型是MX那还得再找一遍它的A解析加入additional section
+//如果没找到完全匹配，那么从serverFile中查找最佳匹配，也就是调用一遍自己checkNameServer设为1，
+//如果找到了，将此任务移出taskList，将rr放入authority section
+//如果没找到，就不管了，直接从taskList移除。
+void resolveTask(struct Message* msg, int checkNameServer) {
+    int rc;
+    struct ResourceRecord rr;
+    memset(&rr, 0, sizeof(struct ResourceRecord));
+    rr.type = taskList->type;
+    rr.class = taskList->class;
+    switch (rr.type)
+    {
+        case A_Resource_RecordType:
+        case CNAME_Resource_RecordType:
+        case MX_Resource_RecordType:
+            if(!checkNameServer) {
+                
+                rc = getRecordFromZone(&rr, taskList->name, resolveZone, msg->arena);
+                if (rc != 2) {
+                    memset(&rr, 0, sizeof(struct ResourceRecord));
+                    rr.type = taskList->type;
+                    rr.class = taskList->class;
+                    rc = cacheLookup(resolverCache, &rr, taskList->name, msg->arena, 0, NULL);
+                    if (rc > 0)
+                        msg->fromCache = 1;
+                }
+            }
+            else
+                rc = getDelegationRecord(&rr, taskList->name, 0, msg->arena);
+            break;
+
+        default:
+            msg->rcode = NotImplemented_ResponseType;
+            if (queryLogLevel >= 2)
+                printf("Cannot answer question of type %d.\n", rr.type);
+            rc=-1;
+    }
+
+    if( !checkNameServer ) {
+        if ( rc==2 ) {
+            addAnswer(msg, &rr, 0);
+        }
+        else {
+            taskList->type = A_Resource_RecordType;
+            resolveTask(msg, 1);
+        }
+    } else {
+        moveTaskList2Next();
+        if ( rc>=0 ) {
+            //这个区域的所有权威服务器都放进authority section，客户端可以挑着问
+            *addRecord(msg, &msg->authorities, &msg->auCount, &msg->auCap) = rr;
+            addOtherDelegationRecords(msg, &rr);
+        }
+    }
+}
+
+//从事件循环的空闲链表里取一个Resolution，没有的话新分配一个，除了arena以外全部清零
+struct Resolution* allocResolution(struct EventLoop* loop) {
+    struct Resolution* res = loop->freeResolutions;
+    struct Arena arena;
+
+    if (res == NULL) {
+        res = malloc(sizeof(struct Resolution));
+        memset(&res->arena, 0, sizeof(struct Arena));
+    }
+    else
+        loop->freeResolutions = res->nextFree;
+    arena = res->arena;
+    memset(res, 0, sizeof(struct Resolution));
+    res->arena = arena;
+    res->msg.arena = &res->arena;
+    return res;
+}
+
+//请求回复完了，清空它的arena，把Resolution放回空闲链表
+void releaseResolution(struct EventLoop* loop, struct Resolution* res) {
+    resetArena(&res->arena);
+    res->nextFree = loop->freeResolutions;
+    loop->freeResolutions = res;
+}
+
+//为一条快过期的缓存记录新建一个后台解析，放进pendingPrefetches，由事件循环开始问上游
+//调用者还在推进客户端的解析，拿着taskList，所以这里不能直接开始问
+void queuePrefetch(struct EventLoop* loop, struct DomainName* name, unsigned short type, unsigned short class) {
+    struct Resolution* res = allocResolution(loop);
+    struct Question* task;
+
+    res->prefetch = 1;
+    res->timerIndex = -1;
+    gettimeofday(&res->start, NULL);
+    task = arenaAlloc(&res->arena, sizeof(struct Question));
+    task->name = copyDomainName(&res->arena, name);
+    task->type = type;
+    task->class = class;
+    task->next = NULL;
+    res->taskList = task;
+    res->nextPrefetch = loop->pendingPrefetches;
+    loop->pendingPrefetches = res;
+    if (loop->metrics)
+        metricsAdd(loop->metrics->prefetchesStarted, 1);
+}
+
+//local server的解析函数过程
+//逻辑是先从resolveFile和cacheFile中找完全匹配，找到了就和普通的resolveTask一样用addAnswer放进answer section
+//没找到就像客户端一样去向根服务器开始请求解析，此时res会开始等上游的回复
+void resolveTaskForLocalServer(struct EventLoop* loop, struct Resolution* res) {
+    int rc, step, refresh = 0;
+    unsigned short negativeRcode;
+    struct TraceHop* hop;
+    struct ResourceRecord rr;
+    struct Message* msg = &res->msg;
+    memset(&rr, 0, sizeof(struct ResourceRecord));
+    rr.type = taskList->type;
+    rr.class = taskList->class;
+
+    switch (rr.type) {
+        case A_Resource_RecordType:
+        case CNAME_Resource_RecordType:
+        case MX_Resource_RecordType:
+            rc = getRecordFromZone(&rr, taskList->name, resolveZone, msg->arena);
+            step = TRACE_STEP_LOCAL;
+            if (rc!=2) {
+                memset(&rr, 0, sizeof(struct ResourceRecord));
+                rr.type = taskList->type;
+                rr.class = taskList->class;
+                rc = cacheLookup(resolverCache, &rr, taskList->name, msg->arena, res->prefetch, &refresh);
+                step = TRACE_STEP_CACHE;
+            }
+            break;
+
+        default:
+            if (queryLogLevel >= 2)
+                printf("无法解析类型：%d\n", rr.type);
+            msg->rcode = NotImplemented_ResponseType;
+            moveTaskList2Next();
+            return;
+    }
+
+    if (rc==2) {
+        addTraceHop(res, step);
+        if (step == TRACE_STEP_CACHE)
+            msg->fromCache = 1;
+        if (refresh)//常用的记录快过期了
+            queuePrefetch(loop, taskList->name, taskList->type, taskList->class);
+        addAnswer(msg, &rr, res->prefetch);
+    }
+    else if (negativeCacheLookup(resolverCache, taskList->name, taskList->type, taskList->class, &negativeRcode)) {
+        //最近解析过这个域名这个类型而且失败了，直接返回当时的结果，不再从根开始问一遍
+        hop = addTraceHop(res, TRACE_STEP_NEGATIVE);
+        if (hop)
+            hop->rcode = negativeRcode;
+        msg->rcode = negativeRcode;
+        msg->fromCache = 1;
+        moveTaskList2Next();
+    }
+    else {
+        rr.name = NULL;//getDelegationRecord会重新填写rr.name
+        queryAsAClient(loop, res, &rr);
+    }
+}
+
+void writeMsgHeader(struct Message* msg) {
+    //写入回复Message的header
+    msg->qr = 1; //这是一条Response
+    if (!isLocal)
+        msg->aa = 1; //此服务器权威
+    else
+        msg->aa = 0;
+    if (isRecursive) {
+        msg->rd = 1; //期望递归
+        msg->ra = 1; //能够递归
+    }
+    else {
+        msg->rd = 0;
+        msg->ra = 0;
+    }
+    msg->rcode = Ok_ResponseType;
+    msg->ansCount = 0;
+    msg->auCount = 0;
+    msg->adCount = 0;
+}
+
+//创建一个绑定在myIpAddr:53上的socket，失败返回-1
+//设置了SO_REUSEPORT，多个线程可以各自绑定一个socket到同一个地址上，由内核把收到的请求分给它们
+int openServerSocket(int type) {
+    struct sockaddr_in addr;
+    int sock, on = 1;
+
+    sock = socket(AF_INET, type, 0);
+    if (sock < 0)
+        return -1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(myIpAddr);
+    addr.sin_port = htons(DNS_PORT);
+    if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) != 0
+        || (type == SOCK_STREAM && listen(sock, SOMAXCONN) < 0)) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+//把fd设为非阻塞
+void setNonBlocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+//关闭一个连接，从epoll和连接链表里删掉
+//连接不会马上释放，而是放进closedConnections，同一批epoll事件里后面可能还有它的事件，
+//而且它上面可能还有没解析完的请求，等一批事件处理完并且pending为0了再由freeClosedConnections释放
+void closeTcpConnection(struct EventLoop* loop, struct TcpConnection* conn) {
+    if (conn->closed)
+        return;
+    conn->closed = 1;
+    close(conn->handle.fd);
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        loop->connections = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    conn->prev = NULL;
+    conn->next = loop->closedConnections;
+    if (loop->closedConnections)
+        loop->closedConnections->prev = conn;
+    loop->closedConnections = conn;
+}
+
+//释放已经关闭、上面也没有还在解析的请求的连接
+void freeClosedConnections(struct EventLoop* loop) {
+    struct TcpConnection* conn;
+    struct TcpConnection* next;
+    for (conn = loop->closedConnections; conn; conn = next) {
+        next = conn->next;
+        if (conn->pending > 0)
+            continue;
+        if (conn->prev)
+            conn->prev->next = conn->next;
+        else
+            loop->closedConnections = conn->next;
+        if (conn->next)
+            conn->next->prev = conn->prev;
+        free(conn->out);
+        free(conn);
+    }
+}
+
+//把回复追加到连接的发送缓冲区后面
+void appendTcpOutput(struct TcpConnection* conn, uint8_t* data, int len) {
+    if (conn->outSent > 0) {
+        //已经发出去的部分挪掉，腾出空间
+        memmove(conn->out, conn->out + conn->outSent, conn->outLen - conn->outSent);
+        conn->outLen -= conn->outSent;
+        conn->outSent = 0;
+    }
+    if (conn->outLen + len > conn->outCap) {
+        while (conn->outLen + len > conn->outCap)
+            conn->outCap = conn->outCap ? conn->outCap * 2 : BUF_SIZE + 2;
+        conn->out = realloc(conn->out, conn->outCap);
+    }
+    memcpy(conn->out + conn->outLen, data, len);
+    conn->outLen += len;
+}
+
+//尽量把发送缓冲区发出去，发不完就在epoll里关注EPOLLOUT，等可写了再接着发
+//返回-1表示连接需要关闭：出错了，或者对方已经不再发请求而且所有回复都发完了
+int flushTcpConnection(struct EventLoop* loop, struct TcpConnection* conn) {
+    struct epoll_event ev;
+    unsigned int events;
+    int n;
+
+    while (conn->outSent < conn->outLen) {
+        n = send(conn->handle.fd, conn->out + conn->outSent, conn->outLen - conn->outSent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        conn->outSent += n;
+    }
+    if (conn->outSent == conn->outLen)
+        conn->outSent = conn->outLen = 0;
+    if (conn->eof && conn->pending == 0 && conn->outLen == 0)
+        return -1;
+
+    events = (conn->eof ? 0 : EPOLLIN) | (conn->outLen > 0 ? EPOLLOUT : 0);
+    if (events != conn->events) {
+        conn->events = events;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.ptr = &conn->handle;
+        epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->handle.fd, &ev);
+    }
+    return 0;
+}
+
+//把排队的UDP回复用sendmmsg一次发出去，一次没发完就接着发，出错的话剩下的丢掉（和原来sendto一样不重试）
+void flushUdpReplies(struct EventLoop* loop) {
+    struct UdpBatch* batch = &loop->udp;
+    int sent = 0, n;
+    long start;
+
+    while (sent < batch->sendCount) {
+        start = metricsNow();
+        n = sendmmsg(loop->server.fd, batch->sendMsgs + sent, batch->sendCount - sent, 0);
+        observeStage(METRICS_STAGE_SEND, start);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        sent += n;
+    }
+    batch->sendCount = 0;
+    batch->sendUsed = 0;
+}
+
+//把一个UDP回复拷进发送队列，队列满了先发掉
+void queueUdpReply(struct EventLoop* loop, uint8_t* data, int len, struct sockaddr_in* cltAddr, socklen_t cltAddrLen) {
+    struct UdpBatch* batch = &loop->udp;
+    int i;
+
+    if (batch->sendCount == batch->size || batch->sendUsed + len > batch->sendCap)
+        flushUdpReplies(loop);
+    i = batch->sendCount++;
+    memcpy(batch->sendBuffer + batch->sendUsed, data, len);
+    batch->sendIovs[i].iov_base = batch->sendBuffer + batch->sendUsed;
+    batch->sendIovs[i].iov_len = len;
+    batch->sendAddrs[i] = *cltAddr;
+    batch->sendMsgs[i].msg_hdr.msg_namelen = cltAddrLen;
+    batch->sendUsed += len;
+}
+
+//服务线程调用：按抽样率决定这个请求记不记，要记就返回环形缓冲区里下一个空位，填好以后调用commitQueryLog
+//缓冲区满了说明日志线程跟不上，丢掉这条并计数，服务线程从不等日志线程
+struct QueryLogRecord* beginQueryLog(struct EventLoop* loop) {
+    struct QueryLogRing* ring = loop->queryLog;
+    unsigned int tail;
+
+    if (ring == NULL)
+        return NULL;
+    if (++ring->sampleCounter < queryLogSample)
+        return NULL;
+    ring->sampleCounter = 0;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (ring->head - tail >= QUERY_LOG_RING_SIZE) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    return &ring->records[ring->head & (QUERY_LOG_RING_SIZE - 1)];
+}
+
+void commitQueryLog(struct EventLoop* loop) {
+    __atomic_store_n(&loop->queryLog->head, loop->queryLog->head + 1, __ATOMIC_RELEASE);
+}
+
+unsigned char* queryLogTypeStr(unsigned short type, unsigned char* buf) {
+    switch (type) {
+        case A_Resource_RecordType:
+            return "A";
+        case NS_Resource_RecordType:
+            return "NS";
+        case CNAME_Resource_RecordType:
+            return "CNAME";
+        case SOA_Resource_RecordType:
+            return "SOA";
+        case PTR_Resource_RecordType:
+            return "PTR";
+        case MX_Resource_RecordType:
+            return "MX";
+        default:
+            sprintf(buf, "TYPE%u", type);
+            return buf;
+    }
+}
+
+unsigned char* queryLogRcodeStr(unsigned char rcode, unsigned char* buf) {
+    switch (rcode) {
+        case Ok_ResponseType:
+            return "NOERROR";
+        case FormatError_ResponseType:
+            return "FORMERR";
+        case ServerFailure_ResponseType:
+            return "SERVFAIL";
+        case NameError_ResponseType:
+            return "NXDOMAIN";
+        case NotImplemented_ResponseType:
+            return "NOTIMP";
+        case Refused_ResponseType:
+            return "REFUSED";
+        default:
+            sprintf(buf, "RCODE%u", rcode);
+            return buf;
+    }
+}
+
+//一条记录写成一行：时间 客户端 协议 域名 类型 rcode 耗时 来源，有多个问题时最后加上问题数
+void writeQueryLogRecord(struct QueryLogRecord* record) {
+    const char* sources[] = { "local", "cache", "answer-cache", "upstream" };
+    unsigned char name[256];
+    unsigned char typeBuf[16];
+    unsigned char rcodeBuf[16];
+    unsigned char timeStr[32];
+    struct tm tm;
+    time_t sec = record->time.tv_sec;
+
+    localtime_r(&sec, &tm);
+    strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", &tm);
+    if (record->qnameLen > 1)
+        domainBytes2DomainStr(record->qname, name);
+    else
+        strcpy(name, ".");
+    fprintf(queryLogFile, "%s.%06ld %u.%u.%u.%u:%u %s %s %s %s %dus %s",
+            timeStr, (long)record->time.tv_usec,
+            record->client[0], record->client[1], record->client[2], record->client[3], record->port,
+            record->tcp ? "tcp" : "udp", name,
+            queryLogTypeStr(record->type, typeBuf), queryLogRcodeStr(record->rcode, rcodeBuf),
+            record->latency, sources[record->source]);
+    if (record->qCount > 1)
+        fprintf(queryLogFile, " questions=%u", record->qCount);
+    fputc('\n', queryLogFile);
+}
+
+//轨迹写进traceFile，再放进recentTraces，挤掉最老的一条
+void writeTraceLine(struct TraceLine* trace) {
+    struct TraceLine* slot;
+
+    fprintf(traceFile, "%s\n", trace->line);
+    pthread_mutex_lock(&recentTracesLock);
+    slot = &recentTraces[recentTraceNext++ % TRACE_RECENT];
+    free(slot->line);
+    *slot = *trace;
+    pthread_mutex_unlock(&recentTracesLock);
+}
+
+//把最近的轨迹里请求ID是id的都写进out，新的在前，返回写了几条
+//ID只有16位，不同客户端的请求可能用同一个ID，所以可能有多条
+int writeRecentTraces(FILE* out, unsigned short id) {
+    struct TraceLine* slot;
+    unsigned int i;
+    int found = 0;
+
+    pthread_mutex_lock(&recentTracesLock);
+    for (i = 1; i <= TRACE_RECENT && i <= recentTraceNext; i++) {
+        slot = &recentTraces[(recentTraceNext - i) % TRACE_RECENT];
+        if (slot->line != NULL && slot->id == id) {
+            fprintf(out, "%s\n", slot->line);
+            found++;
+        }
+    }
+    pthread_mutex_unlock(&recentTracesLock);
+    return found;
+}
+
+//日志线程：轮流把每个事件循环的查询日志和轨迹的环形缓冲区取空，都是空的就睡10毫秒
+void* queryLogThread(void* arg) {
+    struct QueryLogRing* ring;
+    struct TraceRing* traces;
+    unsigned long dropped;
+    unsigned int head;
+    int i, count, written, tracesWritten;
+
+    while (1) {
+        written = 0;
+        tracesWritten = 0;
+        pthread_mutex_lock(&eventLoopsLock);
+        count = eventLoopCount;
+        pthread_mutex_unlock(&eventLoopsLock);
+        for (i = 0; i < count; i++) {
+            traces = eventLoops[i]->traces;
+            if (traces) {
+                head = __atomic_load_n(&traces->head, __ATOMIC_ACQUIRE);
+                while (traces->tail != head) {
+                    writeTraceLine(&traces->lines[traces->tail & (TRACE_RING_SIZE - 1)]);
+                    __atomic_store_n(&traces->tail, traces->tail + 1, __ATOMIC_RELEASE);
+                    tracesWritten++;
+                }
+                dropped = __atomic_load_n(&traces->dropped, __ATOMIC_RELAXED);
+                if (dropped != traces->reportedDrops) {
+                    printf("解析轨迹跟不上，线程%d丢掉了%lu条轨迹\n", i, dropped - traces->reportedDrops);
+                    traces->reportedDrops = dropped;
+                }
+            }
+            ring = eventLoops[i]->queryLog;
+            if (ring == NULL)
+                continue;
+            head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            while (ring->tail != head) {
+                writeQueryLogRecord(&ring->records[ring->tail & (QUERY_LOG_RING_SIZE - 1)]);
+                __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+                written++;
+            }
+            dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+            if (dropped != ring->reportedDrops) {
+                fprintf(queryLogFile, "查询日志跟不上，线程%d丢掉了%lu条记录\n", i, dropped - ring->reportedDrops);
+                ring->reportedDrops = dropped;
+                written++;
+            }
+        }
+        if (written > 0)
+            fflush(queryLogFile);
+        if (tracesWritten > 0)
+            fflush(traceFile);
+        if (written == 0 && tracesWritten == 0)
+            usleep(10000);
+    }
+    return NULL;
+}
+
+//回复缓存key的哈希，FNV-1a；qname是规范化（小写）的域名字节码
+unsigned int hashAnswerCacheKey(uint8_t* qname, int len, unsigned short type, unsigned short class, unsigned short flags) {
+    unsigned int hash = 2166136261u;
+    int i;
+    for (i = 0; i < len; i++) {
+        hash ^= qname[i];
+        hash *= 16777619u;
+    }
+    hash ^= type;
+    hash *= 16777619u;
+    hash ^= class;
+    hash *= 16777619u;
+    hash ^= flags;
+    hash *= 16777619u;
+    return hash;
+}
+
+//把一个回复放进回复缓存，只有只带一个question、内容全部来自区域索引和授权trie的UDP回复才放
+void storeAnswerCache(struct EventLoop* loop, struct Resolution* res, uint8_t* response, int len) {
+    struct AnswerCacheEntry* entry;
+    struct AnswerCacheEntry** slot;
+    struct NameKey key;
+    unsigned short flags = (res->msg.opcode << 11) & ANSWER_CACHE_FLAG_MASK;
+    unsigned int hash;
+
+    if (loop->answerCache == NULL || res->conn || res->msg.qCount != 1 || res->msg.fromCache)
+        return;
+    if (nameKeyFromDomainName(res->msg.questions[0].name, &key) < 0)
+        return;
+    hash = hashAnswerCacheKey(key.wire, key.len, res->msg.questions[0].type, res->msg.questions[0].class, flags);
+    entry = malloc(sizeof(struct AnswerCacheEntry) + len);
+    entry->hash = hash;
+    entry->type = res->msg.questions[0].type;
+    entry->class = res->msg.questions[0].class;
+    entry->flags = flags;
+    entry->qnameLen = key.len;
+    memcpy(entry->qname, key.wire, key.len);
+    entry->len = len;
+    memcpy(entry->response, response, len);
+
+    slot = &loop->answerCache[hash & (ANSWER_CACHE_SLOTS - 1)];
+    free(*slot);
+    *slot = entry;
+}
+
+//收到的UDP请求先在回复缓存里找，命中了就补上ID和question直接回复，返回1；没命中返回0，按正常流程解析
+//这里不解析整个报文，只读只有一个question、域名没有压缩指针的请求，其他的都交给正常流程
+int replyFromAnswerCache(struct EventLoop* loop, uint8_t* request, int len, struct sockaddr_in* cltAddr, socklen_t cltAddrLen) {
+    struct AnswerCacheEntry* entry;
+    struct QueryLogRecord* record;
+    uint8_t qname[256];
+    uint8_t* p = request + 12;
+    unsigned short type, class, flags;
+    int qnameLen = 0, i;
+    uint8_t c;
+
+    if (loop->answerCache == NULL || len < 12 || (request[2] & 0x80) || request[4] != 0 || request[5] != 1)
+        return 0;
+    while (1) {
+        if (p >= request + len || (*p & 0xC0))
+            return 0;
+        if (qnameLen + 1 + *p > 255 || p + 1 + *p > request + len)
+            return 0;
+        qname[qnameLen++] = *p;
+        if (*p == 0)
+            break;
+        for (i = 1; i <= p[0]; i++) {
+            c = p[i];
+            qname[qnameLen++] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+        }
+        p += 1 + p[0];
+    }
+    p++;
+    if (p + 4 > request + len)
+        return 0;
+    type = get16bits(&p);
+    class = get16bits(&p);
+    flags = ((request[2] << 8) | request[3]) & ANSWER_CACHE_FLAG_MASK;
+
+    entry = loop->answerCache[hashAnswerCacheKey(qname, qnameLen, type, class, flags) & (ANSWER_CACHE_SLOTS - 1)];
+    if (entry == NULL || entry->type != type || entry->class != class || entry->flags != flags
+        || entry->qnameLen != qnameLen || memcmp(entry->qname, qname, qnameLen) != 0)
+        return 0;
+    memcpy(entry->response, request, 2);
+    memcpy(entry->response + 12, request + 12, qnameLen + 4);
+    queueUdpReply(loop, entry->response, entry->len, cltAddr, cltAddrLen);
+    if (loop->metrics)
+        metricsAdd(loop->metrics->answerCacheHits[metricsQtypeOf(type)][metricsRcodeOf(entry->response[3] & RCODE_MASK)], 1);
+
+    record = beginQueryLog(loop);
+    if (record) {
+        gettimeofday(&record->time, NULL);
+        memcpy(record->client, &cltAddr->sin_addr, 4);
+        record->port = ntohs(cltAddr->sin_port);
+        record->tcp = 0;
+        record->source = QUERY_LOG_SOURCE_ANSWER_CACHE;
+        record->type = type;
+        record->rcode = entry->response[3] & RCODE_MASK;
+        record->qCount = 1;
+        record->latency = 0;
+        record->qnameLen = qnameLen;
+        memcpy(record->qname, request + 12, qnameLen);
+        commitQueryLog(loop);
+    }
+    return 1;
+}
+
+//把域名写成JSON字符串，客户端发来的标签里什么字节都可能有，引号、反斜杠和控制字符要转义
+void writeJsonName(FILE* out, struct DomainName* name) {
+    unsigned char str[256];
+    int i;
+
+    getDomainNameStr(name, str);
+    if (str[0] == '\0')
+        strcpy(str, ".");
+    fputc('"', out);
+    for (i = 0; str[i]; i++) {
+        if (str[i] == '"' || str[i] == '\\')
+            fprintf(out, "\\%c", str[i]);
+        else if (str[i] < 0x20)
+            fprintf(out, "\\u%04x", str[i]);
+        else
+            fputc(str[i], out);
+    }
+    fputc('"', out);
+}
+
+void writeTraceHop(FILE* out, struct TraceHop* hop) {
+    const char* steps[] = { "local", "cache", "negative", "delegation", "query", "coalesced" };
+    const char* results[] = { "pending", "answer", "referral", "referral-limit", "failure", "timeout" };
+    unsigned char buf[16];
+
+    fprintf(out, "{\"step\":\"%s\",\"name\":", steps[hop->step]);
+    writeJsonName(out, hop->name);
+    fprintf(out, ",\"type\":\"%s\"", queryLogTypeStr(hop->type, buf));
+    switch (hop->step) {
+        case TRACE_STEP_NEGATIVE:
+            fprintf(out, ",\"rcode\":\"%s\"", queryLogRcodeStr(hop->rcode, buf));
+            break;
+        case TRACE_STEP_DELEGATION:
+            fprintf(out, ",\"zone\":");
+            writeJsonName(out, hop->zone);
+            fprintf(out, ",\"servers\":%d", hop->nextServers);
+            break;
+        case TRACE_STEP_QUERY:
+            fprintf(out, ",\"server\":\"%u.%u.%u.%u\",\"result\":\"%s\",\"rtt_us\":%d",
+                    hop->server[0], hop->server[1], hop->server[2], hop->server[3], results[hop->result], hop->rtt);
+            if (hop->result != TRACE_RESULT_PENDING && hop->result != TRACE_RESULT_TIMEOUT)
+                fprintf(out, ",\"rcode\":\"%s\"", queryLogRcodeStr(hop->rcode, buf));
+            if (hop->result == TRACE_RESULT_REFERRAL)
+                fprintf(out, ",\"next_servers\":%d", hop->nextServers);
+            break;
+    }
+    fputc('}', out);
+}
+
+//问过上游的解析回复以后，把它的轨迹写成一行JSON交给日志线程，缓冲区满了就丢掉
+//JSON在服务线程里写，但只有要问上游的解析才会走到这里，这时已经至少等了一个RTT，写一行JSON的时间可以忽略
+void emitTrace(struct EventLoop* loop, struct Resolution* res, struct sockaddr_in* addr, struct timeval* end, int timeuse) {
+    struct TraceRing* ring = loop->traces;
+    struct TraceLine* slot;
+    unsigned char timeStr[32];
+    unsigned char buf[16];
+    char* line;
+    size_t lineLen;
+    struct tm tm;
+    time_t sec = end->tv_sec;
+    FILE* out;
+    int i;
+
+    if (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= TRACE_RING_SIZE) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    localtime_r(&sec, &tm);
+    strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", &tm);
+    out = open_memstream(&line, &lineLen);
+    fprintf(out, "{\"time\":\"%s.%06ld\",\"id\":%u,\"client\":\"%u.%u.%u.%u:%u\",\"transport\":\"%s\"",
+            timeStr, (long)end->tv_usec, res->msg.id,
+            ((uint8_t*)&addr->sin_addr)[0], ((uint8_t*)&addr->sin_addr)[1], ((uint8_t*)&addr->sin_addr)[2], ((uint8_t*)&addr->sin_addr)[3],
+            ntohs(addr->sin_port), res->conn ? "tcp" : "udp");
+    if (res->msg.qCount > 0) {
+        fprintf(out, ",\"question\":");
+        writeJsonName(out, res->msg.questions[0].name);
+        fprintf(out, ",\"type\":\"%s\"", queryLogTypeStr(res->msg.questions[0].type, buf));
+    }
+    fprintf(out, ",\"questions\":%d,\"rcode\":\"%s\",\"latency_us\":%d,\"upstream_queries\":%d,\"hops\":[",
+            res->msg.qCount, queryLogRcodeStr(res->msg.rcode, buf), timeuse, res->upstreamQueries);
+    for (i = 0; i < res->traceCount; i++) {
+        if (i > 0)
+            fputc(',', out);
+        writeTraceHop(out, &res->trace[i]);
+    }
+    fprintf(out, "]}");
+    fclose(out);
+
+    slot = &ring->lines[ring->head & (TRACE_RING_SIZE - 1)];
+    slot->id = res->msg.id;
+    slot->line = line;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+//所有question都解决了，把回复发给客户端，然后把res还给事件循环
+void finishResolution(struct EventLoop* loop, struct Resolution* res) {
+    struct TcpConnection* conn = res->conn;
+    struct timeval end;
+    uint8_t* pointerForWrite;
+    uint8_t* pointerForLength;
+    struct QueryLogRecord* record;
+    struct sockaddr_in* addr;
+    int bufLen, timeuse;
+    long start;
+
+    //预取没有客户端在等，刷新了缓存就完了
+    if (res->prefetch) {
+        if (loop->metrics && res->msg.rcode == Ok_ResponseType && res->msg.ansCount > 0)
+            metricsAdd(loop->metrics->prefetchesRefreshed, 1);
+        releaseResolution(loop, res);
+        return;
+    }
+
+    if (queryLogLevel >= 2)
+        printMessage(&res->msg);//打印准备好的回复
+
+    //开始将msg写入buffer，写出去的每个字节都是编码时写的，不用先清零
+    pointerForWrite = loop->buffer;
+    if (conn) {
+        //TCP，先写入两个字节占位，等消息都写完了再回到这里来补填长度
+        put16bits(&pointerForWrite, 0);
+    }
+    start = metricsNow();
+    writeBuffer(&res->msg, &pointerForWrite);
+    observeStage(METRICS_STAGE_ENCODE, start);
+    bufLen = pointerForWrite - loop->buffer;
+    if (conn) {
+        pointerForLength = loop->buffer;
+        put16bits(&pointerForLength, bufLen-2);//回到buffer的最开始，写入2个字节的长度信息，其中减2是因为长度不包括记录长度的那两个字节自己
+        conn->pending--;
+        if (!conn->closed) {
+            start = metricsNow();
+            appendTcpOutput(conn, loop->buffer, bufLen);
+            if (flushTcpConnection(loop, conn) < 0)
+                closeTcpConnection(loop, conn);
+            observeStage(METRICS_STAGE_SEND, start);
+        }
+    }
+    else {
+        queueUdpReply(loop, loop->buffer, bufLen, &res->cltAddr, res->cltAddrLen);
+        storeAnswerCache(loop, res, loop->buffer, bufLen);
+    }
+
+    gettimeofday(&end, NULL); //记录结束时间
+    timeuse = 1000000 * ( end.tv_sec - res->start.tv_sec ) + end.tv_usec - res->start.tv_usec;//计算时间差
+    if (queryLogLevel >= 2)
+        printf("time: %d us\n", timeuse);
+    if (loop->metrics) {
+        observeLatency(&loop->metrics->requests[metricsQtypeOf(res->msg.qCount > 0 ? res->msg.questions[0].type : 0)][metricsRcodeOf(res->msg.rcode)],
+                       timeuse * 1000L);
+    }
+
+    addr = conn ? &conn->addr : &res->cltAddr;
+    if (loop->traces && res->upstreamQueries > 0)
+        emitTrace(loop, res, addr, &end, timeuse);
+
+    record = beginQueryLog(loop);
+    if (record) {
+        record->time = end;
+        memcpy(record->client, &addr->sin_addr, 4);
+        record->port = ntohs(addr->sin_port);
+        record->tcp = conn != NULL;
+        if (res->upstreamQueries > 0)
+            record->source = QUERY_LOG_SOURCE_UPSTREAM;
+        else if (res->msg.fromCache)
+            record->source = QUERY_LOG_SOURCE_CACHE;
+        else
+            record->source = QUERY_LOG_SOURCE_LOCAL;
+        record->rcode = res->msg.rcode;
+        record->qCount = res->msg.qCount > 255 ? 255 : res->msg.qCount;
+        record->latency = timeuse;
+        record->type = 0;
+        record->qnameLen = 1;
+        record->qname[0] = 0;
+        if (res->msg.qCount > 0) {
+            pointerForWrite = record->qname;
+            putDomainName2Buffer(&pointerForWrite, res->msg.questions[0].name, NULL);
+            record->qnameLen = pointerForWrite - record->qname;
+            record->type = res->msg.questions[0].type;
+        }
+        commitQueryLog(loop);
+    }
+
+    releaseResolution(loop, res);
+}
+
+//推进一个解析，直到它开始等上游的回复，或者所有question都解决了，这时直接回复客户端
+//taskList在推进期间指向这个解析自己的任务链表，resolveTask这些函数就和以前一样只管taskList
+void advanceResolution(struct EventLoop* loop, struct Resolution* res) {
+    taskList = res->taskList;
+    while (taskList && !res->waiting) {
+        if (isLocal || isRecursive) {
+            resolveTaskForLocalServer(loop, res);
+        }
+        else {
+            resolveTask(&res->msg, 0);
+        }
+    }
+    res->taskList = taskList;
+    taskList = NULL;
+    if (!res->waiting)
+        finishResolution(loop, res);
+}
+
+//推进所有领头已经问完的跟随解析，推进的过程中可能又有新的跟随解析变成ready，一直做到没有为止
+void runReadyFollowers(struct EventLoop* loop) {
+    struct Resolution* res;
+
+    while (loop->readyFollowers != NULL) {
+        res = loop->readyFollowers;
+        loop->readyFollowers = res->nextFollower;
+        res->nextFollower = NULL;
+        res->waiting = 0;
+        taskList = res->taskList;
+        if (res->coalesceOutcome != COALESCE_RETRY) {
+            if (res->coalesceOutcome != COALESCE_SKIP)
+                res->msg.rcode = res->coalesceOutcome;
+            moveTaskList2Next();
+        }
+        res->taskList = taskList;
+        taskList = NULL;
+        advanceResolution(loop, res);
+    }
+}
+
+//开始问排队的预取：和客户端的解析一样从queryAsAClient开始，同一个问题已经有解析在问的话就跟着它
+//预取不回复客户端，问完了在finishResolution里直接放回空闲链表
+void startPrefetches(struct EventLoop* loop) {
+    struct Resolution* res;
+    struct ResourceRecord rr;
+
+    while (loop->pendingPrefetches != NULL) {
+        res = loop->pendingPrefetches;
+        loop->pendingPrefetches = res->nextPrefetch;
+        res->nextPrefetch = NULL;
+        memset(&rr, 0, sizeof(struct ResourceRecord));
+        rr.type = res->taskList->type;
+        rr.class = res->taskList->class;
+        taskList = res->taskList;
+        queryAsAClient(loop, res, &rr);
+        res->taskList = taskList;
+        taskList = NULL;
+        if (!res->waiting)
+            finishResolution(loop, res);
+    }
+}
+
+//开始处理一个请求：把request里的packet读成视图，把其中的question复制进msg和任务链表，然后开始解析
+//request指向DNS报文本身，len是报文的长度，TCP前面那两个字节的长度要由调用者跳过
+//conn不为NULL时是TCP连接上来的请求，否则回复发给UDP的cltAddr
+//报文格式不对的话直接丢掉，不回复
+void startResolution(struct EventLoop* loop, uint8_t* request, int len, struct TcpConnection* conn, struct sockaddr_in* cltAddr, socklen_t cltAddrLen) {
+    struct MessageView view;
+    struct Resolution* res;
+    long start = metricsNow();
+
+    if (readMessageView(&view, request, len) < 0) {
+        if (loop->metrics)
+            metricsAdd(loop->metrics->malformedRequests, 1);
+        if (queryLogLevel >= 2)
+            printf("收到格式错误的请求，丢掉\n");
+        return;
+    }
+    if (queryLogLevel >= 2)
+        printMessageView(&view);
+
+    res = allocResolution(loop);
+    gettimeofday( &res->start, NULL );//记录开始查询的时间
+    res->timerIndex = -1;
+    res->conn = conn;
+    if (conn)
+        conn->pending++;
+    else {
+        res->cltAddr = *cltAddr;
+        res->cltAddrLen = cltAddrLen;
+    }
+
+    res->msg.id = view.id;
+    res->msg.opcode = view.opcode;
+    res->msg.qCount = view.questionCount;
+    res->msg.questions = viewQuestions2Questions(&view, &res->arena);
+    observeStage(METRICS_STAGE_PARSE, start);
+    writeMsgHeader(&res->msg);
+
+    taskList = NULL;
+    putQuestionsInMsgToTaskList(&res->msg);
+    res->taskList = taskList;
+    taskList = NULL;
+
+    advanceResolution(loop, res);
+}
+
+//上游的回复到了，try是它对应的那次请求，reply是已经读好的回复
+//回复里有请求的结果就存进缓存，任务留着，advanceResolution重新解析时会从缓存里找到；
+//回复里给了新的权威服务器IP就接着问它；都没有就是解析失败
+void handleUpstreamResponse(struct EventLoop* loop, struct UpstreamTry* try, struct MessageView* reply) {
+    struct Resolution* res = try->res;
+    int traceIndex = try->traceHop;//try在重新发请求时会被覆盖，先记下来
+    struct TraceHop* hop;
+    struct timeval end;
+    unsigned char ipStr[16];
+    int i, hasResult, timeuse;
+
+    gettimeofday(&end, NULL );
+    timeuse = 1000000 * ( end.tv_sec - try->sentAt.tv_sec ) + end.tv_usec - try->sentAt.tv_usec;
+    updateServerRtt(try->server, timeuse);//RTT记进RTT表，以后挑服务器用
+    if (loop->metrics)
+        observeLatency(&loop->metrics->stages[METRICS_STAGE_UPSTREAM], timeuse * 1000L);
+    stopWaitingUpstream(loop, res);
+
+    if (queryLogLevel >= 2) {
+        sprintf(ipStr,"%u.%u.%u.%u",try->server[0],try->server[1],try->server[2],try->server[3]);
+        printf("\n\nResponse from %s:\n",ipStr);
+        printMessageView(reply);
+        printf("time: %d us\n", timeuse);
+    }
+
+    hop = traceHopOf(res, traceIndex);
+    if (hop) {
+        hop->rtt = timeuse;
+        hop->rcode = reply->rcode;
+    }
+
+    taskList = res->taskList;
+    hasResult = 0;
+    hasResult+= saveRecord2Cache(reply, 0, reply->authorityStart, taskList->name, taskList->type, 0, res->prefetch);
+    hasResult+= saveRecord2Cache(reply, reply->additionalStart, reply->recordCount, taskList->name, taskList->type, 1, res->prefetch);
+    //权威服务器那一段（authorityStart到additionalStart）不可缓存
+    //saveRecord2Cache的if里有判定条件，只有rr与所请求的完全匹配的情况下才存入缓存，除非force save是1
+    //saveRecord2Cache函数的返回结果是这些section中是否包含原始请求的解析结果，如果包含解析结果，那么任务留在taskList里，
+    //advanceResolution会从头重新解析，也就是重新从缓存中找解析结果，此时因为结果已经存入缓存，所以可以成功解析。
+    if (hop && hasResult > 0)
+        hop->result = TRACE_RESULT_ANSWER;
+    if (hasResult > 0)
+        finishInflight(loop, res, COALESCE_RETRY);
+    if (hasResult == 0) {
+        if (reply->additionalStart > reply->authorityStart && reply->records[reply->authorityStart].type == A_Resource_RecordType) {
+            if (res->referrals >= MAX_REFERRALS) {
+                if (hop)
+                    hop->result = TRACE_RESULT_REFERRAL_LIMIT;
+                if (queryLogLevel >= 2)
+                    printf("转发次数太多，放弃解析\n");
+                res->msg.rcode = ServerFailure_ResponseType;
+                finishInflight(loop, res, ServerFailure_ResponseType);
+                moveTaskList2Next();
+            }
+            else {
+                //authority section里所有的A记录都是下一步可以问的服务器
+                res->referrals++;
+                resetUpstreamServers(res);
+                for (i = reply->authorityStart; i < reply->additionalStart; i++)
+                    if (reply->records[i].type == A_Resource_RecordType)
+                        addUpstreamServer(res, reply->records[i].addr);
+                hop = traceHopOf(res, traceIndex);
+                if (hop) {
+                    hop->result = TRACE_RESULT_REFERRAL;
+                    hop->nextServers = res->serverCount;
+                }
+                if (sendUpstreamQuery(loop, res) < 0) {
+                    res->msg.rcode = ServerFailure_ResponseType;
+                    finishInflight(loop, res, ServerFailure_ResponseType);
+                    moveTaskList2Next();
+                }
+            }
+        }
+        else {
+            //原则上讲authority section的内容应该是一个NS，然后在additional section存着这个NS的A解析，不过作业要求里没有NS解析
+            //没有authority section，解析失败，把这次失败记进负缓存，上游说了NXDOMAIN就是NXDOMAIN，否则就是NODATA
+            if (hop)
+                hop->result = TRACE_RESULT_FAILURE;
+            cacheNegative(resolverCache, taskList->name, taskList->type, taskList->class, reply->rcode, negativeTtlOf(reply));
+            finishInflight(loop, res, COALESCE_SKIP);
+            moveTaskList2Next();
+        }
+    }
+    res->taskList = taskList;
+    taskList = NULL;
+
+    if (!res->waiting)
+        advanceResolution(loop, res);
+}
+
+//upstreamSockets中的一个收到了回复，一直收到没有为止
+//每个回复先按ID在pendingTries里找，再核对socket、服务器地址、端口和question，都对得上才交给handleUpstreamResponse
+void receiveUpstreamResponses(struct EventLoop* loop, struct EventHandle* handle) {
+    struct MessageView reply;
+    struct sockaddr_in from;
+    socklen_t fromLen;
+    struct UpstreamTry* try;
+    struct QuestionView* q;
+    unsigned short id;
+    uint8_t* p;
+    int n, socketIndex;
+
+    socketIndex = handle - loop->upstreamSockets;
+    while (1) {
+        fromLen = sizeof(from);
+        n = recvfrom(handle->fd, loop->buffer, BUF_SIZE, 0, (struct sockaddr *) &from, &fromLen);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (n < 12 || from.sin_port != htons(53))
+            continue;//连header都不完整，或者不是从53端口来的，丢掉
+        p = loop->buffer;
+        id = get16bits(&p);
+        for (try = loop->pendingTries[id % UPSTREAM_ID_BUCKETS]; try; try = try->next)
+            if (try->id == id && try->socketIndex == socketIndex && memcmp(&from.sin_addr.s_addr, try->server, 4) == 0)
+                break;
+        if (try == NULL)
+            continue;//不是在等的回复，可能是已经放弃了的请求晚到的回复，丢掉
+
+        if (readMessageView(&reply, loop->buffer, n) < 0 || reply.questionCount == 0)
+            continue;//格式不对，丢掉继续等
+        q = &reply.questions[0];
+        if (q->type != try->res->taskList->type || q->class != try->res->taskList->class
+            || !viewNameEqual(&reply, q->name, try->res->taskList->name))
+            continue;//ID对上了但是问的不是同一个问题，丢掉继续等
+        handleUpstreamResponse(loop, try, &reply);
+    }
+}
+
+//处理已经到了重传时间的上游请求：这个服务器的平滑RTT翻倍，换一个服务器重发，等待时间翻倍，
+//一共发了UPSTREAM_MAX_TRIES次还没有回复，这个任务回复SERVFAIL，然后接着解析下一个任务
+//返回离下一个重传时间还有多少毫秒，没有在等的请求时返回-1
+int expireUpstreamQueries(struct EventLoop* loop) {
+    struct Resolution* res;
+    struct UpstreamTry* try;
+    struct TraceHop* hop;
+    long now = monotonicMillis();
+
+    while (loop->timerCount > 0 && (res = loop->timers[0])->deadline <= now) {
+        try = &res->tries[res->tryCount - 1];
+        hop = traceHopOf(res, try->traceHop);
+        if (hop) {
+            hop->result = TRACE_RESULT_TIMEOUT;
+            hop->rtt = try->rto * 1000;
+        }
+        if (queryLogLevel >= 2)
+            printf("向%u.%u.%u.%u的请求超时\n", try->server[0], try->server[1], try->server[2], try->server[3]);
+        if (loop->metrics)
+            metricsAdd(loop->metrics->upstreamTimeouts, 1);
+        penalizeServerRtt(try->server, try->rto * 1000);
+        taskList = res->taskList;
+        if (res->tryCount >= UPSTREAM_MAX_TRIES || sendUpstreamQuery(loop, res) < 0) {
+            if (res->waiting)
+                stopWaitingUpstream(loop, res);
+            res->msg.rcode = ServerFailure_ResponseType;
+            finishInflight(loop, res, ServerFailure_ResponseType);
+            moveTaskList2Next();
+            res->taskList = taskList;
+            taskList = NULL;
+            advanceResolution(loop, res);
+        }
+        else {
+            res->taskList = taskList;
+            taskList = NULL;
+        }
+    }
+    return loop->timerCount > 0 ? loop->timers[0]->deadline - now : -1;
+}
+
+//处理in里所有已经收完整的请求，一个请求是两个字节的长度加上这么长的DNS报文
+//返回-1表示收到了长度为0的非法请求，需要关闭连接
+int processTcpRequests(struct EventLoop* loop, struct TcpConnection* conn) {
+    uint8_t* p;
+    int offset = 0;
+    int len;
+
+    while (!conn->closed && conn->inLen - offset >= 2) {
+        p = conn->in + offset;
+        len = get16bits(&p);
+        if (len == 0)
+            return -1;
+        if (conn->inLen - offset - 2 < len)
+            break;//这个请求还没收完，等下一次可读
+
+        startResolution(loop, conn->in + offset + 2, len, conn, NULL, 0);
+        offset += 2 + len;
+    }
+    if (offset > 0) {
+        memmove(conn->in, conn->in + offset, conn->inLen - offset);
+        conn->inLen -= offset;
+        memset(conn->in + conn->inLen, 0, offset);
+    }
+    return 0;
+}
+
+//新连接，一直accept到没有为止
+void acceptTcpConnections(struct EventLoop* loop) {
+    struct TcpConnection* conn;
+    struct epoll_event ev;
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    int fd;
+
+    while ((fd = accept(loop->server.fd, (struct sockaddr*)&addr, &addrLen)) >= 0) {
+        setNonBlocking(fd);
+        conn = malloc(sizeof(struct TcpConnection));
+        memset(conn, 0, sizeof(struct TcpConnection));
+        conn->addr = addr;
+        addrLen = sizeof(addr);
+        conn->handle.type = EVENT_CLIENT;
+        conn->handle.fd = fd;
+        conn->handle.owner = conn;
+        conn->events = EPOLLIN;
+        conn->lastActive = monotonicSeconds();
+        conn->next = loop->connections;
+        if (loop->connections)
+            loop->connections->prev = conn;
+        loop->connections = conn;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = &conn->handle;
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+//客户端TCP连接上有事件：读进所有能读的数据，处理收完整的请求，再把回复尽量发出去
+void serviceTcpConnection(struct EventLoop* loop, struct TcpConnection* conn, unsigned int events) {
+    int n, closeIt = 0;
+
+    if (conn->closed)
+        return;
+    conn->lastActive = monotonicSeconds();
+    conn->pending++;//处理期间防止连接被释放
+    if (events & EPOLLIN) {
+        while (!conn->closed) {
+            n = recv(conn->handle.fd, conn->in + conn->inLen, sizeof(conn->in) - conn->inLen, 0);
+            if (n > 0) {
+                conn->inLen += n;
+                if (processTcpRequests(loop, conn) < 0) {
+                    closeIt = 1;
+                    break;
+                }
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n == 0)
+                conn->eof = 1;//对方不会再发请求了，还在解析的请求的回复还是要发出去
+            else if (errno != EAGAIN && errno != EWOULDBLOCK)
+                closeIt = 1;
+            break;
+        }
+    }
+    else if (events & (EPOLLERR | EPOLLHUP)) {
+        closeIt = 1;
+    }
+    conn->pending--;
+    if (!conn->closed && (closeIt || flushTcpConnection(loop, conn) < 0))
+        closeTcpConnection(loop, conn);
+}
+
+//普通服务器收到了UDP请求，一直收到没有为止
+//分配批量收发用的数组，每个收发槽的iovec和地址都预先挂好，之后每次系统调用不用再填
+void initUdpBatch(struct UdpBatch* batch, int size) {
+    int i;
+
+    batch->size = size;
+    batch->recvMsgs = malloc(sizeof(struct mmsghdr) * size);
+    batch->recvIovs = malloc(sizeof(struct iovec) * size);
+    batch->recvAddrs = malloc(sizeof(struct sockaddr_in) * size);
+    batch->recvBuffers = malloc((size_t)UDP_REQUEST_SLOT_SIZE * size);
+    batch->sendMsgs = malloc(sizeof(struct mmsghdr) * size);
+    batch->sendIovs = malloc(sizeof(struct iovec) * size);
+    batch->sendAddrs = malloc(sizeof(struct sockaddr_in) * size);
+    batch->sendCap = (size_t)BUF_SIZE * 2;//至少放得下一个最长的回复
+    batch->sendBuffer = malloc(batch->sendCap);
+    batch->sendCount = 0;
+    batch->sendUsed = 0;
+    memset(batch->recvMsgs, 0, sizeof(struct mmsghdr) * size);
+    memset(batch->sendMsgs, 0, sizeof(struct mmsghdr) * size);
+    for (i = 0; i < size; i++) {
+        batch->recvIovs[i].iov_base = batch->recvBuffers + (size_t)UDP_REQUEST_SLOT_SIZE * i;
+        batch->recvIovs[i].iov_len = UDP_REQUEST_SLOT_SIZE;
+        batch->recvMsgs[i].msg_hdr.msg_iov = &batch->recvIovs[i];
+        batch->recvMsgs[i].msg_hdr.msg_iovlen = 1;
+        batch->recvMsgs[i].msg_hdr.msg_name = &batch->recvAddrs[i];
+        batch->sendMsgs[i].msg_hdr.msg_iov = &batch->sendIovs[i];
+        batch->sendMsgs[i].msg_hdr.msg_iovlen = 1;
+        batch->sendMsgs[i].msg_hdr.msg_name = &batch->sendAddrs[i];
+    }
+}
+
+//一次recvmmsg收一批请求，挨个处理，当场能回复的回复都进发送队列，这一批处理完再一起发出去
+//收到的不满一批说明socket里已经没有了，不用再调一次recvmmsg等EAGAIN，剩下的epoll会再通知
+void receiveUdpRequests(struct EventLoop* loop) {
+    struct UdpBatch* batch = &loop->udp;
+    struct msghdr* hdr;
+    uint8_t* request;
+    unsigned int generation;
+    int n, i;
+
+    //区域数据重新加载过了，回复缓存里的都是旧数据编出来的，全部清掉
+    generation = __atomic_load_n(&zoneGeneration, __ATOMIC_ACQUIRE);
+    if (loop->answerCache && loop->answerGeneration != generation) {
+        for (i = 0; i < ANSWER_CACHE_SLOTS; i++) {
+            free(loop->answerCache[i]);
+            loop->answerCache[i] = NULL;
+        }
+        loop->answerGeneration = generation;
+    }
+
+    while (1) {
+        for (i = 0; i < batch->size; i++)
+            batch->recvMsgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        n = recvmmsg(loop->server.fd, batch->recvMsgs, batch->size, 0, NULL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            hdr = &batch->recvMsgs[i].msg_hdr;
+            if (hdr->msg_flags & MSG_TRUNC) {
+                if (loop->metrics)
+                    metricsAdd(loop->metrics->malformedRequests, 1);
+                if (queryLogLevel >= 2)
+                    printf("收到超长的请求，丢掉\n");
+                continue;
+            }
+            request = batch->recvIovs[i].iov_base;
+            if (replyFromAnswerCache(loop, request, batch->recvMsgs[i].msg_len, &batch->recvAddrs[i], hdr->msg_namelen))
+                continue;
+            startResolution(loop, request, batch->recvMsgs[i].msg_len, NULL, &batch->recvAddrs[i], hdr->msg_namelen);
+        }
+        flushUdpReplies(loop);
+        if (n < batch->size)
+            break;
+    }
+}
+
+//等所有事件循环都经过一次静止点：换指针之前就睡在epoll_wait里的，醒来以后读到的一定是新指针；
+//醒着的，等它的epoch变了，说明它手上那一轮事件已经处理完了。之后就没有线程还拿着旧的区域数据了
+//查询线程不用加锁也不用等，只是这里多等一会儿，最多等一轮事件处理的时间
+void waitForEventLoopsQuiescent() {
+    unsigned long* snapshot;
+    struct EventLoop* loop;
+    int i, count;
+
+    pthread_mutex_lock(&eventLoopsLock);
+    count = eventLoopCount;
+    snapshot = malloc(sizeof(unsigned long) * (count ? count : 1));
+    for (i = 0; i < count; i++)
+        snapshot[i] = __atomic_load_n(&eventLoops[i]->epoch, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&eventLoopsLock);
+    for (i = 0; i < count; i++) {
+        loop = eventLoops[i];
+        if (snapshot[i] % 2 == 1)
+            continue;
+        while (__atomic_load_n(&loop->epoch, __ATOMIC_SEQ_CST) == snapshot[i])
+            usleep(1000);
+    }
+    free(snapshot);
+}
+
+//重新加载resolveFile和serverFile：在这个线程里把新的索引和trie建好，换掉全局指针，等所有线程都不用旧的了再释放旧的
+//建索引的时候查询照常进行，用的还是旧的数据；新文件打不开的话得到的是空的索引，和启动时一样
+void reloadZones() {
+    struct ZoneIndex* zone;
+    struct ZoneIndex* oldZone;
+    struct DelegationTrie* trie;
+    struct DelegationTrie* oldTrie;
+
+    zone = loadZoneImage(resolveImageFile, resolveFile);
+    if (zone == NULL)
+        zone = loadZoneFromFile(resolveFile);
+    trie = loadDelegationTrie(serverFile, serverImageFile);
+
+    oldZone = __atomic_exchange_n(&resolveZone, zone, __ATOMIC_SEQ_CST);
+    oldTrie = __atomic_exchange_n(&delegationTrie, trie, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&zoneGeneration, 1, __ATOMIC_SEQ_CST);
+
+    waitForEventLoopsQuiescent();
+    freeZoneIndex(oldZone);
+    freeDelegationTrie(oldTrie);
+    printf("区域数据已重新加载\n");
+}
+
+//收到SIGHUP就重新加载区域数据；SIGHUP在所有线程里都被屏蔽了，只有这个线程用sigwait等它
+void* reloadThread(void* arg) {
+    sigset_t* set = arg;
+    int sig;
+
+    while (1) {
+        if (sigwait(set, &sig) != 0)
+            continue;
+        printf("收到SIGHUP，重新加载%s和%s\n", resolveFile, serverFile);
+        reloadZones();
+    }
+    return NULL;
+}
+
+//把所有事件循环的指标加到total里，写的线程同时在写，每个值单独读，所以各个计数之间可能差一两个请求
+void sumLatencyHistogram(struct LatencyHistogram* total, struct LatencyHistogram* h) {
+    int i;
+    for (i = 0; i < METRICS_BUCKETS; i++)
+        total->buckets[i] += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+    total->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    total->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+}
+
+void sumMetrics(struct Metrics* total, unsigned long* droppedLogs) {
+    struct Metrics* m;
+    int i, j, k, count;
+
+    memset(total, 0, sizeof(struct Metrics));
+    *droppedLogs = 0;
+    pthread_mutex_lock(&eventLoopsLock);
+    count = eventLoopCount;
+    pthread_mutex_unlock(&eventLoopsLock);
+    for (k = 0; k < count; k++) {
+        m = eventLoops[k]->metrics;
+        for (i = 0; i < METRICS_STAGES; i++)
+            sumLatencyHistogram(&total->stages[i], &m->stages[i]);
+        for (i = 0; i < METRICS_QTYPES; i++) {
+            for (j = 0; j < METRICS_RCODES; j++) {
+                sumLatencyHistogram(&total->requests[i][j], &m->requests[i][j]);
+                total->answerCacheHits[i][j] += __atomic_load_n(&m->answerCacheHits[i][j], __ATOMIC_RELAXED);
+            }
+        }
+        total->upstreamTimeouts += __atomic_load_n(&m->upstreamTimeouts, __ATOMIC_RELAXED);
+        total->malformedRequests += __atomic_load_n(&m->malformedRequests, __ATOMIC_RELAXED);
+        total->coalescedQueries += __atomic_load_n(&m->coalescedQueries, __ATOMIC_RELAXED);
+        total->cacheHits += __atomic_load_n(&m->cacheHits, __ATOMIC_RELAXED);
+        total->cacheMisses += __atomic_load_n(&m->cacheMisses, __ATOMIC_RELAXED);
+        total->prefetchesStarted += __atomic_load_n(&m->prefetchesStarted, __ATOMIC_RELAXED);
+        total->prefetchesRefreshed += __atomic_load_n(&m->prefetchesRefreshed, __ATOMIC_RELAXED);
+        total->prefetchHits += __atomic_load_n(&m->prefetchHits, __ATOMIC_RELAXED);
+        if (eventLoops[k]->queryLog)
+            *droppedLogs += __atomic_load_n(&eventLoops[k]->queryLog->dropped, __ATOMIC_RELAXED);
+    }
+}
+
+//直方图里第quantile分位的值，取所在桶的上界，单位秒
+double latencyQuantile(struct LatencyHistogram* h, double quantile) {
+    unsigned long rank, seen = 0;
+    int i;
+
+    if (h->count == 0)
+        return 0;
+    rank = (unsigned long)(quantile * h->count);
+    if (rank >= h->count)
+        rank = h->count - 1;
+    for (i = 0; i < METRICS_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank)
+            return latencyBucketUpper(i) / 1e9;
+    }
+    return latencyBucketUpper(METRICS_BUCKETS - 1) / 1e9;
+}
+
+//按Prometheus的histogram格式写一个序列，le取2^10到2^35纳秒（约1微秒到34秒），正好落在细桶的边界上
+//labels是{}里面的部分
+void writeLatencyHistogram(FILE* out, const char* metric, const char* labels, struct LatencyHistogram* h) {
+    unsigned long cumulative = 0;
+    unsigned long bound;
+    int i, b = 0;
+
+    for (i = 10; i <= 35; i++) {
+        bound = 1UL << i;
+        while (b < METRICS_BUCKETS && latencyBucketUpper(b) <= bound)
+            cumulative += h->buckets[b++];
+        fprintf(out, "%s_bucket{%s,le=\"%.12g\"} %lu\n", metric, labels, bound / 1e9, cumulative);
+    }
+    fprintf(out, "%s_bucket{%s,le=\"+Inf\"} %lu\n", metric, labels, h->count);
+    fprintf(out, "%s_sum{%s} %.9f\n", metric, labels, h->sum / 1e9);
+    fprintf(out, "%s_count{%s} %lu\n", metric, labels, h->count);
+}
+
+//服务器自己从细桶里算出来的分位数，比Prometheus从粗的le算出来的准，单独作为一个gauge输出
+void writeLatencyQuantiles(FILE* out, const char* metric, const char* labels, struct LatencyHistogram* h) {
+    double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    int i;
+    for (i = 0; i < 4; i++)
+        fprintf(out, "%s{%s,quantile=\"%g\"} %.9g\n", metric, labels, quantiles[i], latencyQuantile(h, quantiles[i]));
+}
+
+void writeMetrics(FILE* out, struct Metrics* m, unsigned long droppedLogs) {
+    const char* stages[] = { "parse", "zone", "delegation", "cache", "upstream", "encode", "send" };
+    //和metricsQtypeOf、metricsRcodeOf的下标一一对应
+    const char* qtypes[] = { "A", "NS", "CNAME", "PTR", "MX", "other" };
+    const char* rcodes[] = { "NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED", "other" };
+    char labels[128];
+    int i, j;
+
+    fprintf(out, "# HELP dns_stage_duration_seconds 请求处理各阶段的耗时\n");
+    fprintf(out, "# TYPE dns_stage_duration_seconds histogram\n");
+    for (i = 0; i < METRICS_STAGES; i++) {
+        sprintf(labels, "stage=\"%s\"", stages[i]);
+        writeLatencyHistogram(out, "dns_stage_duration_seconds", labels, &m->stages[i]);
+    }
+    fprintf(out, "# HELP dns_stage_duration_quantile_seconds 各阶段耗时的分位数\n");
+    fprintf(out, "# TYPE dns_stage_duration_quantile_seconds gauge\n");
+    for (i = 0; i < METRICS_STAGES; i++) {
+        sprintf(labels, "stage=\"%s\"", stages[i]);
+        writeLatencyQuantiles(out, "dns_stage_duration_quantile_seconds", labels, &m->stages[i]);
+    }
+    //只输出出现过的qtype和rcode组合
+    fprintf(out, "# HELP dns_request_duration_seconds 从收到请求到回复发出的耗时，不含回复缓存直接回复的请求\n");
+    fprintf(out, "# TYPE dns_request_duration_seconds histogram\n");
+    for (i = 0; i < METRICS_QTYPES; i++) {
+        for (j = 0; j < METRICS_RCODES; j++) {
+            if (m->requests[i][j].count == 0)
+                continue;
+            sprintf(labels, "qtype=\"%s\",rcode=\"%s\"", qtypes[i], rcodes[j]);
+            writeLatencyHistogram(out, "dns_request_duration_seconds", labels, &m->requests[i][j]);
+        }
+    }
+    fprintf(out, "# HELP dns_request_duration_quantile_seconds 请求耗时的分位数\n");
+    fprintf(out, "# TYPE dns_request_duration_quantile_seconds gauge\n");
+    for (i = 0; i < METRICS_QTYPES; i++) {
+        for (j = 0; j < METRICS_RCODES; j++) {
+            if (m->requests[i][j].count == 0)
+                continue;
+            sprintf(labels, "qtype=\"%s\",rcode=\"%s\"", qtypes[i], rcodes[j]);
+            writeLatencyQuantiles(out, "dns_request_duration_quantile_seconds", labels, &m->requests[i][j]);
+        }
+    }
+    fprintf(out, "# HELP dns_answer_cache_responses_total 直接从回复缓存回复的请求数\n");
+    fprintf(out, "# TYPE dns_answer_cache_responses_total counter\n");
+    for (i = 0; i < METRICS_QTYPES; i++) {
+        for (j = 0; j < METRICS_RCODES; j++) {
+            if (m->answerCacheHits[i][j] == 0)
+                continue;
+            fprintf(out, "dns_answer_cache_responses_total{qtype=\"%s\",rcode=\"%s\"} %lu\n", qtypes[i], rcodes[j], m->answerCacheHits[i][j]);
+        }
+    }
+    fprintf(out, "# HELP dns_upstream_timeouts_total 向上游的请求超时的次数\n");
+    fprintf(out, "# TYPE dns_upstream_timeouts_total counter\n");
+    fprintf(out, "dns_upstream_timeouts_total %lu\n", m->upstreamTimeouts);
+    fprintf(out, "# HELP dns_coalesced_queries_total 同一个问题别的解析正在问上游，跟着它而没有自己去问的次数\n");
+    fprintf(out, "# TYPE dns_coalesced_queries_total counter\n");
+    fprintf(out, "dns_coalesced_queries_total %lu\n", m->coalescedQueries);
+    fprintf(out, "# HELP dns_cache_hits_total 在缓存里找到了的查找次数\n");
+    fprintf(out, "# TYPE dns_cache_hits_total counter\n");
+    fprintf(out, "dns_cache_hits_total %lu\n", m->cacheHits);
+    fprintf(out, "# HELP dns_cache_misses_total 缓存里没有或者已经过期的查找次数\n");
+    fprintf(out, "# TYPE dns_cache_misses_total counter\n");
+    fprintf(out, "dns_cache_misses_total %lu\n", m->cacheMisses);
+    fprintf(out, "# HELP dns_prefetch_started_total 为快过期的常用缓存记录发起的预取次数\n");
+    fprintf(out, "# TYPE dns_prefetch_started_total counter\n");
+    fprintf(out, "dns_prefetch_started_total %lu\n", m->prefetchesStarted);
+    fprintf(out, "# HELP dns_prefetch_refreshed_total 问到了结果、刷新了缓存的预取次数\n");
+    fprintf(out, "# TYPE dns_prefetch_refreshed_total counter\n");
+    fprintf(out, "dns_prefetch_refreshed_total %lu\n", m->prefetchesRefreshed);
+    fprintf(out, "# HELP dns_prefetch_hits_total 由预取放进缓存的记录回答的命中次数，除以dns_cache_hits_total就是预取命中率\n");
+    fprintf(out, "# TYPE dns_prefetch_hits_total counter\n");
+    fprintf(out, "dns_prefetch_hits_total %lu\n", m->prefetchHits);
+    fprintf(out, "# HELP dns_malformed_requests_total 格式错误或者超长被丢掉的请求数\n");
+    fprintf(out, "# TYPE dns_malformed_requests_total counter\n");
+    fprintf(out, "dns_malformed_requests_total %lu\n", m->malformedRequests);
+    fprintf(out, "# HELP dns_query_log_dropped_total 查询日志跟不上丢掉的记录数\n");
+    fprintf(out, "# TYPE dns_query_log_dropped_total counter\n");
+    fprintf(out, "dns_query_log_dropped_total %lu\n", droppedLogs);
+}
 
-    line2Save = malloc(sizeof(unsigned char)*BUF_SIZE);
-    memset(line2Save, 0, sizeof(unsigned char)*BUF_SIZE);
+//指标线程：在绑定IP的metricsPort端口上提供一个最简单的HTTP服务，/trace?id=返回解析轨迹，其他路径都返回全部指标
+//一次只处理一个连接，读完请求头写完回复就关闭，和服务线程没有任何共享的锁
+void* metricsThread(void* arg) {
+    int listenFd = (int)(long)arg;
+    struct Metrics* total = malloc(sizeof(struct Metrics));
+    struct timeval timeout = { 1, 0 };
+    unsigned long droppedLogs;
+    char request[1024];
+    char header[128];
+    char* body;
+    size_t bodyLen;
+    FILE* out;
+    int fd, n, status;
 
-    line2Search = malloc(sizeof(unsigned char)*BUF_SIZE);
-    memset(line2Search, 0, sizeof(unsigned char)*BUF_SIZE);
+    while (1) {
+        fd = accept(listenFd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        n = recv(fd, request, sizeof(request) - 1, 0);
+        request[n > 0 ? n : 0] = '\0';
+        out = open_memstream(&body, &bodyLen);
+        //GET /trace?id=<请求ID>返回最近这个ID的解析轨迹，ID可以是十进制或者0x开头的十六进制
+        if (strncmp(request, "GET /trace?id=", 14) == 0) {
+            status = writeRecentTraces(out, strtol(request + 14, NULL, 0)) > 0 ? 200 : 404;
+            fclose(out);
+            sprintf(header, "HTTP/1.0 %s\r\nContent-Type: application/x-ndjson\r\nContent-Length: %lu\r\n\r\n",
+                    status == 200 ? "200 OK" : "404 Not Found", (unsigned long)bodyLen);
+        }
+        else {
+            sumMetrics(total, &droppedLogs);
+            writeMetrics(out, total, droppedLogs);
+            fclose(out);
+            sprintf(header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\n\r\n", (unsigned long)bodyLen);
+        }
+        send(fd, header, strlen(header), MSG_NOSIGNAL);
+        send(fd, body, bodyLen, MSG_NOSIGNAL);
+        free(body);
+        close(fd);
+    }
+    return NULL;
+}
 
-    while(rr) {
-        if ((strcmp(getDomainNameStr(rr->name), getDomainNameStr(query_domain))==0 && queryType==rr->type) || forceSave == 1) {
-            hasTask = 1;
-            switch (rr->type) {
-                case A_Resource_RecordType:
-                    type = "A";
-                    break;
-                case NS_Resource_RecordType:
-                    type = "NS";
-                    break;
-                case CNAME_Resource_RecordType:
-                    type = "CNAME";
-                    break;
-                case PTR_Resource_RecordType:
-                    type = "PTR";
-                    break;
-                case MX_Resource_RecordType:
-                    type = "MX";
-                    break;
-                default:
-                    type = "A";
-            }
-            switch (rr->class) {
-                case IN_Class:
-                    class = "IN";
-                    break;
-                case CH_Class:
-                    class = "CH";
-                    break;
-                case HS_Class:
-                    class = "HS";
-                    break;
-                default:
-                    class = "IN";
-            }
+//绑定指标端口，失败返回-1
+int openMetricsSocket() {
+    struct sockaddr_in addr;
+    int fd, on = 1;
 
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(metricsPort);
+    addr.sin_addr.s_addr = inet_addr(myIpAddr);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-            rrResult = malloc(sizeof(unsigned char)*BUF_SIZE);
-            memset(rrResult, 0, sizeof(unsigned char)*BUF_SIZE);
+//服务线程，参数是这个线程自己的socket：local服务器是TCP监听socket，普通服务器是接收请求的UDP socket
+//一个epoll同时管理客户端的请求和向上游发出的请求，解析不会因为等上游而阻塞，一个线程可以同时推进很多个解析
+//每个线程的事件循环、连接、解析都是自己的，线程之间共享的只有只读的区域索引、授权trie，以及带锁的缓存
+void* eventLoopThread(void* arg) {
+    struct EventLoop* loop;
+    struct EventHandle* handle;
+    struct epoll_event ev;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    struct TcpConnection* conn;
+    struct TcpConnection* nextConn;
+    long now, lastSweep;
+    int sock = (int)(long)arg;
+    int n, i, timeout;
+
+    randSeed = secureRandom();
+    loop = malloc(sizeof(struct EventLoop));
+    memset(loop, 0, sizeof(struct EventLoop));
+    loop->server.type = isLocal ? EVENT_LISTEN : EVENT_SERVER;
+    loop->server.fd = sock;
+    loop->answerGeneration = zoneGeneration;
+    setNonBlocking(sock);
+    if (!isLocal)
+        initUdpBatch(&loop->udp, udpBatchSize);
+    //普通服务器只回答区域索引和授权trie里的数据，回复不会变，可以把编好的回复缓存起来
+    if (!isLocal && !isRecursive) {
+        loop->answerCache = malloc(sizeof(struct AnswerCacheEntry*) * ANSWER_CACHE_SLOTS);
+        memset(loop->answerCache, 0, sizeof(struct AnswerCacheEntry*) * ANSWER_CACHE_SLOTS);
+    }
+    if (queryLogLevel >= 1) {
+        loop->queryLog = malloc(sizeof(struct QueryLogRing));
+        memset(loop->queryLog, 0, sizeof(struct QueryLogRing));
+    }
+    if (traceFile != NULL && (isLocal || isRecursive)) {
+        loop->traces = malloc(sizeof(struct TraceRing));
+        memset(loop->traces, 0, sizeof(struct TraceRing));
+    }
+    if (metricsPort > 0) {
+        loop->metrics = malloc(sizeof(struct Metrics));
+        memset(loop->metrics, 0, sizeof(struct Metrics));
+        threadMetrics = loop->metrics;
+    }
+    loop->epfd = epoll_create1(0);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop->server;
+    epoll_ctl(loop->epfd, EPOLL_CTL_ADD, sock, &ev);
+    //只有local服务器和支持递归的服务器需要向上游发请求
+    for (i = 0; i < UPSTREAM_SOCKETS; i++) {
+        loop->upstreamSockets[i].type = EVENT_UPSTREAM;
+        loop->upstreamSockets[i].fd = (isLocal || isRecursive) ? openUpstreamSocket() : -1;
+        if (loop->upstreamSockets[i].fd < 0)
+            continue;
+        ev.data.ptr = &loop->upstreamSockets[i];
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->upstreamSockets[i].fd, &ev);
+    }
+    lastSweep = monotonicSeconds();
+    pthread_mutex_lock(&eventLoopsLock);
+    eventLoops[eventLoopCount++] = loop;
+    pthread_mutex_unlock(&eventLoopsLock);
 
-            switch (rr->type) {
-                case A_Resource_RecordType:
-                    sprintf(rrResult,"%u.%u.%u.%u",
-                            rr->rd_data.a_record.addr[0],
-                            rr->rd_data.a_record.addr[1],
-                            rr->rd_data.a_record.addr[2],
-                            rr->rd_data.a_record.addr[3]
-                            );
+    while (1) {
+        timeout = expireUpstreamQueries(loop);
+        //上一轮事件里问完的领头解析，跟随它们的解析在这里接着推进；查缓存时排上的预取也在这里开始问
+        //推进的时候可能又发了新的上游请求，所以要重新算超时
+        while (loop->readyFollowers != NULL || loop->pendingPrefetches != NULL) {
+            runReadyFollowers(loop);
+            startPrefetches(loop);
+            timeout = expireUpstreamQueries(loop);
+        }
+        if (timeout < 0 || timeout > 1000)
+            timeout = 1000;
+        //等上游回复或者超时之后才解析完的请求，回复也在发送队列里，睡下去之前一起发出去
+        if (loop->udp.sendCount > 0)
+            flushUdpReplies(loop);
+        __atomic_add_fetch(&loop->epoch, 1, __ATOMIC_SEQ_CST);
+        n = epoll_wait(loop->epfd, events, EPOLL_MAX_EVENTS, timeout);
+        __atomic_add_fetch(&loop->epoch, 1, __ATOMIC_SEQ_CST);
+        for (i = 0; i < n; i++) {
+            handle = events[i].data.ptr;
+            switch (handle->type) {
+                case EVENT_LISTEN:
+                    acceptTcpConnections(loop);
                     break;
-                case CNAME_Resource_RecordType:
-                    sprintf(rrResult,"%s", getDomainNameStr(domainBytes2DomainStructureFromStr(rr->rd_data.cname_record.name)));
+                case EVENT_SERVER:
+                    receiveUdpRequests(loop);
                     break;
-                case MX_Resource_RecordType:
-                    sprintf(rrResult,"%s,%u", getDomainNameStr(domainBytes2DomainStructureFromStr(rr->rd_data.mx_record.exchange)),rr->rd_data.mx_record.preference);
+                case EVENT_CLIENT:
+                    serviceTcpConnection(loop, handle->owner, events[i].events);
                     break;
-                default:
-                    printf("Unknown Resource Record");
-            }
-
-            sprintf(line2Save,"%s\t%s\t%s\t%s\t%d\n",type,class, getDomainNameStr(rr->name),rrResult,rr->ttl);
-            sprintf(line2Search,"%s\t%s\t%s",type,class, getDomainNameStr(rr->name));
-
-            while(fgets(buf,bufSize,fd)>0) {
-                unsigned char* origBufPos = buf;
-                if (strlen(buf)<5) {//如果buf太小，则此行无效，跳过。5这个数随便写的
-                    memset(buf, 0, sizeof(unsigned char)*BUF_SIZE);
-                    continue;
-                }
-                if (strstr(buf,line2Search)!=0) {
-                    found = 1;
+                case EVENT_UPSTREAM:
+                    receiveUpstreamResponses(loop, handle);
                     break;
-                }
-                buf = origBufPos;
-                memset(buf, 0, sizeof(unsigned char)*BUF_SIZE);
             }
-            if (found == 0) {
-                fputs(line2Save,fd);
-            } else {
-                //此处应该考虑把旧的缓存删掉，把新的缓存写入进去
-                //但是C语言删改文件太麻烦了，还是算了= =
+        }
+
+        //关闭空闲的连接，还有请求在解析的连接不算空闲
+        now = monotonicSeconds();
+        if (now != lastSweep) {
+            lastSweep = now;
+            for (conn = loop->connections; conn; conn = nextConn) {
+                nextConn = conn->next;
+                if (conn->pending == 0 && now - conn->lastActive >= TCP_IDLE_TIMEOUT)
+                    closeTcpConnection(loop, conn);
             }
         }
-        rewind(fd);//回到文件的开头
-        rr = rr->next;
+        freeClosedConnections(loop);
     }
-    fclose(fd);
-    return hasTask;
+    return NULL;
 }
 
-//用于生成找到的最佳匹配的链表
-//finalDomainName是查找最佳匹配时匹配失败的那一段，因此我们应该复制这一段之前的所有段
-//这个函数的使用场景是，finalDomainName是targetDomainName这个链表中的一项，因此当next为finalDomainName时停止复制。
-//当finalDomainName是NULL时，这个函数可以用来完全复制一个DomainName链表
-struct DomainName* getBestMatchDomainName(struct DomainName* targetDomainName, struct DomainName* finalDomainName) {
-    struct DomainName* readFromTarget = targetDomainName;
-    struct DomainName* name;
-    struct DomainName* head; //因为在代码运行过程中name不断被name->next替代，所以需要一个变量记录head的地址
-    unsigned char* name_str;
-
-    int first = 1;
-    name = malloc(sizeof(struct DomainName));
-    memset(name, 0, sizeof(struct DomainName));
-    head = name;
-    while (readFromTarget->next != finalDomainName) {
-        if (!first) {
-            name->next = malloc(sizeof(struct DomainName));
-            memset(name->next, 0, sizeof(struct DomainName));
-            name = name->next;
-            readFromTarget = readFromTarget->next;
-        }
-        name_str = malloc(sizeof(unsigned char)*(readFromTarget->len+1));//+1是为了字符串最后的\0
-        memset(name_str, 0, sizeof(unsigned char)*(readFromTarget->len+1));
-        memcpy(name_str, readFromTarget->name, readFromTarget->len);
-        name_str[readFromTarget->len] = '\0';
-        name->name = name_str;
-        name->len = readFromTarget->len;
-        if (first && readFromTarget == finalDomainName)
-            break;
-        first = 0;
-    }
-    name->next = NULL;
-    return head;
-}
+#ifdef CODEC_BENCH
+//编解码和区域查找的微基准，只在用-DCODEC_BENCH编译时才有，正常编译的服务器里没有这些代码
+//  gcc -O2 -DCODEC_BENCH server.c -o codecbench -lpthread && ./codecbench [记录数 ...]
+//每一项从1次开始翻倍，直到一轮跑满0.3秒，报告最后一轮的每次耗时和每次malloc的次数
+//malloc次数用glibc的__libc_*包一层来数，free还是glibc自己的
 
-//将msg中的question加入全局变量taskList中
-void putQuestionsInMsgToTaskList(struct Message* msg) {
-    int count = 0;
-    struct Question* q;
-    struct Question* pq;
-    q = msg->questions;
-    while (q) {
-        count++;
-        pq = malloc(sizeof(struct Question));
-        memset(pq, 0, sizeof(struct Question));
-        pq->name = getBestMatchDomainName(q->name, NULL);
-        pq->type = q->type;
-        pq->class = q->class;
-        pq->next = taskList;
-        taskList = pq;
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+unsigned long benchAllocs;
 
-        q = q->next;
-    }
+void* malloc(size_t size) {
+    benchAllocs++;
+    return __libc_malloc(size);
 }
 
-//以UDP协议将packet发送出去
-void sendQuery(struct Message* msg, unsigned char* remote_ip, struct DomainName* query_domain, int query_type) {
-    struct timeval start, end;
-    gettimeofday( &start, NULL );
-    uint8_t buffer[BUF_SIZE];
-    struct sockaddr_in dnsSvrAddr;
-    struct sockaddr_in cltAddr;
-    socklen_t addrLen = sizeof(struct sockaddr_in);
-    unsigned short dnsSvrPort = 53;
-    int sock;
-    uint8_t* pointerForLength;
-    int bufLen;
+void* calloc(size_t count, size_t size) {
+    benchAllocs++;
+    return __libc_calloc(count, size);
+}
 
-    memset(&dnsSvrAddr, 0, sizeof(dnsSvrAddr));/*Zero out structure*/
-    dnsSvrAddr.sin_family = AF_INET;
-    dnsSvrAddr.sin_addr.s_addr = inet_addr(remote_ip);
-    dnsSvrAddr.sin_port = htons(dnsSvrPort);
+void* realloc(void* ptr, size_t size) {
+    benchAllocs++;
+    return __libc_realloc(ptr, size);
+}
 
-    sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+long benchNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
 
-    //讲道理此时作为一个客户端是不需要bind的，但是如果不bind，发出去的包的ip地址会是127.0.0.1，就看不出来这个包是哪个服务器发的了，
-    //所以bind一下好看些
-    struct sockaddr_in cltBindAddr;
-    memset(&cltBindAddr,0,sizeof(cltBindAddr));
-    cltBindAddr.sin_family = AF_INET;
-    cltBindAddr.sin_addr.s_addr = inet_addr(myIpAddr);
-    bind(sock, (struct sockaddr *) &cltBindAddr, sizeof(cltBindAddr));
+//一个报文的基准：msg是构造好的回复，packet是它编出来的字节，解析用的就是这份字节
+struct CodecBench {
+    struct Arena arena;//msg的域名和记录
+    struct Arena scratch;//解析成Message时用的，每次操作后清空
+    struct Message msg;
+    uint8_t packet[BUF_SIZE];
+    int len;
+    struct MessageView view;
+};
 
-    memset(msg, 0, sizeof(struct Message));
-    memset(&buffer,0,sizeof(buffer));
+//区域查找的基准：targets里一半是索引里有的域名，一半是没有的
+#define ZONE_BENCH_TARGETS 4096
+struct ZoneBench {
+    struct ZoneIndex* zone;
+    struct DomainName* targets[ZONE_BENCH_TARGETS];
+    struct Arena arena;
+};
 
-    //准备header
-    msg->id = rand()%BUF_SIZE;
-    msg->qr = 0;//这是一条Query
-    msg->aa = 0;
-    if (isRecursive) {
-        msg->rd = 1; //期望递归
-        msg->ra = 1; //能够递归
-    }
-    else {
-        msg->rd = 0;
-        msg->ra = 0;
-    }
-    msg->rcode = 0;
+void runMicroBench(const char* name, void (*op)(void*, long), void* ctx) {
+    long iterations = 1, i, start, elapsed;
+    unsigned long allocs;
 
-    msg->qCount = 0;
-    msg->ansCount = 0;
-    msg->auCount = 0;
-    msg->adCount = 0;
+    while (1) {
+        allocs = benchAllocs;
+        start = benchNanos();
+        for (i = 0; i < iterations; i++)
+            op(ctx, i);
+        elapsed = benchNanos() - start;
+        allocs = benchAllocs - allocs;
+        if (elapsed >= 300000000L || iterations >= (1L << 30))
+            break;
+        iterations *= 2;
+    }
+    printf("%-40s %12.1f ns/op %10.2f allocs/op\n", name, (double)elapsed / iterations, (double)allocs / iterations);
+}
 
-    struct Question* q;
-    q = malloc(sizeof(struct Question));
-    memset(q, 0, sizeof(struct Question));
-    q->name = getBestMatchDomainName(query_domain, NULL);
-    q->type = query_type;
-    q->class = IN_Class;
-    q->next = msg->questions;
-    msg->questions = q;
+//服务器回复里的域名都来自区域索引或者缓存，已经驻留着，写报文时驻留只是找到它们
+//所以基准里的域名也驻留一份一直拿着不放，不然每次编码都要新建再释放
+struct DomainName* benchDomainName(struct Arena* arena, unsigned char* str) {
+    unsigned char* bytes = domainStr2DomainBytes(str);
+    struct DomainName* name = domainBytes2DomainStructureFromStr(arena, bytes);
+    struct NameKey key;
+    free(bytes);
+    if (nameKeyFromDomainName(name, &key) == 0)
+        internName(&key, 0);
+    return name;
+}
 
+void benchQuestion(struct Message* msg, unsigned char* name, unsigned short type) {
+    struct Question* questions = arenaAlloc(msg->arena, sizeof(struct Question) * (msg->qCount + 1));
+    if (msg->qCount > 0)
+        memcpy(questions, msg->questions, sizeof(struct Question) * msg->qCount);
+    questions[msg->qCount].name = benchDomainName(msg->arena, name);
+    questions[msg->qCount].type = type;
+    questions[msg->qCount].class = IN_Class;
+    msg->questions = questions;
     msg->qCount++;
+}
 
-    pointerForLength = buffer;
-    writeBuffer(msg, &pointerForLength);
-    bufLen = pointerForLength - buffer;
+//往msg的一个部分里加一条记录，A的data是点分的地址，CNAME的是域名，MX的是“域名,preference”
+void benchRecord(struct Message* msg, int section, unsigned char* name, unsigned short type, char* data) {
+    struct ResourceRecord* rr;
+    unsigned char exchange[256];
+    unsigned int ip[4];
+    int preference, i;
+
+    if (section == 1)
+        rr = addRecord(msg, &msg->answers, &msg->ansCount, &msg->ansCap);
+    else if (section == 2)
+        rr = addRecord(msg, &msg->authorities, &msg->auCount, &msg->auCap);
+    else
+        rr = addRecord(msg, &msg->additionals, &msg->adCount, &msg->adCap);
+    rr->name = benchDomainName(msg->arena, name);
+    rr->type = type;
+    rr->class = IN_Class;
+    rr->ttl = 86400;
+    if (type == CNAME_Resource_RecordType) {
+        benchDomainName(msg->arena, data);
+        rr->rd_data.cname_record.name = domainStr2DomainBytes(data);
+        rr->rd_length = strlen(rr->rd_data.cname_record.name) + 1;
+    } else if (type == MX_Resource_RecordType) {
+        sscanf(data, "%255[^,],%d", exchange, &preference);
+        benchDomainName(msg->arena, exchange);
+        rr->rd_data.mx_record.preference = preference;
+        rr->rd_data.mx_record.exchange = domainStr2DomainBytes(exchange);
+        rr->rd_length = strlen(rr->rd_data.mx_record.exchange) + 1 + 2;
+    } else {
+        sscanf(data, "%u.%u.%u.%u", &ip[0], &ip[1], &ip[2], &ip[3]);
+        for (i = 0; i < 4; i++)
+            rr->rd_data.a_record.addr[i] = ip[i];
+        rr->rd_length = 4;
+    }
+}
 
-    if ((sendto(sock, buffer, bufLen, 0, (struct sockaddr *) &dnsSvrAddr, sizeof(dnsSvrAddr)))!= bufLen)
-        printf("sendto() sent a different number of bytes than expected.\n");
+struct CodecBench* newCodecBench() {
+    struct CodecBench* bench = malloc(sizeof(struct CodecBench));
+    memset(bench, 0, sizeof(struct CodecBench));
+    bench->msg.arena = &bench->arena;
+    bench->msg.id = 0x1234;
+    bench->msg.qr = 1;
+    bench->msg.aa = 1;
+    return bench;
+}
 
-    freeQuestions(msg->questions);
-    freeResourceRecords(msg->answers);
-    freeResourceRecords(msg->authorities);
-    freeResourceRecords(msg->additionals);
+void encodeBenchOp(void* ctx, long i) {
+    struct CodecBench* bench = ctx;
+    uint8_t* p = bench->packet;
+    writeBuffer(&bench->msg, &p);
+    bench->len = p - bench->packet;
+}
 
-    memset(msg, 0, sizeof(struct Message));
-    memset(buffer, 0, sizeof(buffer));
-    recvfrom(sock, buffer, sizeof(buffer), 0, (struct sockaddr *) &cltAddr, &addrLen);
-    readBuffer(msg, buffer);
-    printf("\n\nResponse from %s:\n",remote_ip);
-    printMessage(msg);
-    gettimeofday(&end, NULL );
-    int timeuse = 1000000 * ( end.tv_sec - start.tv_sec ) + end.tv_usec - start.tv_usec;
-    printf("time: %d us\n", timeuse);
-    close(sock);
+void viewBenchOp(void* ctx, long i) {
+    struct CodecBench* bench = ctx;
+    readMessageView(&bench->view, bench->packet, bench->len);
 }
 
-//删掉当前任务，将下一个任务提到当前来
-//因为这几行代码用的次数很多所以单独提出来当一个函数了
-void moveTaskList2Next() {
-    struct Question* next;
-    next = taskList->next;
-    freeDomainName(taskList->name);
-    free(taskList);
-    taskList = next;
+//和服务器收到请求时一样：读成视图，question复制进arena；记录读到栈上
+void decodeBenchOp(void* ctx, long i) {
+    struct CodecBench* bench = ctx;
+    struct DomainName nodes[MAX_LABELS];
+    struct ResourceRecord rr;
+    unsigned char rdBuf[256];
+    int k;
+
+    readMessageView(&bench->view, bench->packet, bench->len);
+    viewQuestions2Questions(&bench->view, &bench->scratch);
+    for (k = 0; k < bench->view.recordCount; k++)
+        viewRecord2ResourceRecord(&bench->view, k, &rr, nodes, rdBuf);
+    resetArena(&bench->scratch);
 }
 
-//先在serverFile中查找最佳匹配的权威服务器，如果找到了，那么进入while循环，此时应该不断向已知IP请求解析，然后得到新的权威服务器IP，
-//再向新IP请求解析，循环直到得到请求的域名的解析为止。
-//注意每次请求的域名都是一模一样的，比如你请求的是北邮.教育.中国的MX，那么你问根、中国、教育的时候，question section里的内容永远都是北邮.教育.中国的MX。
-//如果没找到但是服务器是local server，那么就从"根.网络"开始请求
-//如果没找到服务器也不是local server，此题无解，删除跳过
-void queryAsAClient(struct DomainName* query_domain, struct ResourceRecord* rr) {
-    int rc, origType, hasResult;
-    unsigned char* addr;
-    unsigned char* ipStr;
-    struct Message* msg;
-
-    origType = rr->type;
-    rr->type = A_Resource_RecordType;
-    rc = getRecordFromFile(rr, query_domain, serverFile);//check serverFileName
-    if (isLocal && rc <0) {
-        query_domain = domainBytes2DomainStructureFromStr(domainStr2DomainBytes("根.网络"));
-        rc = getRecordFromFile(rr, query_domain, serverFile);
-    }
-    rr->type = origType;
-    if (rc > 0) {
-        addr = rr->rd_data.a_record.addr;
-        while (1) {
-            ipStr = malloc(sizeof(unsigned char)*16);
-            memset(ipStr,0,sizeof(unsigned char)*16);
-            sprintf(ipStr,"%u.%u.%u.%u",addr[0],addr[1],addr[2],addr[3]);
-            msg = malloc(sizeof(struct Message));
-            memset(msg,0,sizeof(struct Message));
-            sendQuery(msg, ipStr, taskList->name, rr->type);
-            hasResult = 0;
-            hasResult+= saveRecord2File(msg->answers, taskList->name, cacheFile, rr->type, 0);
-            hasResult+= saveRecord2File(msg->additionals, taskList->name, cacheFile, rr->type, 1);
-            //saveRecord2File(msg->authorities, taskList->qName, serverFileName, rr->type, 1); //权威服务器不可缓存
-            //save_record_to_file的if里有判定条件，只有rr与所请求的完全匹配的情况下才存入文件，除非force save是1
-            if (hasResult>0)
-                break;
-                //saveRecord2File函数的返回结果是这些section中是否包含原始请求的解析结果，如果包含解析结果，那么直接break此函数，
-                //程序会回到main函数中的taskList那个循环，从头开始重新解析，也就是重新从文件中找解析结果，此时因为结果已经存入文件，
-                //所以可以成功解析，解析过程结束。
-            else {
-                if(msg->auCount>0) {
-                    if(msg->authorities->type == A_Resource_RecordType) {
-                        addr = msg->authorities->rd_data.a_record.addr;
-                        continue;
-                    }
-                    else {
-                        //原则上讲authority section的内容应该是一个NS，然后在additional section存着这个NS的A解析，不过作业要求里没有NS解析
-                    }
-                }
-                moveTaskList2Next();
-                msg->rcode = Refused_ResponseType;//没有authority section，解析失败，修改return code，这热Refused是瞎设的因为我也不知道该设啥
-                return;
-            }
-        }
-    }
-    else {
-        moveTaskList2Next();//没有在serverFile内找到最佳匹配的权威服务器，此题无解，删除跳过。
-        return;
-    }
+void zoneBenchOp(void* ctx, long i) {
+    struct ZoneBench* bench = ctx;
+    struct ResourceRecord rr;
+
+    memset(&rr, 0, sizeof(rr));
+    rr.type = A_Resource_RecordType;
+    rr.class = IN_Class;
+    getRecordFromZone(&rr, bench->targets[i & (ZONE_BENCH_TARGETS - 1)], bench->zone, &bench->arena);
+    resetArena(&bench->arena);
 }
 
-//解析过程函数
-//逻辑是先从resolveFile文件和cacheFile文件中查找完全匹配，如果找到了，将此任务移出taskList，将rr放入answer section，
-//如果请求类型是MX那还得再找一遍它的A解析加入additional section
-//如果没找到完全匹配，那么从serverFile中查找最佳匹配，也就是调用一遍自己checkNameServer设为1，
-//如果找到了，将此任务移出taskList，将rr放入authority section
-//如果没找到，就不管了，直接从taskList移除。
-void resolveTask(struct Message* msg, int checkNameServer) {
-    int rc;
-    struct ResourceRecord* rr;
-    rr = malloc(sizeof(struct ResourceRecord));
-    memset(rr, 0, sizeof(struct ResourceRecord));
-    rr->name = getBestMatchDomainName(taskList->name, NULL);
-    rr->type = taskList->type;
-    rr->class = taskList->class;
-    switch (rr->type)
-    {
-        case A_Resource_RecordType:
-        case CNAME_Resource_RecordType:
-        case MX_Resource_RecordType:
-            if(!checkNameServer) {
-                
-                rc = getRecordFromFile(rr, rr->name, resolveFile);
-                if (rc != 2) {
-                    free(rr->name);
-                    free(rr);
-                    rr = malloc(sizeof(struct ResourceRecord));
-                    memset(rr, 0, sizeof(struct ResourceRecord));
-                    rr->name = getBestMatchDomainName(taskList->name, NULL);
-                    rr->type = taskList->type;
-                    rr->class = taskList->class;
-                    rc = getRecordFromFile(rr, rr->name, cacheFile);
-                }
-            }
-            else
-                rc = getRecordFromFile(rr, rr->name, serverFile);
-            break;
+void runCodecBenches() {
+    struct CodecBench* benches[4];
+    const char* names[4] = { "单个A", "MX带附加记录", "多个question", "压缩域名（引荐）" };
+    unsigned char line[128];
+    int i;
 
-        default:
-            msg->rcode = NotImplemented_ResponseType;
-            printf("Cannot answer question of type %d.\n", rr->type);
-            rc=-1;
+    for (i = 0; i < 4; i++)
+        benches[i] = newCodecBench();
+
+    benchQuestion(&benches[0]->msg, "www.example.教育.中国", A_Resource_RecordType);
+    benchRecord(&benches[0]->msg, 1, "www.example.教育.中国", A_Resource_RecordType, "9.9.9.9");
+
+    benchQuestion(&benches[1]->msg, "北邮.教育.中国", MX_Resource_RecordType);
+    benchRecord(&benches[1]->msg, 1, "北邮.教育.中国", MX_Resource_RecordType, "邮件.北邮.教育.中国,5");
+    benchRecord(&benches[1]->msg, 3, "邮件.北邮.教育.中国", A_Resource_RecordType, "1.2.3.4");
+
+    benchQuestion(&benches[2]->msg, "主页.北邮.教育.中国", A_Resource_RecordType);
+    benchQuestion(&benches[2]->msg, "北邮.教育.中国", MX_Resource_RecordType);
+    benchQuestion(&benches[2]->msg, "网站.北邮.教育.中国", CNAME_Resource_RecordType);
+    benchQuestion(&benches[2]->msg, "视窗.微软.商业", A_Resource_RecordType);
+    benchRecord(&benches[2]->msg, 1, "主页.北邮.教育.中国", A_Resource_RecordType, "5.6.7.8");
+    benchRecord(&benches[2]->msg, 1, "北邮.教育.中国", MX_Resource_RecordType, "邮件.北邮.教育.中国,5");
+    benchRecord(&benches[2]->msg, 1, "网站.北邮.教育.中国", CNAME_Resource_RecordType, "主页.北邮.教育.中国");
+    benchRecord(&benches[2]->msg, 1, "视窗.微软.商业", A_Resource_RecordType, "7.7.7.7");
+    benchRecord(&benches[2]->msg, 3, "邮件.北邮.教育.中国", A_Resource_RecordType, "1.2.3.4");
+
+    benchQuestion(&benches[3]->msg, "主页.计算机学院.北邮.教育.中国", A_Resource_RecordType);
+    benchRecord(&benches[3]->msg, 1, "主页.计算机学院.北邮.教育.中国", CNAME_Resource_RecordType, "网站.计算机学院.北邮.教育.中国");
+    for (i = 0; i < 4; i++) {
+        sprintf(line, "10.0.0.%d", i + 1);
+        benchRecord(&benches[3]->msg, 2, "计算机学院.北邮.教育.中国", A_Resource_RecordType, line);
+    }
+    for (i = 0; i < 4; i++) {
+        sprintf(line, "服务器%d.计算机学院.北邮.教育.中国", i + 1);
+        benchRecord(&benches[3]->msg, 3, line, A_Resource_RecordType, "10.0.1.1");
     }
 
-    if( !checkNameServer ) {
-        if ( rc==2 ) {
-            struct Question* next;
-            next = taskList->next;
-            freeDomainName(taskList->name);
-            free(taskList);
-            taskList = next;
-
-            msg->ansCount++;
-            rr->next = msg->answers;
-            msg->answers = rr;
-
-            if (rr->type == MX_Resource_RecordType) {
-                struct ResourceRecord* rr_mx;
-                rr_mx = malloc(sizeof(struct ResourceRecord));
-                memset(rr_mx, 0, sizeof(struct ResourceRecord));
-                rr_mx->name = getBestMatchDomainName(domainBytes2DomainStructureFromStr(rr->rd_data.mx_record.exchange), NULL);
-                rr_mx->type = A_Resource_RecordType;
-                rr_mx->class = rr->class;
-                rc = getRecordFromFile(rr_mx, rr_mx->name, resolveFile);
-                if (rc != 2) {
-                    free(rr_mx->name);
-                    free(rr_mx);
-                    rr_mx = malloc(sizeof(struct ResourceRecord));
-                    memset(rr_mx, 0, sizeof(struct ResourceRecord));
-                    rr_mx->name = getBestMatchDomainName(domainBytes2DomainStructureFromStr(rr->rd_data.mx_record.exchange), NULL);
-                    rr_mx->type = A_Resource_RecordType;
-                    rr_mx->class = rr->class;
-                    rc = getRecordFromFile(rr_mx, rr_mx->name, cacheFile);
-                }
-                if ( rc > 0 ) {
-                    msg->adCount++;
-                    rr_mx->next = msg->additionals;
-                    msg->additionals = rr_mx;
-                } else {
-                    free(rr_mx->name);
-                    free(rr_mx);
-                }
-            }
-        }
-        else {
-            taskList->type = A_Resource_RecordType;
-            resolveTask(msg, 1);
-        }
-    } else {
-        if ( rc<0 ) {
-            free(rr->name);
-            free(rr);
-            struct Question* next;
-            next = taskList->next;
-            freeDomainName(taskList->name);
-            free(taskList);
-            taskList = next;
-        } else {
-            struct Question* next;
-            next = taskList->next;
-            freeDomainName(taskList->name);
-            free(taskList);
-            taskList = next;
-            msg->auCount++;
-            rr->next = msg->authorities;
-            msg->authorities = rr;
-        }
+    for (i = 0; i < 4; i++) {
+        encodeBenchOp(benches[i], 0);
+        sprintf(line, "编码 %s（%d字节）", names[i], benches[i]->len);
+        runMicroBench(line, encodeBenchOp, benches[i]);
+    }
+    for (i = 0; i < 4; i++) {
+        sprintf(line, "解析成视图 %s", names[i]);
+        runMicroBench(line, viewBenchOp, benches[i]);
+    }
+    for (i = 0; i < 4; i++) {
+        sprintf(line, "解析成Message %s", names[i]);
+        runMicroBench(line, decodeBenchOp, benches[i]);
     }
 }
 
-//local server的解析函数过程
-//逻辑是先从resolveFile和cacheFile中找完全匹配，找到了就直接按照普通的resolveTask函数跑，所以直接调用了resolveTask函数
-//没找到就像客户端一样去向根服务器开始请求解析
-//注意getBestMatchDomainName函数在第二个参数是NULL时效果就是复制一遍这个链表
-void resolveTaskForLocalServer(struct Message* msg) {
-    int rc;
-    struct ResourceRecord* rr;
-    rr = malloc(sizeof(struct ResourceRecord));
-    memset(rr, 0, sizeof(struct ResourceRecord));
-    rr->name = getBestMatchDomainName(taskList->name, NULL);
-    rr->type = taskList->type;
-    rr->class = taskList->class;
-
-    switch (rr->type) {
-        case A_Resource_RecordType:
-        case CNAME_Resource_RecordType:
-        case MX_Resource_RecordType:
-            rc = getRecordFromFile(rr, rr->name, resolveFile);
-            if (rc!=2) {
-                free(rr->name);
-                free(rr);
-                rr = malloc(sizeof(struct ResourceRecord));
-                memset(rr, 0, sizeof(struct ResourceRecord));
-                rr->name = getBestMatchDomainName(taskList->name, NULL);
-                rr->type = taskList->type;
-                rr->class = taskList->class;
-                rc = getRecordFromFile(rr, rr->name, cacheFile);
-            }
-            break;
-
-        default:
-            free(rr->name);
-            free(rr);
-            msg->rcode = NotImplemented_ResponseType;
-            printf("无法解析类型：%d\n", rr->type);
-            struct Question* next;
-            next = taskList->next;
-            freeDomainName(taskList->name);
-            free(taskList);
-            taskList = next;
-            return;
+//建一个有count条A记录的区域，先测哈希索引，再编译成二进制区域文件测映射的镜像
+void runZoneBenches(long count) {
+    struct ZoneBench bench;
+    struct ResourceRecord rr;
+    unsigned char textName[64];
+    unsigned char imageName[64];
+    unsigned char name[64];
+    FILE* fd;
+    long i, start;
+
+    memset(&bench, 0, sizeof(bench));
+    sprintf(textName, "/tmp/codecbench%dresolve.txt", getpid());
+    sprintf(imageName, "/tmp/codecbench%dresolve.bin", getpid());
+    fd = fopen(textName, "w");
+    if (fd == NULL) {
+        printf("无法写入%s\n", textName);
+        return;
     }
-
-    if (rc==2) {
-        resolveTask(msg, 0);
+    start = benchNanos();
+    bench.zone = createZoneIndex();
+    for (i = 0; i < count; i++) {
+        fprintf(fd, "A\tIN\th%ld.大.教育.中国\t10.%ld.%ld.%ld\t300\n", i, (i >> 16) & 255, (i >> 8) & 255, i & 255);
+        sprintf(name, "h%ld.大.教育.中国", i);
+        memset(&rr, 0, sizeof(rr));
+        rr.name = benchDomainName(NULL, name);
+        rr.type = A_Resource_RecordType;
+        rr.class = IN_Class;
+        rr.rd_length = 4;
+        addZoneRecord(bench.zone, &rr);
+        freeDomainName(rr.name);
     }
-    else {
-        queryAsAClient(getBestMatchDomainName(taskList->name, NULL), rr);
-        free(rr->name);
-        free(rr);
+    fclose(fd);
+    printf("\n%ld条记录，建哈希索引和写文本用了%.1f秒\n", count, (benchNanos() - start) / 1e9);
+
+    for (i = 0; i < ZONE_BENCH_TARGETS; i++) {
+        //偶数是有的域名，奇数是没有的，没有的那些要一路查到最短的后缀
+        if (i % 2 == 0)
+            sprintf(name, "h%ld.大.教育.中国", (i * 2654435761u) % count);
+        else
+            sprintf(name, "m%ld.大.教育.中国", i);
+        bench.targets[i] = benchDomainName(NULL, name);
     }
-}
 
-void writeMsgHeader(struct Message* msg) {
-    //写入回复Message的header
-    msg->qr = 1; //这是一条Response
-    if (!isLocal)
-        msg->aa = 1; //此服务器权威
-    else
-        msg->aa = 0;
-    if (isRecursive) {
-        msg->rd = 1; //期望递归
-        msg->ra = 1; //能够递归
+    sprintf(name, "区域查找 哈希索引 %ld条", count);
+    runMicroBench(name, zoneBenchOp, &bench);
+    freeZoneIndex(bench.zone);
+
+    compileZoneFile(textName, imageName);
+    bench.zone = loadZoneImage(imageName, textName);
+    unlink(textName);
+    unlink(imageName);//已经映射了，删掉文件不影响
+    if (bench.zone != NULL) {
+        sprintf(name, "区域查找 二进制镜像 %ld条", count);
+        runMicroBench(name, zoneBenchOp, &bench);
+        freeZoneIndex(bench.zone);
     }
-    else {
-        msg->rd = 0;
-        msg->ra = 0;
+    for (i = 0; i < ZONE_BENCH_TARGETS; i++)
+        freeDomainName(bench.targets[i]);
+}
+
+//不带参数时区域查找测1千、10万、100万条，也可以在命令行上指定
+int runCodecBench(int argc, char* argv[]) {
+    long counts[] = { 1000, 100000, 1000000 };
+    int i;
+
+    initNameTable(&nameTable);
+    runCodecBenches();
+    if (argc > 1) {
+        for (i = 1; i < argc; i++)
+            runZoneBenches(atol(argv[i]));
+    } else {
+        for (i = 0; i < 3; i++)
+            runZoneBenches(counts[i]);
     }
-    msg->rcode = Ok_ResponseType;
-    msg->ansCount = 0;
-    msg->auCount = 0;
-    msg->adCount = 0;
+    return 0;
 }
+#endif
 
 int main(int argc, char* argv[]) {
-    if (argc != 4) {
-        printf("使用说明: %s <绑定IP> <文件前缀> <服务器类型>\n", argv[0]);
+#ifdef CODEC_BENCH
+    return runCodecBench(argc, argv);
+#endif
+    //server -c <文件前缀>：把两个区域文件编译成二进制区域文件，之后启动的服务器会直接映射它们
+    if (argc == 3 && strcmp(argv[1], "-c") == 0) {
+        unsigned char textName[BUF_SIZE];
+        unsigned char imageName[BUF_SIZE];
+        int failed = 0;
+        snprintf(textName, BUF_SIZE, "%sresolve.txt", argv[2]);
+        snprintf(imageName, BUF_SIZE, "%sresolve.bin", argv[2]);
+        failed |= compileZoneFile(textName, imageName);
+        snprintf(textName, BUF_SIZE, "%sauthorised.txt", argv[2]);
+        snprintf(imageName, BUF_SIZE, "%sauthorised.bin", argv[2]);
+        failed |= compileZoneFile(textName, imageName);
+        return failed ? 1 : 0;
+    }
+    if (argc < 4) {
+        printf("使用说明: %s <绑定IP> <文件前缀> <服务器类型> [选项]\n", argv[0]);
+        printf("      或: %s -c <文件前缀>  把解析数据库和权威服务器数据库编译成二进制区域文件\n", argv[0]);
         printf("其中，如文件前缀为“某文件”，则程序会以工作目录下的“某文件resolve.txt”为解析数据库，\n");
         printf("“某文件authorised.txt”为权威服务器数据库，“某文件cache.txt”为缓存数据库，请确保三个文件全部存在。\n");
-        printf("服务器类型：0为local服务器，1为普通服务器，2为支持递归的普通服务器");
+        printf("如果有编译好的“某文件resolve.bin”“某文件authorised.bin”，而且不比对应的txt旧，会优先映射它们。\n");
+        printf("修改或重新编译了这两个数据库以后，向服务器发送SIGHUP即可重新加载，不用重启。\n");
+        printf("服务器类型：0为local服务器，1为普通服务器，2为支持递归的普通服务器\n");
+        printf("选项：\n");
+        printf("  -m <KB>  缓存的内存上限，默认%d\n", DEFAULT_CACHE_BUDGET_KB);
+        printf("  -s <秒>  每隔多少秒把缓存写回缓存数据库，默认0为不写回\n");
+        printf("  -n <秒>  上游没有给出SOA时，解析失败的结果在负缓存里保存多久，默认%d\n", DEFAULT_NEGATIVE_TTL);
+        printf("  -t <数>  服务线程数，每个线程一个socket，0为CPU核数，默认1\n");
+        printf("  -b <数>  普通服务器每次系统调用最多收发多少个UDP报文，默认%d，最大%d\n", DEFAULT_UDP_BATCH, MAX_UDP_BATCH);
+        printf("  -v <级别>  0为不记查询日志，1为每个请求记一行（默认），2再同步打印每个收发的报文和出错信息，只用来调试\n");
+        printf("  -r <数>  每多少个请求记一条查询日志，默认1\n");
+        printf("  -o <文件>  查询日志追加写进这个文件，默认写到标准输出\n");
+        printf("  -M <端口>  在绑定IP的这个TCP端口上用HTTP提供Prometheus格式的计数和各阶段延迟直方图，默认不开\n");
+        printf("  -T <文件>  local服务器和递归服务器把问过上游的解析的每一步写成一行JSON追加进这个文件，-为标准输出，\n");
+        printf("             开了-M的话还可以用/trace?id=<请求ID>查最近%d条里的轨迹\n", TRACE_RECENT);
+        printf("  -P <百分比>  缓存记录剩下的TTL不到原来的这个百分比时，在后台提前到上游刷新，默认%d，0为不预取\n", DEFAULT_PREFETCH_PERCENT);
+        printf("  -H <次数>  缓存记录至少被查到这么多次才预取，默认%d\n", DEFAULT_PREFETCH_HITS);
         exit(1);
     }
 
-    struct timeval boot, start, end;
-    struct sockaddr_in CltAddr;
-    socklen_t AddrLen = sizeof(struct sockaddr_in);
-    struct sockaddr_in addr;
-    int sock,sockTcp,sockTcp2;
-    int port = 53;
-    int rc, rcTcp, rcListen, timeuse;
-    struct Message msg;
     unsigned char* resolveFileTemp;
     unsigned char* serverFileTemp;
     unsigned char* cacheFileTemp;
+    unsigned char* rootBytes;
+
+    size_t cacheBudget = (size_t)DEFAULT_CACHE_BUDGET_KB * 1024;
+    pthread_t snapshotThread;
+    pthread_t reloader;
+    pthread_t queryLogger;
+    pthread_t metricsServer;
+    int metricsFd;
+    char* queryLogPath = NULL;
+    char* tracePath = NULL;
+    sigset_t reloadSignals;
+    pthread_t* workers;
+    int* workerSocks;
+    int i;
 
-    uint8_t buffer[BUF_SIZE];//用于存储字节码packet的buffer
-    int bufLen;
-    uint8_t* pointerForRead;
-    uint8_t* pointerForWrite;
-    uint8_t* pointerForLength;
+    for (i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+            cacheBudget = (size_t)atol(argv[++i]) * 1024;
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            snapshotInterval = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            negativeTtl = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            threadCount = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+            udpBatchSize = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-v") == 0 && i + 1 < argc)
+            queryLogLevel = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            queryLogSample = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            queryLogPath = argv[++i];
+        else if (strcmp(argv[i], "-M") == 0 && i + 1 < argc)
+            metricsPort = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc)
+            tracePath = argv[++i];
+        else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc)
+            prefetchPercent = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-H") == 0 && i + 1 < argc)
+            prefetchMinHits = atoi(argv[++i]);
+        else
+            printf("忽略无法识别的参数：%s\n", argv[i]);
+    }
 
     resolveFileTemp = malloc(sizeof(unsigned char)*BUF_SIZE);
     memset(resolveFileTemp,0,sizeof(unsigned char)*BUF_SIZE);
@@ -1601,6 +6126,10 @@ int main(int argc, char* argv[]) {
     resolveFile = strcat(resolveFileTemp,"resolve.txt");
     serverFile = strcat(serverFileTemp,"authorised.txt");
     cacheFile = strcat(cacheFileTemp,"cache.txt");
+    resolveImageFile = malloc(strlen(argv[2]) + sizeof("authorised.bin"));
+    sprintf(resolveImageFile, "%sresolve.bin", argv[2]);
+    serverImageFile = malloc(strlen(argv[2]) + sizeof("authorised.bin"));
+    sprintf(serverImageFile, "%sauthorised.bin", argv[2]);
     switch(atoi(argv[3])) {
         case 0:
             isLocal = 1;
@@ -1623,96 +6152,77 @@ int main(int argc, char* argv[]) {
             break;
     }
 
-    gettimeofday( &boot, NULL );
-    srand(1000000*boot.tv_sec+boot.tv_usec);//用当前时间精确到微秒的数据生成随机数种子
-
-    memset(&msg, 0, sizeof(struct Message));
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = inet_addr(myIpAddr);
-    addr.sin_port = htons(port);
-
-    if (isLocal) {
-        sockTcp = socket(PF_INET, SOCK_STREAM, 0);
-        rcTcp = bind(sockTcp, (struct sockaddr *) &addr, sizeof(addr));
-        rcListen = listen(sockTcp, 100);
-        if (rcTcp != 0 || rcListen < 0) {
-            printf("TCP端口绑定失败！\n");
+    randSeed = secureRandom();
+
+    initNameTable(&nameTable);
+    //三个文件在启动时读一次，之后的查询都在内存里完成；改了resolveFile或serverFile以后发SIGHUP（kill -HUP）重新加载
+    //SIGHUP要在创建任何线程之前屏蔽掉，这样所有线程都继承这个屏蔽，只有reloadThread用sigwait收它
+    sigemptyset(&reloadSignals);
+    sigaddset(&reloadSignals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &reloadSignals, NULL);
+    resolveZone = loadZoneImage(resolveImageFile, resolveFile);
+    if (resolveZone == NULL)
+        resolveZone = loadZoneFromFile(resolveFile);
+    rootBytes = domainStr2DomainBytes("根.网络");
+    rootDomainName = domainBytes2DomainStructureFromStr(NULL, rootBytes);
+    free(rootBytes);
+    delegationTrie = loadDelegationTrie(serverFile, serverImageFile);
+    resolverCache = createResolverCache(cacheBudget);
+    loadCacheFromFile(resolverCache, cacheFile);
+    if (snapshotInterval > 0)
+        pthread_create(&snapshotThread, NULL, cacheSnapshotThread, NULL);
+
+    //每个线程一个SO_REUSEPORT的socket，由内核把请求（local服务器是新连接）分给各个线程
+    //socket先在这里全部创建好，绑定失败可以直接退出
+    if (threadCount <= 0)
+        threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    if (udpBatchSize < 1)
+        udpBatchSize = 1;
+    if (udpBatchSize > MAX_UDP_BATCH)
+        udpBatchSize = MAX_UDP_BATCH;
+    if (queryLogSample < 1)
+        queryLogSample = 1;
+    queryLogFile = stdout;
+    if (queryLogPath != NULL && queryLogLevel >= 1) {
+        queryLogFile = fopen(queryLogPath, "a");
+        if (queryLogFile == NULL) {
+            printf("无法打开查询日志%s\n", queryLogPath);
             return 1;
         }
     }
-    else {
-        sock = socket(AF_INET, SOCK_DGRAM, 0);
-        rc = bind(sock, (struct sockaddr*) &addr, AddrLen);
-        if (rc != 0) {
-            printf("UDP端口绑定失败！\n");
+    if (tracePath != NULL) {
+        traceFile = strcmp(tracePath, "-") == 0 ? stdout : fopen(tracePath, "a");
+        if (traceFile == NULL) {
+            printf("无法打开轨迹文件%s\n", tracePath);
             return 1;
         }
     }
-
-    printf("正在监听%s:%u\n", myIpAddr, port);
-
-    while (1) {
-        //清空释放所有链表
-        freeQuestions(msg.questions);
-        freeResourceRecords(msg.answers);
-        freeResourceRecords(msg.authorities);
-        freeResourceRecords(msg.additionals);
-
-        memset(&msg, 0, sizeof(struct Message));
-        memset(&buffer, 0, sizeof(buffer));
-
-        if (isLocal) {
-            sockTcp2=accept(sockTcp, (struct sockaddr *) &CltAddr, &AddrLen);
-            recv(sockTcp2, buffer, sizeof(buffer), 0);
-            pointerForRead = buffer;
-            get16bits(&pointerForRead);//跳过TCP包的前两个用于记录包总长度的字节
-        }
-        else {
-            recvfrom(sock, buffer, sizeof(buffer), 0, (struct sockaddr *) &CltAddr, &AddrLen);
-            pointerForRead = buffer;
-        }
-
-        gettimeofday( &start, NULL );//记录开始查询的时间
-        readBuffer(&msg, pointerForRead);
-        printMessage(&msg);
-
-        writeMsgHeader(&msg);
-
-        //开始解析
-        putQuestionsInMsgToTaskList(&msg);
-        while (taskList) {
-            if (isLocal || isRecursive) {
-                resolveTaskForLocalServer(&msg);
-            }
-            else {
-                resolveTask(&msg, 0);
-            }
-        }
-
-        printMessage(&msg);//打印准备好的回复
-
-        //开始将msg写入buffer
-        memset(&buffer,0,sizeof(buffer));
-
-        pointerForWrite = buffer;
-        if (isLocal) {
-            //TCP，先写入两个字节占位，等消息都写完了再回到这里来补填长度
-            put16bits(&pointerForWrite, 0);
+    workers = malloc(sizeof(pthread_t) * threadCount);
+    eventLoops = malloc(sizeof(struct EventLoop*) * threadCount);
+    workerSocks = malloc(sizeof(int) * threadCount);
+    for (i = 0; i < threadCount; i++) {
+        workerSocks[i] = openServerSocket(isLocal ? SOCK_STREAM : SOCK_DGRAM);
+        if (workerSocks[i] < 0) {
+            printf(isLocal ? "TCP端口绑定失败！\n" : "UDP端口绑定失败！\n");
+            return 1;
         }
-        writeBuffer(&msg, &pointerForWrite);
-        bufLen = pointerForWrite - buffer;
-        if (isLocal){
-            pointerForLength = buffer;
-            put16bits(&pointerForLength, bufLen-2);//回到buffer的最开始，写入2个字节的长度信息，其中减2是因为长度不包括记录长度的那两个字节自己
-            send(sockTcp2, buffer, bufLen, 0);
-            close(sockTcp2);
-        }else {
-            sendto(sock, buffer, bufLen, 0, (struct sockaddr*) &CltAddr, AddrLen);
+    }
+    printf("正在监听%s:%u，%d个线程\n", myIpAddr, DNS_PORT, threadCount);
+    pthread_create(&reloader, NULL, reloadThread, &reloadSignals);
+    if (queryLogLevel >= 1 || traceFile != NULL)
+        pthread_create(&queryLogger, NULL, queryLogThread, NULL);
+    if (metricsPort > 0) {
+        metricsFd = openMetricsSocket();
+        if (metricsFd < 0) {
+            printf("指标端口%d绑定失败！\n", metricsPort);
+            return 1;
         }
-
-        gettimeofday(&end, NULL); //记录结束时间
-        timeuse = 1000000 * ( end.tv_sec - start.tv_sec ) + end.tv_usec - start.tv_usec;//计算时间差
-        printf("time: %d us\n", timeuse);
+        pthread_create(&metricsServer, NULL, metricsThread, (void*)(long)metricsFd);
+        printf("指标在http://%s:%d/metrics\n", myIpAddr, metricsPort);
     }
+    for (i = 0; i < threadCount; i++)
+        pthread_create(&workers[i], NULL, eventLoopThread, (void*)(long)workerSocks[i]);
+    for (i = 0; i < threadCount; i++)
+        pthread_join(workers[i], NULL);
+    return 0;
 }